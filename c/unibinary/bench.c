@@ -0,0 +1,478 @@
+//
+//  bench.c
+//  unibinary
+//
+//  Throughput of the codec on generated inputs, one CSV or JSON line per profile, API and direction.
+//
+//    $ make bench && ./bench -J > bench.json
+//
+
+#include "unibinary.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+// bytes given to or taken from the streaming contexts at once
+#define BENCH_STREAM_STEP (64 * 1024)
+
+typedef struct {
+    const char *name;
+    uint8_t *data;
+    size_t len;
+    unibinary_record_t *records; // tiny records profile only, into data
+    size_t count;
+} profile_t;
+
+typedef struct {
+    const profile_t *profile;
+    const unibinary_options_t *options;
+    uint8_t *encoded;
+    size_t encoded_len;
+    size_t encoded_capacity;
+    uint8_t *decoded;
+    // records
+    size_t *offsets;
+    unibinary_record_t *encoded_records;
+} bench_t;
+
+typedef int (*bench_fn_t)(bench_t *);
+
+// xorshift64, the inputs are the same on every run and machine
+static uint64_t next_random(uint64_t *state) {
+
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+static void fill_random(uint8_t *p, size_t n, uint64_t *state) {
+
+    for(size_t i = 0; i < n; i++) p[i] = next_random(state) >> 56;
+}
+
+static void fill_text(uint8_t *p, size_t n, uint64_t *state) {
+
+    static const char *words[] = { "the", "of", "and", "UniBinary", "encodes", "data", "into", "printable", "Unicode", "characters", "1984", "x" };
+    size_t i = 0;
+
+    while(i < n) {
+        uint64_t r = next_random(state);
+        const char *word = words[r % (sizeof(words) / sizeof(words[0]))];
+        for(size_t k = 0; word[k] && i < n; k++) p[i++] = word[k];
+        if(i < n) p[i++] = (r >> 8) % 12 == 0 ? '\n' : ((r >> 8) % 12 == 1 ? '.' : ' ');
+    }
+}
+
+// binary stretches, such as machine code, between runs of zeros and of 0xFF
+static void fill_mixed(uint8_t *p, size_t n, uint64_t *state) {
+
+    size_t i = 0;
+
+    while(i < n) {
+        uint64_t r = next_random(state);
+        size_t len = 1 + r % 2000;
+        if(len > n - i) len = n - i;
+
+        switch((r >> 32) % 4) {
+            case 0: memset(p + i, 0, len); break;
+            case 1: len = len / 8 + 1; memset(p + i, 0xFF, len); break;
+            default:
+                for(size_t k = 0; k < len; k++) {
+                    uint64_t b = next_random(state);
+                    // small values dominate in machine code
+                    p[i + k] = b % 3 == 0 ? (uint8_t)(b >> 40) : (uint8_t)((b >> 40) & 0x1F);
+                }
+                break;
+        }
+
+        i += len;
+    }
+}
+
+static int make_profile(profile_t *profile, const char *name, size_t len) {
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    memset(profile, 0, sizeof(profile_t));
+    profile->name = name;
+    profile->len = len;
+    profile->data = malloc(len);
+    if(profile->data == NULL) return EXIT_FAILURE;
+
+    if(strcmp(name, "random") == 0) {
+        fill_random(profile->data, len, &state);
+    } else if (strcmp(name, "zeros") == 0) {
+        memset(profile->data, 0, len);
+    } else if (strcmp(name, "text") == 0) {
+        fill_text(profile->data, len, &state);
+    } else if (strcmp(name, "mixed") == 0) {
+        fill_mixed(profile->data, len, &state);
+    } else {
+        // records of 1 to 300 bytes, half text and half binary, laid out back to back
+        profile->records = malloc((len + 1) * sizeof(unibinary_record_t));
+        if(profile->records == NULL) return EXIT_FAILURE;
+
+        size_t i = 0;
+        while(i < len) {
+            size_t n = 1 + next_random(&state) % 300;
+            if(n > len - i) n = len - i;
+
+            if(profile->count % 2) fill_text(profile->data + i, n, &state);
+            else fill_random(profile->data + i, n, &state);
+
+            profile->records[profile->count].data = profile->data + i;
+            profile->records[profile->count].len = n;
+            profile->count++;
+            i += n;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static double now(void) {
+
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// in-memory
+
+static int encode_memory(bench_t *b) {
+    return unibinary_encode_bytes_into(b->profile->data, b->profile->len, b->options, b->encoded, b->encoded_capacity, &b->encoded_len);
+}
+
+static int decode_memory(bench_t *b) {
+
+    size_t len;
+    int status = unibinary_decode_bytes_into(b->encoded, b->encoded_len, b->decoded, b->profile->len, &len);
+
+    return status == EXIT_SUCCESS && len == b->profile->len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// FILE *, from memory to /dev/null so that only stdio and the codec are measured
+
+static int codec_file(bench_t *b, const uint8_t *in, size_t in_len, int encode) {
+
+    FILE *src = fmemopen((void *)in, in_len, "r");
+    FILE *dst = fopen("/dev/null", "w");
+    int status = EXIT_FAILURE;
+
+    if(src != NULL && dst != NULL) {
+        status = encode ? unibinary_encode_with_options(src, dst, b->options) : unibinary_decode_with_options(src, dst, b->options);
+    }
+
+    if(src != NULL) fclose(src);
+    if(dst != NULL) fclose(dst);
+
+    return status;
+}
+
+static int encode_file(bench_t *b) {
+    return codec_file(b, b->profile->data, b->profile->len, 1);
+}
+
+static int decode_file(bench_t *b) {
+    return codec_file(b, b->encoded, b->encoded_len, 0);
+}
+
+// streaming, by steps of BENCH_STREAM_STEP bytes in and out
+
+static int encode_stream(bench_t *b) {
+
+    unibinary_encoder_t encoder;
+    if(unibinary_encoder_init(&encoder, b->options) != EXIT_SUCCESS) return EXIT_FAILURE;
+
+    size_t pos = 0;
+    size_t len = 0;
+    int done = 0;
+
+    while(!done) {
+        size_t consumed = 0, produced;
+        size_t out_capacity = b->encoded_capacity - len < BENCH_STREAM_STEP ? b->encoded_capacity - len : BENCH_STREAM_STEP;
+
+        if(pos < b->profile->len) {
+            size_t in_len = b->profile->len - pos < BENCH_STREAM_STEP ? b->profile->len - pos : BENCH_STREAM_STEP;
+            unibinary_encoder_update(&encoder, b->profile->data + pos, in_len, b->encoded + len, out_capacity, &consumed, &produced);
+        } else {
+            unibinary_encoder_finish(&encoder, b->encoded + len, out_capacity, &produced, &done);
+        }
+
+        pos += consumed;
+        len += produced;
+    }
+
+    unibinary_encoder_end(&encoder);
+    b->encoded_len = len;
+
+    return EXIT_SUCCESS;
+}
+
+static int decode_stream(bench_t *b) {
+
+    unibinary_decoder_t decoder;
+    if(unibinary_decoder_init(&decoder) != EXIT_SUCCESS) return EXIT_FAILURE;
+
+    size_t pos = 0;
+    size_t len = 0;
+    int done = 0;
+    int status = EXIT_SUCCESS;
+
+    while(!done && status == EXIT_SUCCESS) {
+        size_t consumed = 0, produced;
+        size_t out_capacity = b->profile->len - len < BENCH_STREAM_STEP ? b->profile->len - len : BENCH_STREAM_STEP;
+
+        if(pos < b->encoded_len) {
+            size_t in_len = b->encoded_len - pos < BENCH_STREAM_STEP ? b->encoded_len - pos : BENCH_STREAM_STEP;
+            status = unibinary_decoder_update(&decoder, b->encoded + pos, in_len, b->decoded + len, out_capacity, &consumed, &produced);
+        } else {
+            status = unibinary_decoder_finish(&decoder, b->decoded + len, out_capacity, &produced, &done);
+        }
+
+        pos += consumed;
+        len += produced;
+    }
+
+    unibinary_decoder_end(&decoder);
+
+    return status == EXIT_SUCCESS && len == b->profile->len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// records, one call per record or one per batch
+
+static void set_encoded_records(bench_t *b) {
+
+    for(size_t i = 0; i < b->profile->count; i++) {
+        b->encoded_records[i].data = b->encoded + b->offsets[i];
+        b->encoded_records[i].len = b->offsets[i+1] - b->offsets[i];
+    }
+
+    b->encoded_len = b->offsets[b->profile->count];
+}
+
+static int encode_records(bench_t *b) {
+
+    size_t offset = 0;
+
+    for(size_t i = 0; i < b->profile->count; i++) {
+        size_t len;
+        b->offsets[i] = offset;
+        if(unibinary_encode_bytes_into(b->profile->records[i].data, b->profile->records[i].len, b->options, b->encoded + offset, b->encoded_capacity - offset, &len) != EXIT_SUCCESS) return EXIT_FAILURE;
+        offset += len;
+    }
+
+    b->offsets[b->profile->count] = offset;
+    set_encoded_records(b);
+
+    return EXIT_SUCCESS;
+}
+
+static int decode_records(bench_t *b) {
+
+    size_t offset = 0;
+
+    for(size_t i = 0; i < b->profile->count; i++) {
+        size_t len;
+        if(unibinary_decode_bytes_into(b->encoded_records[i].data, b->encoded_records[i].len, b->decoded + offset, b->profile->len - offset, &len) != EXIT_SUCCESS) return EXIT_FAILURE;
+        offset += len;
+    }
+
+    return offset == b->profile->len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int encode_batch(bench_t *b) {
+
+    if(unibinary_encode_batch(b->profile->records, b->profile->count, b->options, b->encoded, b->encoded_capacity, b->offsets, 0, NULL) != EXIT_SUCCESS) return EXIT_FAILURE;
+    set_encoded_records(b);
+
+    return EXIT_SUCCESS;
+}
+
+static int decode_batch(bench_t *b) {
+
+    size_t *offsets = malloc((b->profile->count + 1) * sizeof(size_t));
+    if(offsets == NULL) return EXIT_FAILURE;
+
+    int status = unibinary_decode_batch(b->encoded_records, b->profile->count, b->decoded, b->profile->len, offsets);
+    free(offsets);
+
+    return status;
+}
+
+// output
+
+static int json;
+static int rows;
+
+static void report(const profile_t *profile, const char *api, const char *direction, double seconds, size_t encoded_len) {
+
+    double mb_per_s = profile->len / seconds / 1e6;
+    double ns_per_record = profile->count ? seconds * 1e9 / profile->count : 0;
+
+    if(json) {
+        printf("%s\n  {\"profile\": \"%s\", \"api\": \"%s\", \"direction\": \"%s\", \"bytes\": %zu, \"encoded_bytes\": %zu, \"records\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.1f, \"ns_per_record\": %.1f}",
+               rows ? "," : "[", profile->name, api, direction, profile->len, encoded_len, profile->count, seconds, mb_per_s, ns_per_record);
+    } else {
+        if(rows == 0) printf("profile,api,direction,bytes,encoded_bytes,records,seconds,mb_per_s,ns_per_record\n");
+        printf("%s,%s,%s,%zu,%zu,%zu,%.6f,%.1f,%.1f\n", profile->name, api, direction, profile->len, encoded_len, profile->count, seconds, mb_per_s, ns_per_record);
+    }
+
+    rows++;
+}
+
+// best time of repeats runs
+static int measure(bench_fn_t fn, bench_t *b, unsigned int repeats, double *seconds) {
+
+    *seconds = 0;
+
+    for(unsigned int k = 0; k < repeats; k++) {
+        double start = now();
+        if(fn(b) != EXIT_SUCCESS) return EXIT_FAILURE;
+        double elapsed = now() - start;
+        if(k == 0 || elapsed < *seconds) *seconds = elapsed;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int run_profile(const profile_t *profile, const unibinary_options_t *options, unsigned int repeats) {
+
+    static const struct {
+        const char *api;
+        bench_fn_t encode;
+        bench_fn_t decode;
+        int records;
+    } apis[] = {
+        { "memory", encode_memory, decode_memory, 0 },
+        { "file", encode_file, decode_file, 0 },
+        { "stream", encode_stream, decode_stream, 0 },
+        { "records", encode_records, decode_records, 1 },
+        { "batch", encode_batch, decode_batch, 1 },
+    };
+
+    bench_t b = { .profile = profile, .options = options };
+    b.encoded_capacity = profile->records ? unibinary_encode_batch_max(profile->records, profile->count, options) : unibinary_encoded_length_max(profile->len, options);
+    b.encoded = malloc(b.encoded_capacity);
+    b.decoded = malloc(profile->len);
+    b.offsets = malloc((profile->count + 1) * sizeof(size_t));
+    b.encoded_records = malloc((profile->count + 1) * sizeof(unibinary_record_t));
+
+    int status = EXIT_SUCCESS;
+
+    if(b.encoded == NULL || b.decoded == NULL || b.offsets == NULL || b.encoded_records == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        status = EXIT_FAILURE;
+    }
+
+    for(size_t i = 0; i < sizeof(apis) / sizeof(apis[0]) && status == EXIT_SUCCESS; i++) {
+
+        if(apis[i].records != (profile->records != NULL)) continue;
+
+        // decoding reads what the same API encoded, except FILE * which encodes to /dev/null
+        if(apis[i].encode == encode_file) status = encode_memory(&b);
+
+        double seconds;
+        if(status == EXIT_SUCCESS) status = measure(apis[i].encode, &b, repeats, &seconds);
+        if(status == EXIT_SUCCESS) report(profile, apis[i].api, "encode", seconds, b.encoded_len);
+
+        memset(b.decoded, 0, profile->len);
+        if(status == EXIT_SUCCESS) status = measure(apis[i].decode, &b, repeats, &seconds);
+        if(status == EXIT_SUCCESS && memcmp(b.decoded, profile->data, apis[i].decode == decode_file ? 0 : profile->len) != 0) status = EXIT_FAILURE;
+        if(status == EXIT_SUCCESS) report(profile, apis[i].api, "decode", seconds, b.encoded_len);
+
+        if(status != EXIT_SUCCESS) fprintf(stderr, "-- %s %s failed\n", profile->name, apis[i].api);
+    }
+
+    free(b.encoded);
+    free(b.decoded);
+    free(b.offsets);
+    free(b.encoded_records);
+
+    return status;
+}
+
+int display_usage() {
+    printf("Usage: bench [-s num] [-r num] [-p name] [-J] [-j num] [-F num] [-o] [-k] [-h]\n");
+    printf("\n");
+    printf("Measures UniBinary encoding and decoding on generated data.\n");
+    printf("\n");
+    printf("  -s, --size      MB of data per profile, 16 by default\n");
+    printf("  -r, --repeats   best time of num runs, 3 by default\n");
+    printf("  -p, --profile   random, zeros, text, mixed or records, all by default\n");
+    printf("  -J, --json      print JSON rather than CSV\n");
+    printf("  -j, --jobs      encode or decode FILE * with num threads\n");
+    printf("  -F, --format    encode with format version num\n");
+    printf("  -o, --optimal   encode into the fewest characters of each window of input\n");
+    printf("  -k, --checksum  encode with a CRC32C of the data, checked when decoding\n");
+    printf("  -h, --help      show this help message and exit\n");
+    return EXIT_SUCCESS;
+}
+
+static const struct option long_options[] =
+{
+    { "size", required_argument, 0, 's' },
+    { "repeats", required_argument, 0, 'r' },
+    { "profile", required_argument, 0, 'p' },
+    { "json", no_argument, 0, 'J' },
+    { "jobs", required_argument, 0, 'j' },
+    { "format", required_argument, 0, 'F' },
+    { "optimal", no_argument, 0, 'o' },
+    { "checksum", no_argument, 0, 'k' },
+    { "help", no_argument, 0, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char * const argv[]) {
+
+    static const char *profiles[] = { "random", "zeros", "text", "mixed", "records" };
+
+    size_t size = 16;
+    unsigned int repeats = 3;
+    const char *only = NULL;
+    unibinary_options_t options = { 0 };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "s:r:p:Jj:F:okh", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 's': size = atoi(optarg); break;
+            case 'r': repeats = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'p': only = optarg; break;
+            case 'J': json = 1; break;
+            case 'j': options.threads = atoi(optarg); break;
+            case 'F': options.version = atoi(optarg); break;
+            case 'o': options.optimal = 1; break;
+            case 'k': options.checksum = 1; break;
+            default: return display_usage();
+        }
+    }
+
+    int status = EXIT_SUCCESS;
+
+    for(size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]) && status == EXIT_SUCCESS; i++) {
+
+        if(only != NULL && strcmp(only, profiles[i]) != 0) continue;
+
+        profile_t profile;
+        if(make_profile(&profile, profiles[i], size * 1024 * 1024) != EXIT_SUCCESS) {
+            fprintf(stderr, "-- malloc error\n");
+            status = EXIT_FAILURE;
+        } else {
+            status = run_profile(&profile, &options, repeats);
+        }
+
+        free(profile.data);
+        free(profile.records);
+    }
+
+    if(json) printf(rows ? "\n]\n" : "[]\n");
+
+    return status;
+}
@@ -7,33 +7,66 @@
 //
 
 #include "unibinary.h"
-#include <locale.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
 
 int display_usage() {
-    printf("Usage: unibinary [-ed] [-sf] [-b num] [-h]\n");
+    printf("Usage: unibinary [-edc] [-sf] [-b num] [-j num] [-z] [-F num] [-o] [-k] [-i num] [--stats] [-h]\n");
     printf("\n");
     printf("UniBinary encodes and decodes data into printable Unicode characters.\n");
     printf("\n");
     printf("  -e, --encode\n");
     printf("  -d, --decode\n");
+    printf("  -c, --check     exit with an error at the first offset which cannot be decoded, without decoding\n");
     printf("  -s, --string    to be encoded or decoded\n");
     printf("  -f, --filepath  to be encoded or decoded\n");
     printf("  -b, --break     break encoded string into num characters lines\n");
+    printf("  -j, --jobs      encode or decode with num threads, up to 64\n");
+    printf("  -z, --sparse    decode long runs of zeros as holes when writing a file\n");
+    printf("  -F, --format    encode with format version num, 2 for runs of up to 1 MB\n");
+    printf("  -o, --optimal   encode into the fewest characters of each window of input, more slowly\n");
+    printf("  -k, --checksum  encode in format 2 followed by a CRC32C of the data, which decoding checks\n");
+    printf("  -i, --index     encode in format 2 with an index of blocks of num bytes, for unibinary_decode_range()\n");
+    printf("      --stats     print the tokens, I/O and time of each phase as JSON on stderr\n");
     printf("  -h, --help      show this help message and exit\n");
     return EXIT_SUCCESS;
 }
 
+// a whole number in [min, max], else an error naming the option
+static int parse_number(const char *s, char option, long min, long max, long *value) {
+    
+    char *end;
+    errno = 0;
+    *value = strtol(s, &end, 10);
+    
+    if(errno != 0 || end == s || *end != '\0' || *value < min || *value > max) {
+        fprintf(stderr, "-- -%c takes a number from %ld to %ld\n", option, min, max);
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
 static const struct option long_options[] =
 {
     { "encode", no_argument, 0, 'e' },
     { "decode", no_argument, 0, 'd' },
+    { "check", no_argument, 0, 'c' },
     { "string", required_argument, 0, 's' },
     { "path", required_argument, 0, 'f' },
     { "break", required_argument, 0, 'b' },
+    { "jobs", required_argument, 0, 'j' },
+    { "sparse", no_argument, 0, 'z' },
+    { "format", required_argument, 0, 'F' },
+    { "optimal", no_argument, 0, 'o' },
+    { "checksum", no_argument, 0, 'k' },
+    { "index", required_argument, 0, 'i' },
+    { "stats", no_argument, 0, 'S' },
     { "help", no_argument, 0, 'h' },
     { NULL, 0, NULL, 0 }
 };
@@ -41,24 +74,39 @@ static const struct option long_options[] =
 struct global_args_t {
     short encode;
     short decode;
+    short check;
     char *string;
     const char *path;
     short wrap;
+    unsigned int threads;
+    short sparse;
+    unsigned int version;
+    short optimal;
+    short checksum;
+    size_t block_size;
+    short stats;
 } global_args;
 
+void print_stats(const unibinary_stats_t *stats) {
+    fprintf(stderr, "{\"tokens\": {\"runs\": %" PRIu64 ", \"long_runs\": %" PRIu64 ", \"run_bytes\": %" PRIu64 ", \"pairs\": %" PRIu64 ", \"triples\": %" PRIu64 ", \"singles\": %" PRIu64 ", \"newlines\": %" PRIu64 "}, ",
+            stats->runs, stats->long_runs, stats->run_bytes, stats->pairs, stats->triples, stats->singles, stats->newlines);
+    fprintf(stderr, "\"io\": {\"reads\": %" PRIu64 ", \"writes\": %" PRIu64 ", \"bytes_read\": %" PRIu64 ", \"bytes_written\": %" PRIu64 "}, ",
+            stats->reads, stats->writes, stats->bytes_read, stats->bytes_written);
+    fprintf(stderr, "\"seconds\": {\"read\": %.6f, \"codec\": %.6f, \"write\": %.6f}}\n",
+            stats->read_ns * 1e-9, stats->codec_ns * 1e-9, stats->write_ns * 1e-9);
+}
+
 int main(int argc, char * const argv[]) {
 
     //    $ echo test | ./unibinary -e | ./unibinary -d
     //    test
 
-    char *old_locale = setlocale(LC_ALL, NULL);
-    char *saved_locale = strdup(old_locale);
-    if(saved_locale == NULL) return EXIT_FAILURE;
-    
-    setlocale(LC_CTYPE, "");
+    // input and output are UTF-8 whatever the locale
     
-    static const char *opt_string = "eds:f:b:h";
+    static const char *opt_string = "edcs:f:b:j:zF:oki:h";
 
+    long number;
+    
     int opt = getopt_long( argc, argv, opt_string, long_options, NULL);
     while( opt != -1 ) {
         switch( opt ) {
@@ -68,6 +116,9 @@ int main(int argc, char * const argv[]) {
             case 'd':
                 global_args.decode = 1;
                 break;
+            case 'c':
+                global_args.check = 1;
+                break;
             case 's':
                 global_args.string = optarg;
                 break;
@@ -77,6 +128,29 @@ int main(int argc, char * const argv[]) {
             case 'b':
                 global_args.wrap = atoi(optarg);
                 break;
+            case 'j':
+                if(parse_number(optarg, 'j', 1, UNIBINARY_MAX_THREADS, &number) != EXIT_SUCCESS) goto exit_failure;
+                global_args.threads = (unsigned int)number;
+                break;
+            case 'z':
+                global_args.sparse = 1;
+                break;
+            case 'F':
+                if(parse_number(optarg, 'F', 0, UNIBINARY_MAX_VERSION, &number) != EXIT_SUCCESS) goto exit_failure;
+                global_args.version = (unsigned int)number;
+                break;
+            case 'o':
+                global_args.optimal = 1;
+                break;
+            case 'k':
+                global_args.checksum = 1;
+                break;
+            case 'i':
+                global_args.block_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                global_args.stats = 1;
+                break;
 //            case 'h':
 //                display_usage();
 //                goto exit_failure;
@@ -88,27 +162,31 @@ int main(int argc, char * const argv[]) {
         opt = getopt_long( argc, argv, opt_string, long_options, NULL);
     }
     
+    unibinary_stats_t stats = { 0 };
+    unibinary_options_t options = { .wrap_length = global_args.wrap, .threads = global_args.threads, .sparse = global_args.sparse, .version = global_args.version, .optimal = global_args.optimal, .checksum = global_args.checksum, .block_size = global_args.block_size, .stats = global_args.stats ? &stats : NULL };
+    
     if(global_args.encode) {
         // encode
         
         if(global_args.string != NULL) {
             // encode string
-            wchar_t *wcs;
-            unibinary_encode_string(global_args.string, &wcs, global_args.wrap);
-            fwprintf(stdout, wcs);
-            free(wcs);
+            uint8_t *encoded;
+            size_t encoded_len;
+            int status = unibinary_encode_bytes((const uint8_t *)global_args.string, strlen(global_args.string), &options, &encoded, &encoded_len);
+            if(status != 0) goto exit_failure;
+            
+            size_t written = fwrite(encoded, 1, encoded_len, stdout);
+            free(encoded);
+            
+            if(written != encoded_len) goto exit_failure;
         } else if (global_args.path != NULL) {
             // encode path
-            FILE *fd_in = fopen(global_args.path, "rb");
-            if(fd_in == NULL) goto exit_failure;
-            
-            int status = unibinary_encode(fd_in, stdout, global_args.wrap);
-            fclose(fd_in);
+            int status = unibinary_encode_path(global_args.path, STDOUT_FILENO, &options);
             
             if(status != 0) goto exit_failure;
         } else {
             // encode stdin
-            int status = unibinary_encode(stdin, stdout, global_args.wrap);
+            int status = unibinary_encode_fd(STDIN_FILENO, STDOUT_FILENO, &options);
             if(status != 0) goto exit_failure;
         }
     } else if (global_args.decode) {
@@ -116,14 +194,11 @@ int main(int argc, char * const argv[]) {
         
         if(global_args.string != NULL) {
             // decode string
-            size_t max_wchar_bytes = strlen(global_args.string) * MB_CUR_MAX;
-            wchar_t wcsout[max_wchar_bytes];
-            size_t nb_wc = mbstowcs(wcsout, global_args.string, max_wchar_bytes);
-            if(nb_wc == -1) goto exit_failure;
+            uint8_t *data;
+            size_t dst_len;
+            int status = unibinary_decode_bytes_with_options((const uint8_t *)global_args.string, strlen(global_args.string), &options, &data, &dst_len);
+            if(status != 0) goto exit_failure;
             
-            char* data;
-            long dst_len;
-            unibinary_decode_string(wcsout, &data, &dst_len);
             size_t written = fwrite(data, sizeof(char), dst_len, stdout);
             free(data);
             
@@ -131,20 +206,37 @@ int main(int argc, char * const argv[]) {
         
         } else if (global_args.path != NULL) {
             // decode path
-            FILE *fd_in = fopen(global_args.path, "rb");
-            if(fd_in == NULL) goto exit_failure;
-            
-            int status = unibinary_decode(fd_in, stdout);
-            fclose(fd_in);
+            int status = unibinary_decode_path(global_args.path, STDOUT_FILENO, &options);
             
             if(status != 0) goto exit_failure;
         } else {
             // decode stdin
-            int status = unibinary_decode(stdin, stdout);
+            int status = unibinary_decode_fd(STDIN_FILENO, STDOUT_FILENO, &options);
             if(status != 0) goto exit_failure;
 
         }
         
+    } else if (global_args.check) {
+        // check
+        
+        size_t offset;
+        int status;
+        
+        if(global_args.string != NULL) {
+            status = unibinary_validate((const uint8_t *)global_args.string, strlen(global_args.string), &offset);
+        } else if (global_args.path != NULL) {
+            int fd = open(global_args.path, O_RDONLY);
+            if(fd < 0) goto exit_failure;
+            status = unibinary_validate_fd(fd, &offset);
+            close(fd);
+        } else {
+            status = unibinary_validate_fd(STDIN_FILENO, &offset);
+        }
+        
+        if(status != 0) {
+            fprintf(stderr, "-- invalid UniBinary text at offset %zu\n", offset);
+            goto exit_failure;
+        }
     } else {
         display_usage();
     }
@@ -155,19 +247,15 @@ int main(int argc, char * const argv[]) {
             fflush(stdout);
             fprintf(stderr, "\n");
         }
+        
+        if(global_args.stats) print_stats(&stats);
     }
     
     goto exit_success;
 
 exit_success:
-    setlocale(LC_ALL, saved_locale);
-    free(saved_locale);
-    
     return EXIT_SUCCESS;
 
 exit_failure:
-    setlocale(LC_ALL, saved_locale);
-    free(saved_locale);
-    
     return EXIT_FAILURE;
 }
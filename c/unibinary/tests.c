@@ -9,9 +9,13 @@
 #include "unibinary.h"
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 #include <locale.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 int number_of_repeated_characters_at_index(const char* src, size_t i, size_t srcSize, int *n);
 int unichr_12a_from_two_ascii(unsigned char c0, unsigned char c1, wchar_t *u0);
@@ -22,7 +26,8 @@ int to_U12(wchar_t i, wchar_t *o);
 int from_U12b(wchar_t i, wchar_t *o);
 int is_in_U08b(wchar_t i);
 int is_in_U12a(wchar_t i);
-int bytes_from_u1_u2(wchar_t u1, wchar_t u2, uint8_t **buffer, size_t *bufferSize);
+int bytes_from_u1_u2(wchar_t u1, wchar_t u2, uint8_t **cursor);
+int repeated_bytes_from_unichars(wchar_t u1, wchar_t u2, uint8_t **cursor);
 int U12a_to_8_8(wchar_t u, uint8_t *b0, uint8_t *b1);
 int two_bytes_from_unichars(wchar_t u1, wchar_t u2, uint8_t *b1, uint8_t *b2);
 int three_bytes_from_unichars(wchar_t u1, wchar_t u2, uint8_t *b1, uint8_t *b2, uint8_t *b3);
@@ -408,13 +413,13 @@ void test_repeats_2() {
     
     FILE *fd_in3 = fopen("/tmp/test_repeats_2", "rb");
     
-    assert(fgetwc(fd_in) == 0x58BC);
-    assert(fgetwc(fd_in) == 0x5BEF);
-    assert(fgetwc(fd_in) == 0x04FF);
-    assert(fgetwc(fd_in) == 0x4E04);
-    assert(fgetwc(fd_in) == 0x0400);
+    assert(fgetwc(fd_in3) == 0x58BC);
+    assert(fgetwc(fd_in3) == 0x5BEF);
+    assert(fgetwc(fd_in3) == 0x04FF);
+    assert(fgetwc(fd_in3) == 0x4E04);
+    assert(fgetwc(fd_in3) == 0x0400);
     
-    assert(fgetwc(fd_in) == WEOF);
+    assert(fgetwc(fd_in3) == WEOF);
     
     fclose(fd_in3);
 }
@@ -444,9 +449,9 @@ void test_one_char() {
     
     FILE *fd_in3 = fopen("/tmp/test_one_char", "rb");
     
-    assert(fgetwc(fd_in) == 0x0461);
+    assert(fgetwc(fd_in3) == 0x0461);
     
-    assert(fgetwc(fd_in) == WEOF);
+    assert(fgetwc(fd_in3) == WEOF);
     
     fclose(fd_in3);
 }
@@ -474,7 +479,7 @@ void test_empty_string() {
     /**/
     
     FILE *fd_in3 = fopen("/tmp/test_empty_string", "rb");
-    assert(fgetwc(fd_in) == WEOF);
+    assert(fgetwc(fd_in3) == WEOF);
     fclose(fd_in3);
 }
 
@@ -519,12 +524,12 @@ void test_big_repeats_2000_minus_2() {
     
     FILE *fd_in3 = fopen("/tmp/test_big_repeats_2000_minus_2", "rb");
     
-    assert(fgetwc(fd_in) == 0x04AA);
-    assert(fgetwc(fd_in) == 0x5DFF);
-    assert(fgetwc(fd_in) == 0x04AA);
-    assert(fgetwc(fd_in) == 0x5DFF);
+    assert(fgetwc(fd_in3) == 0x04AA);
+    assert(fgetwc(fd_in3) == 0x5DFF);
+    assert(fgetwc(fd_in3) == 0x04AA);
+    assert(fgetwc(fd_in3) == 0x5DFF);
     
-    assert(fgetwc(fd_in) == WEOF);
+    assert(fgetwc(fd_in3) == WEOF);
     
     fclose(fd_in3);
 }
@@ -558,14 +563,14 @@ void test_big_repeats_2000() {
     
     FILE *fd_in3 = fopen("/tmp/test_big_repeats_2000", "rb");
     
-    assert(fgetwc(fd_in) == 0x04AA);
-    assert(fgetwc(fd_in) == 0x5DFF);
-    assert(fgetwc(fd_in) == 0x04AA);
-    assert(fgetwc(fd_in) == 0x5DFF);
-    assert(fgetwc(fd_in) == 0x04AA);
-    assert(fgetwc(fd_in) == 0x04AA);
+    assert(fgetwc(fd_in3) == 0x04AA);
+    assert(fgetwc(fd_in3) == 0x5DFF);
+    assert(fgetwc(fd_in3) == 0x04AA);
+    assert(fgetwc(fd_in3) == 0x5DFF);
+    assert(fgetwc(fd_in3) == 0x04AA);
+    assert(fgetwc(fd_in3) == 0x04AA);
     
-    assert(fgetwc(fd_in) == WEOF);
+    assert(fgetwc(fd_in3) == WEOF);
     
     fclose(fd_in3);
 }
@@ -688,10 +693,10 @@ void test_repeat() {
     
     FILE *fd_in3 = fopen("/tmp/test_repeat", "rb");
     
-    assert(fgetwc(fd_in) == 0x0478);
-    assert(fgetwc(fd_in) == 0x4E03);
+    assert(fgetwc(fd_in3) == 0x0478);
+    assert(fgetwc(fd_in3) == 0x4E03);
     
-    assert(fgetwc(fd_in) == WEOF);
+    assert(fgetwc(fd_in3) == WEOF);
     
     fclose(fd_in3);
 }
@@ -704,6 +709,34 @@ void test_string_encoding() {
     
     assert(wcscmp(wcs, L"\u9B25\u9AF4") == 0);
     free(wcs);
+    
+    // the characters of unibinary_encode_bytes() with the same options
+    unibinary_options_t options = { .wrap_length = 2, .checksum = 1, .block_size = 3 };
+    assert(unibinary_encode_string_with_options("test\xff", &wcs, &options) == EXIT_SUCCESS);
+    uint8_t *encoded;
+    size_t encoded_len;
+    assert(unibinary_encode_bytes((const uint8_t *)"test\xff", 5, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    assert(wcs[0] == 0x9E07 && wcs[2] == L'\n');
+    
+    size_t j = 0;
+    for(size_t i = 0; i < encoded_len; j++) {
+        wchar_t u = encoded[i] < 0x80 ? encoded[i] : (encoded[i] < 0xE0 ? ((encoded[i] & 0x1F) << 6) | (encoded[i+1] & 0x3F) : ((encoded[i] & 0x0F) << 12) | ((encoded[i+1] & 0x3F) << 6) | (encoded[i+2] & 0x3F));
+        assert(wcs[j] == u);
+        i += encoded[i] < 0x80 ? 1 : (encoded[i] < 0xE0 ? 2 : 3);
+    }
+    assert(wcs[j] == L'\0');
+    
+    char *data;
+    long data_len;
+    assert(unibinary_decode_string(wcs, &data, &data_len) == EXIT_SUCCESS);
+    assert(data_len == 5 && memcmp(data, "test\xff", 5) == 0);
+    free(data);
+    free(encoded);
+    free(wcs);
+    
+    options = (unibinary_options_t){ .block_size = 0x1000000 };
+    assert(unibinary_encode_string_with_options("test", &wcs, &options) == EXIT_FAILURE);
+    assert(wcs == NULL);
 }
 
 void test_string_decoding() {
@@ -728,12 +761,2107 @@ void test_string_decoding_with_newline() {
     free(data);
 }
 
+void test_encode_buffer_chunks() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // runs, ASCII and high bytes, split at every possible carry-over
+    size_t SIZE = 3 * 0x1000;
+    uint8_t *src = malloc(SIZE);
+    srand(42);
+    for(size_t i = 0; i < SIZE; i++) {
+        src[i] = (i > 0x100 && i < 0x1300) ? 0xAA : (rand() % 3 == 0 ? rand() % 128 : rand() % 256);
+    }
+    
+    wchar_t *whole = malloc(UNIBINARY_ENCODED_MAX_LENGTH(SIZE) * sizeof(wchar_t));
+    size_t whole_used, whole_len;
+    assert(unibinary_encode_buffer(src, SIZE, 1, whole, &whole_used, &whole_len) == EXIT_SUCCESS);
+    assert(whole_used == SIZE);
+    
+    wchar_t *chunked = malloc(UNIBINARY_ENCODED_MAX_LENGTH(SIZE) * sizeof(wchar_t));
+    
+    size_t chunk_sizes[] = {1, 2, 3, 7, 100, 0x1000};
+    for(size_t k = 0; k < sizeof(chunk_sizes) / sizeof(size_t); k++) {
+        size_t start = 0;
+        size_t available = 0;
+        size_t chunked_len = 0;
+        
+        while(1) {
+            available = available + chunk_sizes[k] > SIZE - start ? SIZE - start : available + chunk_sizes[k];
+            int is_last = start + available == SIZE;
+            
+            size_t used, len;
+            assert(unibinary_encode_buffer(src + start, available, is_last, chunked + chunked_len, &used, &len) == EXIT_SUCCESS);
+            chunked_len += len;
+            start += used;
+            available -= used;
+            
+            if(is_last) break;
+        }
+        
+        assert(start == SIZE);
+        assert(chunked_len == whole_len);
+        assert(wmemcmp(chunked, whole, whole_len) == 0);
+    }
+    
+    free(src);
+    free(whole);
+    free(chunked);
+}
+
+void test_encode_buffer_utf8() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // "test" -> U+9B25 U+9AF4, 'a' -> U+0461
+    const uint8_t *src = (const uint8_t *)"testa";
+    uint8_t dst[UNIBINARY_ENCODED_MAX_UTF8_LENGTH(5)];
+    
+    size_t used, len;
+    int status = unibinary_encode_buffer_utf8(src, 5, 1, dst, &used, &len);
+    assert(status == EXIT_SUCCESS);
+    assert(used == 5);
+    assert(len == 8);
+    assert(memcmp(dst, "\xE9\xAC\xA5\xE9\xAB\xB4\xD1\xA1", 8) == 0);
+    
+    // the trailing 'a' waits for more bytes
+    status = unibinary_encode_buffer_utf8(src, 5, 0, dst, &used, &len);
+    assert(status == EXIT_SUCCESS);
+    assert(used == 4);
+    assert(len == 6);
+}
+
+void test_decode_buffer() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // "test", newline, 0xABCDEF, 'a' repeated 10 times, 'a'
+    const char *src = "\xE9\xAC\xA5\xE9\xAB\xB4\n\xE5\xA2\xBC\xE5\xAF\xAF\xD1\xA1\xE4\xB8\x8A\xD1\xA1";
+    const char *expected = "test\xAB\xCD\xEF" "aaaaaaaaaa" "a";
+    size_t src_len = strlen(src);
+    size_t expected_len = strlen(expected);
+    
+    uint8_t dst[64];
+    size_t used, len;
+    int status = unibinary_decode_buffer((const uint8_t *)src, src_len, 1, dst, sizeof(dst), &used, &len);
+    assert(status == EXIT_SUCCESS);
+    assert(used == src_len);
+    assert(len == expected_len);
+    assert(memcmp(dst, expected, len) == 0);
+    
+    // byte by byte, the truncated characters and tokens are left for the next call
+    size_t start = 0;
+    size_t available = 0;
+    size_t dst_len = 0;
+    while(start + available < src_len) {
+        available += 1;
+        int is_last = start + available == src_len;
+        status = unibinary_decode_buffer((const uint8_t *)src + start, available, is_last, dst + dst_len, sizeof(dst) - dst_len, &used, &len);
+        assert(status == EXIT_SUCCESS);
+        start += used;
+        available -= used;
+        dst_len += len;
+    }
+    assert(start == src_len);
+    assert(dst_len == expected_len);
+    assert(memcmp(dst, expected, dst_len) == 0);
+    
+    // a lone U12b character, the error is reported at its offset
+    status = unibinary_decode_buffer((const uint8_t *)src, 10, 1, dst, sizeof(dst), &used, &len);
+    assert(status == EXIT_FAILURE);
+    assert(used == 7);
+    assert(len == 4);
+}
+
+void test_bytes_from_u1_u2() {
+    
+    printf("== %s ==\n", __func__);
+    
+    uint8_t buffer[0x1000 + 8];
+    uint8_t *cursor = buffer;
+    
+    assert(bytes_from_u1_u2(0x58BC, 0x5BEF, &cursor) == EXIT_SUCCESS);
+    assert(cursor == buffer + 3);
+    assert(buffer[0] == 0xAB && buffer[1] == 0xCD && buffer[2] == 0xEF);
+    
+    assert(bytes_from_u1_u2(0x04AB, 0x04CD, &cursor) == EXIT_SUCCESS);
+    assert(cursor == buffer + 5);
+    assert(buffer[3] == 0xAB && buffer[4] == 0xCD);
+    
+    // RLE runs are written straight at the cursor
+    assert(repeated_bytes_from_unichars(0x04AA, 0x5DFF, &cursor) == EXIT_SUCCESS);
+    assert(cursor == buffer + 5 + 0xFFF);
+    assert(buffer[5] == 0xAA && buffer[5 + 0xFFE] == 0xAA);
+    
+    assert(bytes_from_u1_u2(0x0461, '\n', &cursor) == EXIT_SUCCESS);
+    assert(cursor == buffer + 5 + 0xFFF + 1);
+    
+    // U12b then U8 is not a token, nothing is written
+    uint8_t *before = cursor;
+    assert(bytes_from_u1_u2(0x58BC, 0x0461, &cursor) == EXIT_FAILURE);
+    assert(cursor == before);
+}
+
+void test_encode_buffer_utf8_matches_wide() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // high bytes go through the vectorized 3 bytes path when available, ASCII and runs break it
+    size_t SIZE = 0x4000;
+    uint8_t *src = malloc(SIZE);
+    wchar_t *wide = malloc(UNIBINARY_ENCODED_MAX_LENGTH(SIZE) * sizeof(wchar_t));
+    uint8_t *utf8 = malloc(UNIBINARY_ENCODED_MAX_UTF8_LENGTH(SIZE));
+    uint8_t *expected = malloc(UNIBINARY_ENCODED_MAX_UTF8_LENGTH(SIZE));
+    
+    srand(7);
+    for(int pattern = 0; pattern < 3; pattern++) {
+        for(size_t i = 0; i < SIZE; i++) {
+            uint8_t b = 0x80 | rand();
+            if(pattern == 1 && rand() % 50 == 0) b = rand() % 128;
+            if(pattern == 2 && i > 0 && rand() % 50 == 0) b = src[i-1];
+            src[i] = b;
+        }
+        
+        for(size_t len = SIZE - 40; len <= SIZE; len++) {
+            size_t used, wide_len, utf8_len;
+            assert(unibinary_encode_buffer(src, len, 1, wide, &used, &wide_len) == EXIT_SUCCESS);
+            assert(unibinary_encode_buffer_utf8(src, len, 1, utf8, &used, &utf8_len) == EXIT_SUCCESS);
+            
+            uint8_t *e = expected;
+            for(size_t i = 0; i < wide_len; i++) {
+                wchar_t u = wide[i];
+                if(u < 0x800) {
+                    *e++ = 0xC0 | (u >> 6);
+                } else {
+                    *e++ = 0xE0 | (u >> 12);
+                    *e++ = 0x80 | ((u >> 6) & 0x3F);
+                }
+                *e++ = 0x80 | (u & 0x3F);
+            }
+            
+            assert(utf8_len == (size_t)(e - expected));
+            assert(memcmp(utf8, expected, utf8_len) == 0);
+        }
+    }
+    
+    free(src);
+    free(wide);
+    free(utf8);
+    free(expected);
+}
+
+void test_encode_buffer_prescan_matches_scalar() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // windows of less than 65 bytes are encoded without the masks pre-scan
+    size_t SIZE = 0x4000;
+    uint8_t *src = malloc(SIZE);
+    uint8_t *whole = malloc(UNIBINARY_ENCODED_MAX_UTF8_LENGTH(SIZE));
+    uint8_t *pieces = malloc(UNIBINARY_ENCODED_MAX_UTF8_LENGTH(SIZE));
+    
+    srand(11);
+    for(int pattern = 0; pattern < 3; pattern++) {
+        for(size_t i = 0; i < SIZE; ) {
+            uint8_t b = 'a' + rand() % 26;
+            if(rand() % 20 == 0) b = 0x80 | rand();
+            size_t n = 1;
+            if(pattern >= 1 && rand() % 4 == 0) n = 2 + rand() % 5;
+            if(pattern == 2 && rand() % 200 == 0) n = 0x80 + rand() % 0x100;
+            if(n > SIZE - i) n = SIZE - i;
+            memset(src + i, b, n);
+            i += n;
+        }
+        
+        size_t used, whole_len;
+        assert(unibinary_encode_buffer_utf8(src, SIZE, 1, whole, &used, &whole_len) == EXIT_SUCCESS);
+        assert(used == SIZE);
+        
+        size_t offset = 0;
+        size_t pieces_len = 0;
+        while(offset < SIZE) {
+            size_t len = SIZE - offset < 64 ? SIZE - offset : 64;
+            int is_last = offset + len == SIZE;
+            size_t dst_len;
+            assert(unibinary_encode_buffer_utf8(src + offset, len, is_last, pieces + pieces_len, &used, &dst_len) == EXIT_SUCCESS);
+            if(used == 0) {
+                // a run going past the piece, encoded on its own
+                size_t n = 0;
+                while(offset + n < SIZE && src[offset + n] == src[offset]) n++;
+                assert(unibinary_encode_buffer_utf8(src + offset, n < 0xFFF ? n : 0xFFF, 1, pieces + pieces_len, &used, &dst_len) == EXIT_SUCCESS);
+            }
+            offset += used;
+            pieces_len += dst_len;
+        }
+        
+        assert(pieces_len == whole_len);
+        assert(memcmp(pieces, whole, whole_len) == 0);
+    }
+    
+    free(src);
+    free(whole);
+    free(pieces);
+}
+
+void test_decode_buffer_u12b_runs() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // high bytes only, so almost only U12b U12b tokens, with newlines and a few U8 in between
+    size_t SIZE = 0x3000;
+    uint8_t *src = malloc(SIZE);
+    uint8_t *encoded = malloc(UNIBINARY_ENCODED_MAX_UTF8_LENGTH(SIZE));
+    uint8_t *wrapped = malloc(2 * UNIBINARY_ENCODED_MAX_UTF8_LENGTH(SIZE));
+    uint8_t *decoded = malloc(SIZE);
+    
+    srand(11);
+    for(size_t i = 0; i < SIZE; i++) {
+        src[i] = (i % 1000 == 999) ? 'x' : 0x80 | rand();
+    }
+    
+    size_t used, encoded_len;
+    assert(unibinary_encode_buffer_utf8(src, SIZE, 1, encoded, &used, &encoded_len) == EXIT_SUCCESS);
+    
+    size_t wrapped_len = 0;
+    for(size_t i = 0; i < encoded_len; i++) {
+        if((encoded[i] & 0xC0) != 0x80 && rand() % 37 == 0) wrapped[wrapped_len++] = '\n';
+        wrapped[wrapped_len++] = encoded[i];
+    }
+    
+    // small output buffers stop the runs before their end
+    size_t capacities[] = {SIZE, 17, 5};
+    for(size_t k = 0; k < 3; k++) {
+        size_t start = 0;
+        size_t decoded_len = 0;
+        while(start < wrapped_len) {
+            size_t capacity = capacities[k] < SIZE - decoded_len ? capacities[k] : SIZE - decoded_len;
+            size_t len;
+            assert(unibinary_decode_buffer(wrapped + start, wrapped_len - start, 1, decoded + decoded_len, capacity, &used, &len) == EXIT_SUCCESS);
+            assert(used > 0 || len > 0);
+            start += used;
+            decoded_len += len;
+        }
+        assert(decoded_len == SIZE);
+        assert(memcmp(decoded, src, SIZE) == 0);
+    }
+    
+    // an invalid character in the middle of a run
+    memcpy(wrapped, encoded, encoded_len);
+    wrapped[300] = 0xFF;
+    size_t len;
+    assert(unibinary_decode_buffer(wrapped, encoded_len, 1, decoded, SIZE, &used, &len) == EXIT_FAILURE);
+    assert(used <= 300 && used + 3 > 300);
+    
+    free(src);
+    free(encoded);
+    free(wrapped);
+    free(decoded);
+}
+
+void test_encode_with_options_threads() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // several batches of 1 MB per thread, with splits in runs, in ASCII and in high entropy data
+    size_t SIZE = 7 * 1024 * 1024 + 5;
+    uint8_t *src = malloc(SIZE);
+    
+    srand(13);
+    for(size_t i = 0; i < SIZE; ) {
+        size_t n = 1 + rand() % 200000;
+        if(n > SIZE - i) n = SIZE - i;
+        int kind = rand() % 3;
+        for(size_t j = 0; j < n; j++) {
+            if(kind == 0) src[i+j] = 0;
+            if(kind == 1) src[i+j] = 'a' + rand() % 8;
+            if(kind == 2) src[i+j] = rand();
+        }
+        i += n;
+    }
+    
+    FILE *fd_in = tmpfile();
+    assert(fwrite(src, 1, SIZE, fd_in) == SIZE);
+    
+    for(size_t wrap_length = 0; wrap_length < 100; wrap_length += 77) {
+        
+        rewind(fd_in);
+        FILE *fd_serial = tmpfile();
+        unibinary_options_t serial = { .wrap_length = wrap_length, .threads = 1 };
+        assert(unibinary_encode_with_options(fd_in, fd_serial, &serial) == EXIT_SUCCESS);
+        
+        rewind(fd_in);
+        FILE *fd_parallel = tmpfile();
+        unibinary_options_t parallel = { .wrap_length = wrap_length, .threads = 3 };
+        assert(unibinary_encode_with_options(fd_in, fd_parallel, &parallel) == EXIT_SUCCESS);
+        
+        long len = ftell(fd_serial);
+        assert(len == ftell(fd_parallel));
+        
+        uint8_t *expected = malloc(len);
+        uint8_t *output = malloc(len);
+        rewind(fd_serial);
+        rewind(fd_parallel);
+        assert(fread(expected, 1, len, fd_serial) == (size_t)len);
+        assert(fread(output, 1, len, fd_parallel) == (size_t)len);
+        assert(memcmp(expected, output, len) == 0);
+        
+        free(expected);
+        free(output);
+        fclose(fd_serial);
+        fclose(fd_parallel);
+    }
+    
+    fclose(fd_in);
+    free(src);
+}
+
+void test_decode_with_options_threads() {
+    
+    printf("== %s ==\n", __func__);
+    
+    size_t SIZE = 7 * 1024 * 1024 + 5;
+    uint8_t *src = malloc(SIZE);
+    
+    srand(17);
+    for(size_t i = 0; i < SIZE; ) {
+        size_t n = 1 + rand() % 200000;
+        if(n > SIZE - i) n = SIZE - i;
+        int kind = rand() % 3;
+        for(size_t j = 0; j < n; j++) {
+            if(kind == 0) src[i+j] = 0;
+            if(kind == 1) src[i+j] = 'a' + rand() % 8;
+            if(kind == 2) src[i+j] = 0x80 | rand();
+        }
+        i += n;
+    }
+    
+    FILE *fd_in = tmpfile();
+    assert(fwrite(src, 1, SIZE, fd_in) == SIZE);
+    rewind(fd_in);
+    
+    FILE *fd_encoded = tmpfile();
+    unibinary_options_t options = { .wrap_length = 77, .threads = 3 };
+    assert(unibinary_encode_with_options(fd_in, fd_encoded, &options) == EXIT_SUCCESS);
+    
+    // written in place into a regular file
+    rewind(fd_encoded);
+    FILE *fd_decoded = tmpfile();
+    assert(unibinary_decode_with_options(fd_encoded, fd_decoded, &options) == EXIT_SUCCESS);
+    assert(ftell(fd_decoded) == (long)SIZE);
+    
+    uint8_t *decoded = malloc(SIZE);
+    rewind(fd_decoded);
+    assert(fread(decoded, 1, SIZE, fd_decoded) == SIZE);
+    assert(memcmp(src, decoded, SIZE) == 0);
+    
+    // written in order into a stream without a file descriptor
+    rewind(fd_encoded);
+    char *memory;
+    size_t memory_len;
+    FILE *fd_memory = open_memstream(&memory, &memory_len);
+    assert(unibinary_decode_with_options(fd_encoded, fd_memory, &options) == EXIT_SUCCESS);
+    fclose(fd_memory);
+    assert(memory_len == SIZE);
+    assert(memcmp(src, memory, SIZE) == 0);
+    free(memory);
+    
+    // more threads than UNIBINARY_MAX_THREADS are capped, the same output
+    options.threads = (unsigned int)-1;
+    rewind(fd_in);
+    FILE *fd_capped = tmpfile();
+    assert(unibinary_encode_with_options(fd_in, fd_capped, &options) == EXIT_SUCCESS);
+    assert(ftell(fd_capped) == ftell(fd_encoded));
+    rewind(fd_capped);
+    fd_memory = open_memstream(&memory, &memory_len);
+    assert(unibinary_decode_with_options(fd_capped, fd_memory, &options) == EXIT_SUCCESS);
+    fclose(fd_memory);
+    assert(memory_len == SIZE && memcmp(src, memory, SIZE) == 0);
+    free(memory);
+    fclose(fd_capped);
+    
+    // an invalid character stops both decoders at the same place
+    fseek(fd_encoded, 5000001, SEEK_SET);
+    fputc('A', fd_encoded);
+    
+    rewind(fd_encoded);
+    FILE *fd_serial = tmpfile();
+    options.threads = 1;
+    assert(unibinary_decode_with_options(fd_encoded, fd_serial, &options) == EXIT_FAILURE);
+    
+    rewind(fd_encoded);
+    FILE *fd_parallel = tmpfile();
+    options.threads = 3;
+    assert(unibinary_decode_with_options(fd_encoded, fd_parallel, &options) == EXIT_FAILURE);
+    
+    assert(ftell(fd_serial) == ftell(fd_parallel));
+    
+    fclose(fd_in);
+    fclose(fd_encoded);
+    fclose(fd_decoded);
+    fclose(fd_serial);
+    fclose(fd_parallel);
+    free(src);
+    free(decoded);
+}
+
+void test_encode_decode_path() {
+    
+    printf("== %s ==\n", __func__);
+    
+    size_t SIZE = 3 * 1024 * 1024 + 1;
+    uint8_t *src = malloc(SIZE);
+    srand(19);
+    for(size_t i = 0; i < SIZE; i++) {
+        src[i] = i % 5000 < 100 ? 0 : (i % 3 ? 'a' + rand() % 26 : rand());
+    }
+    
+    char src_path[] = "/tmp/unibinary_src_XXXXXX";
+    char encoded_path[] = "/tmp/unibinary_encoded_XXXXXX";
+    int fd_src = mkstemp(src_path);
+    int fd_encoded = mkstemp(encoded_path);
+    assert(fd_src >= 0 && fd_encoded >= 0);
+    assert(write(fd_src, src, SIZE) == (ssize_t)SIZE);
+    
+    unibinary_options_t options = { .wrap_length = 64, .threads = 1 };
+    assert(unibinary_encode_path(src_path, fd_encoded, &options) == EXIT_SUCCESS);
+    
+    // same output as the stdio encoder
+    FILE *fd_in = fopen(src_path, "rb");
+    FILE *fd_expected = tmpfile();
+    assert(unibinary_encode_with_options(fd_in, fd_expected, &options) == EXIT_SUCCESS);
+    
+    long len = ftell(fd_expected);
+    assert(lseek(fd_encoded, 0, SEEK_CUR) == len);
+    
+    uint8_t *expected = malloc(len);
+    uint8_t *encoded = malloc(len);
+    rewind(fd_expected);
+    assert(fread(expected, 1, len, fd_expected) == (size_t)len);
+    assert(pread(fd_encoded, encoded, len, 0) == len);
+    assert(memcmp(expected, encoded, len) == 0);
+    
+    FILE *fd_decoded = tmpfile();
+    assert(unibinary_decode_path(encoded_path, fileno(fd_decoded), &options) == EXIT_SUCCESS);
+    
+    uint8_t *decoded = malloc(SIZE);
+    assert(pread(fileno(fd_decoded), decoded, SIZE, 0) == (ssize_t)SIZE);
+    assert(memcmp(src, decoded, SIZE) == 0);
+    
+    fclose(fd_in);
+    fclose(fd_expected);
+    fclose(fd_decoded);
+    close(fd_src);
+    close(fd_encoded);
+    unlink(src_path);
+    unlink(encoded_path);
+    free(src);
+    free(expected);
+    free(encoded);
+    free(decoded);
+}
+
+void test_encode_decode_bytes() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // NUL bytes, ASCII, runs and high bytes
+    uint8_t src[1000];
+    srand(23);
+    for(size_t i = 0; i < sizeof(src); i++) {
+        src[i] = i < 10 ? 0 : (i % 2 ? 'a' + rand() % 26 : rand());
+    }
+    
+    for(size_t len = 0; len < sizeof(src); len += 37) {
+        for(size_t wrap_length = 0; wrap_length < 10; wrap_length += 3) {
+            unibinary_options_t options = { .wrap_length = wrap_length };
+            
+            uint8_t *encoded;
+            size_t encoded_len;
+            assert(unibinary_encode_bytes(src, len, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+            assert(encoded[encoded_len] == '\0');
+            
+            // same as the stdio encoder
+            FILE *fd_in = tmpfile();
+            FILE *fd_out = tmpfile();
+            fwrite(src, 1, len, fd_in);
+            rewind(fd_in);
+            assert(unibinary_encode_with_options(fd_in, fd_out, &options) == EXIT_SUCCESS);
+            assert(ftell(fd_out) == (long)encoded_len);
+            
+            uint8_t expected[UNIBINARY_ENCODED_MAX_UTF8_WRAPPED_LENGTH(sizeof(src), 3)];
+            rewind(fd_out);
+            assert(fread(expected, 1, encoded_len, fd_out) == encoded_len);
+            assert(memcmp(expected, encoded, encoded_len) == 0);
+            fclose(fd_in);
+            fclose(fd_out);
+            
+            uint8_t *decoded;
+            size_t decoded_len;
+            assert(unibinary_decode_bytes(encoded, encoded_len, &decoded, &decoded_len) == EXIT_SUCCESS);
+            assert(decoded_len == len);
+            assert(memcmp(decoded, src, len) == 0);
+            
+            // caller buffers
+            uint8_t out[UNIBINARY_ENCODED_MAX_UTF8_WRAPPED_LENGTH(sizeof(src), 3)];
+            size_t out_len;
+            assert(unibinary_encode_bytes_into(src, len, &options, out, UNIBINARY_ENCODED_MAX_UTF8_WRAPPED_LENGTH(len, wrap_length), &out_len) == EXIT_SUCCESS);
+            assert(out_len == encoded_len);
+            assert(memcmp(out, encoded, out_len) == 0);
+            
+            uint8_t bytes[sizeof(src)];
+            assert(unibinary_decode_bytes_into(encoded, encoded_len, bytes, len, &out_len) == EXIT_SUCCESS);
+            assert(out_len == len);
+            assert(memcmp(bytes, src, len) == 0);
+            
+            if(len > 0) {
+                assert(unibinary_decode_bytes_into(encoded, encoded_len, bytes, len - 1, &out_len) == EXIT_FAILURE);
+            }
+            
+            free(encoded);
+            free(decoded);
+        }
+    }
+    
+    // options which cannot be encoded
+    unibinary_options_t options = { .block_size = 0x2000000 };
+    uint8_t *encoded = (uint8_t *)"";
+    size_t encoded_len = 1;
+    assert(unibinary_encode_bytes(src, sizeof(src), &options, &encoded, &encoded_len) == EXIT_FAILURE);
+    assert(encoded == NULL && encoded_len == 0);
+    
+    uint8_t *decoded;
+    size_t decoded_len;
+    assert(unibinary_decode_bytes((const uint8_t *)"abc", 3, &decoded, &decoded_len) == EXIT_FAILURE);
+    assert(decoded == NULL && decoded_len == 0);
+    
+    char *string;
+    long string_len;
+    assert(unibinary_decode_string(L"abc", &string, &string_len) == EXIT_FAILURE);
+    assert(string == NULL && string_len == 0);
+}
+
+void test_encoded_decoded_length() {
+    
+    printf("== %s ==\n", __func__);
+    
+    size_t SIZE = 5000;
+    uint8_t *src = malloc(SIZE);
+    uint8_t *out = malloc(UNIBINARY_ENCODED_MAX_UTF8_WRAPPED_LENGTH(SIZE, 1));
+    uint8_t *decoded = malloc(UNIBINARY_DECODED_MAX_LENGTH(UNIBINARY_ENCODED_MAX_UTF8_WRAPPED_LENGTH(SIZE, 1)));
+    
+    srand(29);
+    for(int pattern = 0; pattern < 4; pattern++) {
+        for(size_t i = 0; i < SIZE; ) {
+            uint8_t b = pattern == 0 ? 'a' + rand() % 26 : (pattern == 1 ? rand() : rand() % 160);
+            size_t n = pattern == 3 && rand() % 10 == 0 ? 1 + rand() % 300 : 1;
+            if(n > SIZE - i) n = SIZE - i;
+            memset(src + i, b, n);
+            i += n;
+        }
+        
+        for(size_t len = 0; len < SIZE; len += 1 + len / 2) {
+            for(size_t wrap_length = 0; wrap_length < 8; wrap_length += 7) {
+                unibinary_options_t options = { .wrap_length = wrap_length };
+                
+                size_t out_len;
+                assert(unibinary_encode_bytes_into(src, len, &options, out, unibinary_encoded_length_max(len, &options), &out_len) == EXIT_SUCCESS);
+                assert(unibinary_encoded_length(src, len, &options) == out_len);
+                
+                size_t decoded_len;
+                assert(unibinary_decoded_length(out, out_len, &decoded_len) == EXIT_SUCCESS);
+                assert(decoded_len == len);
+                assert(decoded_len <= unibinary_decoded_length_max(out_len));
+                
+                // exact buffers are enough
+                assert(unibinary_encode_bytes_into(src, len, &options, decoded, out_len, &decoded_len) == EXIT_SUCCESS);
+                assert(decoded_len == out_len);
+                assert(memcmp(decoded, out, out_len) == 0);
+            }
+            
+            size_t wide_len, used;
+            wchar_t *wide = malloc(UNIBINARY_ENCODED_MAX_LENGTH(len) * sizeof(wchar_t));
+            unibinary_encode_buffer(src, len, 1, wide, &used, &wide_len);
+            assert(unibinary_encoded_characters(src, len) == wide_len);
+            free(wide);
+        }
+    }
+    
+    // same verdict as the decoder on random characters
+    const char *characters[] = { "\xD0\x80", "\xD1\xBF", "\xE4\xB8\x80", "\xE5\xB7\xBF", "\xE5\xB8\x80", "\xE9\xB7\xBF", "\xE9\xB8\x80", "\n", "a", "\xE4" };
+    for(int k = 0; k < 2000; k++) {
+        size_t len = 0;
+        size_t count = rand() % 12;
+        for(size_t c = 0; c < count; c++) {
+            const char *character = characters[rand() % 10];
+            if(rand() % 4) character = characters[2 + rand() % 4];
+            memcpy(out + len, character, strlen(character));
+            len += strlen(character);
+        }
+        
+        size_t used, decoded_len, length;
+        int status = unibinary_decode_buffer(out, len, 1, decoded, UNIBINARY_DECODED_MAX_LENGTH(len), &used, &decoded_len);
+        assert(unibinary_decoded_length(out, len, &length) == status);
+        assert(status != EXIT_SUCCESS || length == decoded_len);
+    }
+    
+    free(src);
+    free(out);
+    free(decoded);
+}
+
+void test_streaming_encoder_decoder() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // pieces and outputs of random sizes, down to a single byte
+    size_t SIZE = 50000;
+    uint8_t *src = malloc(SIZE);
+    srand(31);
+    for(size_t i = 0; i < SIZE; ) {
+        size_t n = rand() % 20 == 0 ? 1 + rand() % 5000 : 1;
+        uint8_t b = rand() % 2 ? 'a' + rand() % 26 : rand();
+        if(n > SIZE - i) n = SIZE - i;
+        memset(src + i, b, n);
+        i += n;
+    }
+    
+    size_t capacity = UNIBINARY_ENCODED_MAX_UTF8_WRAPPED_LENGTH(SIZE, 1);
+    uint8_t *expected = malloc(capacity);
+    uint8_t *encoded = malloc(capacity);
+    uint8_t *decoded = malloc(SIZE);
+    
+    for(size_t wrap_length = 0; wrap_length < 12; wrap_length += 11) {
+        for(size_t max_piece = 1; max_piece < 20000; max_piece *= 37) {
+            unibinary_options_t options = { .wrap_length = wrap_length };
+            
+            size_t expected_len;
+            assert(unibinary_encode_bytes_into(src, SIZE, &options, expected, capacity, &expected_len) == EXIT_SUCCESS);
+            
+            unibinary_encoder_t encoder;
+            assert(unibinary_encoder_init(&encoder, &options) == EXIT_SUCCESS);
+            
+            size_t in_pos = 0;
+            size_t out_len = 0;
+            while(in_pos < SIZE) {
+                size_t in_len = 1 + rand() % max_piece;
+                if(in_len > SIZE - in_pos) in_len = SIZE - in_pos;
+                size_t out_capacity = 1 + rand() % (2 * max_piece);
+                if(out_capacity > capacity - out_len) out_capacity = capacity - out_len;
+                
+                size_t consumed, produced;
+                assert(unibinary_encoder_update(&encoder, src + in_pos, in_len, encoded + out_len, out_capacity, &consumed, &produced) == EXIT_SUCCESS);
+                in_pos += consumed;
+                out_len += produced;
+            }
+            
+            int done = 0;
+            while(!done) {
+                size_t produced;
+                size_t out_capacity = 1 + rand() % (2 * max_piece);
+                if(out_capacity > capacity - out_len) out_capacity = capacity - out_len;
+                assert(unibinary_encoder_finish(&encoder, encoded + out_len, out_capacity, &produced, &done) == EXIT_SUCCESS);
+                out_len += produced;
+            }
+            unibinary_encoder_end(&encoder);
+            
+            assert(out_len == expected_len);
+            assert(memcmp(encoded, expected, out_len) == 0);
+            
+            unibinary_decoder_t decoder;
+            assert(unibinary_decoder_init(&decoder) == EXIT_SUCCESS);
+            
+            in_pos = 0;
+            size_t decoded_len = 0;
+            while(in_pos < out_len) {
+                size_t in_len = 1 + rand() % max_piece;
+                if(in_len > out_len - in_pos) in_len = out_len - in_pos;
+                size_t out_capacity = 1 + rand() % (2 * max_piece);
+                if(out_capacity > SIZE - decoded_len) out_capacity = SIZE - decoded_len;
+                
+                size_t consumed, produced;
+                assert(unibinary_decoder_update(&decoder, encoded + in_pos, in_len, decoded + decoded_len, out_capacity, &consumed, &produced) == EXIT_SUCCESS);
+                in_pos += consumed;
+                decoded_len += produced;
+            }
+            
+            done = 0;
+            while(!done) {
+                size_t produced;
+                assert(unibinary_decoder_finish(&decoder, decoded + decoded_len, SIZE - decoded_len, &produced, &done) == EXIT_SUCCESS);
+                decoded_len += produced;
+            }
+            unibinary_decoder_end(&decoder);
+            
+            assert(decoded_len == SIZE);
+            assert(memcmp(decoded, src, SIZE) == 0);
+        }
+    }
+    
+    // a truncated character fails at the end
+    unibinary_decoder_t decoder;
+    assert(unibinary_decoder_init(&decoder) == EXIT_SUCCESS);
+    size_t consumed, produced;
+    int done;
+    assert(unibinary_decoder_update(&decoder, (const uint8_t *)"\xE5\xB8\x80\xE5\xB8", 5, decoded, SIZE, &consumed, &produced) == EXIT_SUCCESS);
+    assert(consumed == 5 && produced == 2);
+    assert(unibinary_decoder_finish(&decoder, decoded, SIZE, &produced, &done) == EXIT_FAILURE);
+    unibinary_decoder_end(&decoder);
+    
+    // the characters of a run split by more newlines than the pending bytes hold
+    size_t newlines = 5000;
+    size_t split_len = 0;
+    assert(unibinary_encode_bytes_into((const uint8_t *)"\xF0\xF0\xF0", 3, NULL, expected, capacity, &produced) == EXIT_SUCCESS);
+    for(size_t i = 0; i < produced; i++) {
+        encoded[split_len++] = expected[i];
+        if(i + 1 == produced || (expected[i + 1] & 0xC0) != 0x80) {
+            memset(encoded + split_len, '\n', newlines);
+            split_len += newlines;
+        }
+    }
+    
+    uint8_t *split_decoded;
+    size_t split_decoded_len;
+    assert(unibinary_decode_bytes(encoded, split_len, &split_decoded, &split_decoded_len) == EXIT_SUCCESS);
+    assert(split_decoded_len == 3);
+    free(split_decoded);
+    
+    assert(unibinary_decoder_init(&decoder) == EXIT_SUCCESS);
+    size_t in_pos = 0;
+    size_t decoded_len = 0;
+    while(in_pos < split_len) {
+        size_t in_len = split_len - in_pos < 1000 ? split_len - in_pos : 1000;
+        assert(unibinary_decoder_update(&decoder, encoded + in_pos, in_len, decoded + decoded_len, SIZE - decoded_len, &consumed, &produced) == EXIT_SUCCESS);
+        assert(consumed > 0);
+        in_pos += consumed;
+        decoded_len += produced;
+    }
+    assert(unibinary_decoder_finish(&decoder, decoded + decoded_len, SIZE - decoded_len, &produced, &done) == EXIT_SUCCESS);
+    assert(done && decoded_len + produced == 3 && memcmp(decoded, "\xF0\xF0\xF0", 3) == 0);
+    unibinary_decoder_end(&decoder);
+    
+    free(src);
+    free(expected);
+    free(encoded);
+    free(decoded);
+}
+
+void test_encode_decode_fd() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // several pipeline chunks, runs across their boundaries
+    size_t SIZE = 3 * 1024 * 1024 + 7;
+    uint8_t *src = malloc(SIZE);
+    srand(23);
+    for(size_t i = 0; i < SIZE; i++) {
+        src[i] = (i + 2000) % (1024 * 1024) < 4000 ? 'z' : (i % 3 ? 'a' + rand() % 26 : rand());
+    }
+    
+    for(size_t wrap_length = 0; wrap_length < 100; wrap_length += 77) {
+        unibinary_options_t options = { .wrap_length = wrap_length };
+        
+        uint8_t *expected;
+        size_t expected_len;
+        assert(unibinary_encode_bytes(src, SIZE, &options, &expected, &expected_len) == EXIT_SUCCESS);
+        
+        FILE *fd_src = tmpfile();
+        FILE *fd_encoded = tmpfile();
+        FILE *fd_decoded = tmpfile();
+        assert(fwrite(src, 1, SIZE, fd_src) == SIZE);
+        fflush(fd_src);
+        lseek(fileno(fd_src), 0, SEEK_SET);
+        
+        assert(unibinary_encode_fd(fileno(fd_src), fileno(fd_encoded), &options) == EXIT_SUCCESS);
+        assert(lseek(fileno(fd_encoded), 0, SEEK_CUR) == (off_t)expected_len);
+        
+        uint8_t *encoded = malloc(expected_len);
+        assert(pread(fileno(fd_encoded), encoded, expected_len, 0) == (ssize_t)expected_len);
+        assert(memcmp(encoded, expected, expected_len) == 0);
+        
+        lseek(fileno(fd_encoded), 0, SEEK_SET);
+        assert(unibinary_decode_fd(fileno(fd_encoded), fileno(fd_decoded), &options) == EXIT_SUCCESS);
+        
+        uint8_t *decoded = malloc(SIZE);
+        assert(lseek(fileno(fd_decoded), 0, SEEK_CUR) == (off_t)SIZE);
+        assert(pread(fileno(fd_decoded), decoded, SIZE, 0) == (ssize_t)SIZE);
+        assert(memcmp(decoded, src, SIZE) == 0);
+        
+        fclose(fd_src);
+        fclose(fd_encoded);
+        fclose(fd_decoded);
+        free(expected);
+        free(encoded);
+        free(decoded);
+    }
+    
+    // a truncated character fails after the complete ones are written
+    FILE *fd_bad = tmpfile();
+    FILE *fd_out = tmpfile();
+    assert(fwrite("\xE4\xB8\x80\xE4\xB8\x80\xE4\xB8", 1, 8, fd_bad) == 8);
+    fflush(fd_bad);
+    lseek(fileno(fd_bad), 0, SEEK_SET);
+    
+    unibinary_options_t options = { .wrap_length = 0 };
+    assert(unibinary_decode_fd(fileno(fd_bad), fileno(fd_out), &options) == EXIT_FAILURE);
+    assert(lseek(fileno(fd_out), 0, SEEK_CUR) == 3);
+    
+    fclose(fd_bad);
+    fclose(fd_out);
+    free(src);
+}
+
+void test_encode_decode_batch() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // tweet sized records, some empty, some runs
+    size_t COUNT = 2000;
+    unibinary_record_t *records = malloc(COUNT * sizeof(unibinary_record_t));
+    uint8_t *data = malloc(COUNT * 300);
+    srand(29);
+    for(size_t i = 0; i < COUNT; i++) {
+        uint8_t *d = data + i * 300;
+        size_t len = rand() % 301;
+        for(size_t j = 0; j < len; j++) {
+            d[j] = i % 7 == 0 ? 0 : (rand() % 2 ? 'a' + rand() % 26 : rand());
+        }
+        records[i].data = d;
+        records[i].len = len;
+    }
+    
+    for(size_t wrap_length = 0; wrap_length < 20; wrap_length += 13) {
+        unibinary_options_t options = { .wrap_length = wrap_length };
+        
+        size_t capacity = unibinary_encode_batch_max(records, COUNT, &options);
+        uint8_t *arena = malloc(capacity);
+        size_t *offsets = malloc((COUNT + 1) * sizeof(size_t));
+        uint8_t *fits = malloc(COUNT);
+        
+        assert(unibinary_encode_batch(records, COUNT, &options, arena, capacity, offsets, 140, fits) == EXIT_SUCCESS);
+        
+        // same as one record at a time
+        for(size_t i = 0; i < COUNT; i++) {
+            uint8_t *expected;
+            size_t expected_len;
+            assert(unibinary_encode_bytes(records[i].data, records[i].len, &options, &expected, &expected_len) == EXIT_SUCCESS);
+            assert(offsets[i + 1] - offsets[i] == expected_len);
+            assert(memcmp(arena + offsets[i], expected, expected_len) == 0);
+            assert(fits[i] == (unibinary_encoded_characters(records[i].data, records[i].len) <= 140));
+            free(expected);
+        }
+        
+        // the encoded records decode back into another arena
+        unibinary_record_t *encoded = malloc(COUNT * sizeof(unibinary_record_t));
+        for(size_t i = 0; i < COUNT; i++) {
+            encoded[i].data = arena + offsets[i];
+            encoded[i].len = offsets[i + 1] - offsets[i];
+        }
+        
+        uint8_t *decoded = malloc(COUNT * 300);
+        size_t *decoded_offsets = malloc((COUNT + 1) * sizeof(size_t));
+        assert(unibinary_decode_batch(encoded, COUNT, decoded, COUNT * 300, decoded_offsets) == EXIT_SUCCESS);
+        
+        for(size_t i = 0; i < COUNT; i++) {
+            assert(decoded_offsets[i + 1] - decoded_offsets[i] == records[i].len);
+            assert(records[i].len == 0 || memcmp(decoded + decoded_offsets[i], records[i].data, records[i].len) == 0);
+        }
+        
+        // arenas one byte too small
+        assert(unibinary_encode_batch(records, COUNT, &options, arena, offsets[COUNT] - 1, offsets, 0, NULL) == EXIT_FAILURE);
+        assert(unibinary_decode_batch(encoded, COUNT, decoded, decoded_offsets[COUNT] - 1, decoded_offsets) == EXIT_FAILURE);
+        
+        free(arena);
+        free(offsets);
+        free(fits);
+        free(encoded);
+        free(decoded);
+        free(decoded_offsets);
+    }
+    
+    free(records);
+    free(data);
+}
+
+typedef struct {
+    unsigned int seed;
+    int status;
+} concurrent_job_t;
+
+static void *concurrent_job(void *arg) {
+    
+    concurrent_job_t *job = arg;
+    job->status = EXIT_FAILURE;
+    
+    uint8_t src[3000];
+    for(size_t i = 0; i < sizeof(src); i++) {
+        src[i] = i % 500 < 10 ? 0 : (rand_r(&job->seed) % 2 ? 'a' + rand_r(&job->seed) % 26 : rand_r(&job->seed));
+    }
+    
+    unibinary_options_t options = { .wrap_length = job->seed % 2 ? 0 : 40 };
+    
+    for(int round = 0; round < 200; round++) {
+        uint8_t *encoded;
+        uint8_t *decoded;
+        size_t encoded_len, decoded_len;
+        
+        if(unibinary_encode_bytes(src, sizeof(src), &options, &encoded, &encoded_len) != EXIT_SUCCESS) return NULL;
+        int status = unibinary_decode_bytes(encoded, encoded_len, &decoded, &decoded_len);
+        int same = status == EXIT_SUCCESS && decoded_len == sizeof(src) && memcmp(decoded, src, sizeof(src)) == 0;
+        free(encoded);
+        free(decoded);
+        
+        if(!same) return NULL;
+    }
+    
+    job->status = EXIT_SUCCESS;
+    return NULL;
+}
+
+void test_concurrent_calls() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // no locks, no locale, and a locale which is not UTF-8 does not matter
+    char *saved_locale = strdup(setlocale(LC_ALL, NULL));
+    setlocale(LC_ALL, "C");
+    
+    concurrent_job_t jobs[8];
+    pthread_t threads[8];
+    
+    for(int i = 0; i < 8; i++) {
+        jobs[i].seed = 100 + i;
+        assert(pthread_create(&threads[i], NULL, concurrent_job, &jobs[i]) == 0);
+    }
+    
+    for(int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        assert(jobs[i].status == EXIT_SUCCESS);
+    }
+    
+    setlocale(LC_ALL, saved_locale);
+    free(saved_locale);
+}
+
+void test_decode_sparse() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // long runs of zeros between data, and at the end
+    size_t SIZE = 4 * 1024 * 1024;
+    uint8_t *src = calloc(SIZE, 1);
+    srand(37);
+    for(size_t i = 0; i < SIZE; i++) {
+        if(i % (1024 * 1024) < 1000 || (i > 2500000 && i < 2560000)) src[i] = rand();
+    }
+    
+    uint8_t *encoded;
+    size_t encoded_len;
+    unibinary_options_t options = { .wrap_length = 100, .sparse = 1 };
+    assert(unibinary_encode_bytes(src, SIZE, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    
+    char encoded_path[] = "/tmp/unibinary_sparse_XXXXXX";
+    int fd_encoded = mkstemp(encoded_path);
+    assert(fd_encoded >= 0);
+    assert(write(fd_encoded, encoded, encoded_len) == (ssize_t)encoded_len);
+    
+    uint8_t *decoded = malloc(SIZE);
+    
+    for(int pipeline = 0; pipeline < 2; pipeline++) {
+        
+        // over existing data too, which must end up as zeros
+        FILE *fd_decoded = tmpfile();
+        memset(decoded, 'x', SIZE);
+        assert(fwrite(decoded, 1, pipeline ? SIZE / 2 : 0, fd_decoded) == (pipeline ? SIZE / 2 : 0));
+        fflush(fd_decoded);
+        lseek(fileno(fd_decoded), 0, SEEK_SET);
+        
+        if(pipeline) {
+            lseek(fd_encoded, 0, SEEK_SET);
+            assert(unibinary_decode_fd(fd_encoded, fileno(fd_decoded), &options) == EXIT_SUCCESS);
+        } else {
+            assert(unibinary_decode_path(encoded_path, fileno(fd_decoded), &options) == EXIT_SUCCESS);
+        }
+        
+        struct stat st;
+        assert(fstat(fileno(fd_decoded), &st) == 0);
+        assert(st.st_size == (off_t)SIZE);
+        assert(pread(fileno(fd_decoded), decoded, SIZE, 0) == (ssize_t)SIZE);
+        assert(memcmp(decoded, src, SIZE) == 0);
+        
+        fclose(fd_decoded);
+    }
+    
+    close(fd_encoded);
+    unlink(encoded_path);
+    free(src);
+    free(encoded);
+    free(decoded);
+}
+
+void test_format_v2() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // runs longer than 2 * 0xFFF bytes become long runs, shorter ones stay v1 runs
+    size_t SIZE = 4 * 1024 * 1024;
+    uint8_t *src = calloc(SIZE, 1);
+    srand(41);
+    for(size_t i = 3000000; i < SIZE; i++) {
+        if(i < 3005000 || (i >= 3025000 && i < 3025100)) src[i] = rand();
+        else if (i < 3015000) src[i] = 'a';
+        else if (i < 3020000) src[i] = 0xFF;
+        else if (i >= 3030000) src[i] = i % 7 ? rand() : 'b';
+    }
+    
+    for(size_t wrap_length = 0; wrap_length < 100; wrap_length += 77) {
+        
+        unibinary_options_t options = { .wrap_length = wrap_length, .version = 2 };
+        unibinary_options_t options_v1 = { .wrap_length = wrap_length };
+        
+        uint8_t *encoded, *encoded_v1;
+        size_t encoded_len, encoded_v1_len;
+        assert(unibinary_encode_bytes(src, SIZE, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+        assert(unibinary_encode_bytes(src, SIZE, &options_v1, &encoded_v1, &encoded_v1_len) == EXIT_SUCCESS);
+        
+        // the header, then fewer characters
+        assert(memcmp(encoded, "\xe9\xb8\x81", 3) == 0);
+        assert(encoded_len + 3500 < encoded_v1_len);
+        assert(unibinary_encoded_length(src, SIZE, &options) == encoded_len);
+        
+        // exactly sized buffers go through the counting pass
+        uint8_t *exact = malloc(encoded_len);
+        size_t exact_len;
+        assert(unibinary_encode_bytes_into(src, SIZE, &options, exact, encoded_len, &exact_len) == EXIT_SUCCESS);
+        assert(exact_len == encoded_len && memcmp(exact, encoded, encoded_len) == 0);
+        free(exact);
+        
+        size_t decoded_len;
+        assert(unibinary_decoded_length(encoded, encoded_len, &decoded_len) == EXIT_SUCCESS);
+        assert(decoded_len == SIZE);
+        assert(unibinary_decoded_length_max(encoded_len) >= SIZE);
+        
+        uint8_t *decoded;
+        assert(unibinary_decode_bytes(encoded, encoded_len, &decoded, &decoded_len) == EXIT_SUCCESS);
+        assert(decoded_len == SIZE && memcmp(decoded, src, SIZE) == 0);
+        free(decoded);
+        
+        // the same characters through FILE, fd and streaming
+        FILE *fd_in = tmpfile();
+        assert(fwrite(src, 1, SIZE, fd_in) == SIZE);
+        
+        for(int through_fd = 0; through_fd < 2; through_fd++) {
+            FILE *fd_out = tmpfile();
+            rewind(fd_in);
+            
+            if(through_fd) {
+                lseek(fileno(fd_in), 0, SEEK_SET);
+                assert(unibinary_encode_fd(fileno(fd_in), fileno(fd_out), &options) == EXIT_SUCCESS);
+            } else {
+                assert(unibinary_encode_with_options(fd_in, fd_out, &options) == EXIT_SUCCESS);
+                fflush(fd_out);
+            }
+            
+            uint8_t *file_encoded = malloc(encoded_len + 1);
+            assert(pread(fileno(fd_out), file_encoded, encoded_len + 1, 0) == (ssize_t)encoded_len);
+            assert(memcmp(file_encoded, encoded, encoded_len) == 0);
+            free(file_encoded);
+            
+            // and back through the decoders
+            FILE *fd_decoded = tmpfile();
+            lseek(fileno(fd_out), 0, SEEK_SET);
+            if(through_fd) {
+                assert(unibinary_decode_fd(fileno(fd_out), fileno(fd_decoded), &options) == EXIT_SUCCESS);
+            } else {
+                rewind(fd_out);
+                assert(unibinary_decode(fd_out, fd_decoded) == EXIT_SUCCESS);
+                fflush(fd_decoded);
+            }
+            
+            decoded = malloc(SIZE + 1);
+            assert(pread(fileno(fd_decoded), decoded, SIZE + 1, 0) == (ssize_t)SIZE);
+            assert(memcmp(decoded, src, SIZE) == 0);
+            free(decoded);
+            
+            fclose(fd_decoded);
+            fclose(fd_out);
+        }
+        
+        fclose(fd_in);
+        
+        unibinary_encoder_t encoder;
+        assert(unibinary_encoder_init(&encoder, &options) == EXIT_SUCCESS);
+        
+        uint8_t *streamed = malloc(encoded_len);
+        size_t streamed_len = 0;
+        size_t pos = 0;
+        int done = 0;
+        
+        while(!done) {
+            size_t consumed = 0, produced;
+            if(pos < SIZE) {
+                size_t in_len = SIZE - pos < 5000 ? SIZE - pos : 5000;
+                assert(unibinary_encoder_update(&encoder, src + pos, in_len, streamed + streamed_len, 700, &consumed, &produced) == EXIT_SUCCESS);
+            } else {
+                size_t out_capacity = encoded_len - streamed_len < 700 ? encoded_len - streamed_len : 700;
+                assert(unibinary_encoder_finish(&encoder, streamed + streamed_len, out_capacity, &produced, &done) == EXIT_SUCCESS);
+            }
+            pos += consumed;
+            streamed_len += produced;
+        }
+        unibinary_encoder_end(&encoder);
+        
+        assert(streamed_len == encoded_len && memcmp(streamed, encoded, encoded_len) == 0);
+        free(streamed);
+        
+        // outputs smaller than a long run go through the staging area
+        unibinary_decoder_t decoder;
+        assert(unibinary_decoder_init(&decoder) == EXIT_SUCCESS);
+        
+        decoded = malloc(SIZE);
+        decoded_len = 0;
+        pos = 0;
+        done = 0;
+        
+        while(!done) {
+            size_t consumed = 0, produced;
+            size_t out_capacity = SIZE - decoded_len < 1000 ? SIZE - decoded_len : 1000;
+            if(pos < encoded_len) {
+                assert(unibinary_decoder_update(&decoder, encoded + pos, encoded_len - pos, decoded + decoded_len, out_capacity, &consumed, &produced) == EXIT_SUCCESS);
+            } else {
+                assert(unibinary_decoder_finish(&decoder, decoded + decoded_len, out_capacity, &produced, &done) == EXIT_SUCCESS);
+            }
+            pos += consumed;
+            decoded_len += produced;
+        }
+        unibinary_decoder_end(&decoder);
+        
+        assert(decoded_len == SIZE && memcmp(decoded, src, SIZE) == 0);
+        free(decoded);
+        
+        free(encoded);
+        free(encoded_v1);
+    }
+    
+    // v1 is unchanged without a version
+    unibinary_options_t options_v1 = { .version = 1 };
+    uint8_t *encoded_v1, *encoded_default;
+    size_t encoded_v1_len, encoded_default_len;
+    assert(unibinary_encode_bytes(src, SIZE, &options_v1, &encoded_v1, &encoded_v1_len) == EXIT_SUCCESS);
+    assert(unibinary_encode_bytes(src, SIZE, NULL, &encoded_default, &encoded_default_len) == EXIT_SUCCESS);
+    assert(encoded_v1_len == encoded_default_len && memcmp(encoded_v1, encoded_default, encoded_v1_len) == 0);
+    free(encoded_v1);
+    free(encoded_default);
+    
+    // concatenated streams decode to the concatenated data
+    unibinary_options_t options = { .version = 2 };
+    uint8_t *a, *b;
+    size_t a_len, b_len;
+    assert(unibinary_encode_bytes((const uint8_t *)"abc", 3, &options, &a, &a_len) == EXIT_SUCCESS);
+    assert(unibinary_encode_bytes((const uint8_t *)"\0\0\0\0", 4, &options, &b, &b_len) == EXIT_SUCCESS);
+    uint8_t ab[64];
+    memcpy(ab, a, a_len);
+    memcpy(ab + a_len, b, b_len);
+    
+    uint8_t *decoded;
+    size_t decoded_len;
+    assert(unibinary_decode_bytes(ab, a_len + b_len, &decoded, &decoded_len) == EXIT_SUCCESS);
+    assert(decoded_len == 7 && memcmp(decoded, "abc\0\0\0\0", 7) == 0);
+    free(decoded);
+    free(a);
+    free(b);
+    
+    // unknown features and malformed long runs are errors
+    const char *invalid[] = {
+        "\xe9\xb8\x82",                                  // header with feature 0x02
+        "\xe9\xbc\x80\xd0\x80\xe4\xb8\x80",              // long run without its last U12b
+        "\xe9\xbc\x80\xe4\xb8\x80\xe4\xb8\x80\xe4\xb8\x80",  // long run without its U8
+        "\xe9\xbc\x80\xd0\x80\xe4\xb8\x80\xe4\xb8\x80\xe4",  // truncated
+        "\xe9\xb8\x81\xe9\xbc\x80\xd0\x80\xe4\xbc\x80\xe4\xb8\x80",  // 0x100000 bytes, the top 4 bits are reserved
+    };
+    for(size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        assert(unibinary_decode_bytes((const uint8_t *)invalid[i], strlen(invalid[i]), &decoded, &decoded_len) == EXIT_FAILURE);
+        assert(decoded == NULL);
+    }
+    
+    // the longest run
+    assert(unibinary_decode_bytes((const uint8_t *)"\xe9\xb8\x81\xe9\xbc\x80\xd0\x81\xe4\xbb\xbf\xe5\xb7\xbf", 14, &decoded, &decoded_len) == EXIT_SUCCESS);
+    assert(decoded_len == 0xFFFFF && decoded[0] == 1 && decoded[0xFFFFE] == 1);
+    free(decoded);
+    
+    // later versions are errors, not v2, with every encoder
+    unibinary_options_t later[] = { { .version = UNIBINARY_MAX_VERSION + 1 }, { .version = -1, .optimal = 1 }, { .version = 9, .checksum = 1, .block_size = 16 } };
+    for(size_t i = 0; i < sizeof(later) / sizeof(later[0]); i++) {
+        uint8_t *encoded;
+        size_t encoded_len;
+        assert(unibinary_encode_bytes((const uint8_t *)"abc", 3, &later[i], &encoded, &encoded_len) == EXIT_FAILURE);
+        assert(encoded == NULL);
+        
+        FILE *fd_in = tmpfile();
+        FILE *fd_out = tmpfile();
+        assert(fwrite("abc", 1, 3, fd_in) == 3);
+        fflush(fd_in);
+        rewind(fd_in);
+        assert(unibinary_encode_with_options(fd_in, fd_out, &later[i]) == EXIT_FAILURE);
+        lseek(fileno(fd_in), 0, SEEK_SET);
+        assert(unibinary_encode_fd(fileno(fd_in), fileno(fd_out), &later[i]) == EXIT_FAILURE);
+        fflush(fd_out);
+        assert(lseek(fileno(fd_out), 0, SEEK_END) == 0);
+        fclose(fd_in);
+        fclose(fd_out);
+        
+        unibinary_encoder_t encoder;
+        later[i].block_size = 0;
+        assert(unibinary_encoder_init(&encoder, &later[i]) == EXIT_FAILURE);
+    }
+    
+    free(src);
+}
+
+static size_t characters_of(const uint8_t *s, size_t n) {
+    
+    size_t characters = 0;
+    for(size_t i = 0; i < n; i++) characters += (s[i] & 0xC0) != 0x80 && s[i] != '\n';
+    
+    return characters;
+}
+
+void test_encode_optimal() {
+    
+    printf("== %s ==\n", __func__);
+    
+    unibinary_options_t options = { .optimal = 1 };
+    
+    // greedy takes the run, then needs 4 characters, pairs need 3
+    uint8_t *encoded;
+    size_t encoded_len;
+    assert(unibinary_encode_bytes((const uint8_t *)"aaabcd", 6, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    assert(characters_of(encoded, encoded_len) == 3);
+    assert(unibinary_encoded_characters((const uint8_t *)"aaabcd", 6) == 4);
+    free(encoded);
+    
+    // text with short runs, binary and long runs, over several windows
+    size_t SIZE = 3 * 1024 * 1024 + 17;
+    uint8_t *src = malloc(SIZE);
+    srand(43);
+    for(size_t i = 0; i < SIZE; ) {
+        size_t n = 1 + rand() % 300;
+        int kind = rand() % 4;
+        for(size_t k = 0; k < n && i < SIZE; k++, i++) {
+            if(kind == 0) src[i] = "ab  ...\n"[rand() % 8];
+            else if (kind == 1) src[i] = rand();
+            else if (kind == 2) src[i] = n > 200 ? 0 : 0xFF;
+            else src[i] = rand() % 2 ? 'x' : 0x80 + rand() % 4;
+        }
+    }
+    
+    for(unsigned int version = 1; version <= 2; version++) {
+        for(size_t wrap_length = 0; wrap_length < 100; wrap_length += 64) {
+            
+            options = (unibinary_options_t){ .wrap_length = wrap_length, .version = version, .optimal = 1 };
+            unibinary_options_t greedy = { .wrap_length = wrap_length, .version = version };
+            
+            uint8_t *greedy_encoded;
+            size_t greedy_len;
+            assert(unibinary_encode_bytes(src, SIZE, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+            assert(unibinary_encode_bytes(src, SIZE, &greedy, &greedy_encoded, &greedy_len) == EXIT_SUCCESS);
+            assert(characters_of(encoded, encoded_len) < characters_of(greedy_encoded, greedy_len));
+            assert(unibinary_encoded_length(src, SIZE, &options) == encoded_len);
+            free(greedy_encoded);
+            
+            uint8_t *decoded;
+            size_t decoded_len;
+            assert(unibinary_decode_bytes(encoded, encoded_len, &decoded, &decoded_len) == EXIT_SUCCESS);
+            assert(decoded_len == SIZE && memcmp(decoded, src, SIZE) == 0);
+            free(decoded);
+            
+            // the windows don't depend on the chunks, every API writes the same characters
+            FILE *fd_in = fopen("/tmp/test_optimal", "wb+");
+            FILE *fd_out = tmpfile();
+            FILE *fd_decoded = tmpfile();
+            assert(fwrite(src, 1, SIZE, fd_in) == SIZE);
+            fflush(fd_in);
+            rewind(fd_in);
+            
+            options.threads = 4;
+            assert(unibinary_encode_with_options(fd_in, fd_out, &options) == EXIT_SUCCESS);
+            fflush(fd_out);
+            
+            uint8_t *other = malloc(encoded_len + 1);
+            assert(pread(fileno(fd_out), other, encoded_len + 1, 0) == (ssize_t)encoded_len);
+            assert(memcmp(other, encoded, encoded_len) == 0);
+            
+            for(int api = 0; api < 2; api++) {
+                FILE *fd_api = tmpfile();
+                lseek(fileno(fd_in), 0, SEEK_SET);
+                if(api == 0) assert(unibinary_encode_fd(fileno(fd_in), fileno(fd_api), &options) == EXIT_SUCCESS);
+                else assert(unibinary_encode_path("/tmp/test_optimal", fileno(fd_api), &options) == EXIT_SUCCESS);
+                assert(pread(fileno(fd_api), other, encoded_len + 1, 0) == (ssize_t)encoded_len);
+                assert(memcmp(other, encoded, encoded_len) == 0);
+                fclose(fd_api);
+            }
+            
+            // the streaming encoder, in steps of odd sizes
+            unibinary_encoder_t encoder;
+            assert(unibinary_encoder_init(&encoder, &options) == EXIT_SUCCESS);
+            size_t in_pos = 0, other_len = 0, consumed, produced;
+            int done = 0;
+            while(!done) {
+                if(in_pos < SIZE) {
+                    size_t step = SIZE - in_pos < 7919 ? SIZE - in_pos : 7919;
+                    assert(unibinary_encoder_update(&encoder, src + in_pos, step, other + other_len, encoded_len - other_len, &consumed, &produced) == EXIT_SUCCESS);
+                    in_pos += consumed;
+                } else {
+                    assert(unibinary_encoder_finish(&encoder, other + other_len, encoded_len - other_len, &produced, &done) == EXIT_SUCCESS);
+                }
+                other_len += produced;
+            }
+            unibinary_encoder_end(&encoder);
+            assert(other_len == encoded_len && memcmp(other, encoded, encoded_len) == 0);
+            free(other);
+            
+            rewind(fd_out);
+            assert(unibinary_decode(fd_out, fd_decoded) == EXIT_SUCCESS);
+            fflush(fd_decoded);
+            
+            decoded = malloc(SIZE + 1);
+            assert(pread(fileno(fd_decoded), decoded, SIZE + 1, 0) == (ssize_t)SIZE);
+            assert(memcmp(decoded, src, SIZE) == 0);
+            free(decoded);
+            
+            fclose(fd_in);
+            fclose(fd_out);
+            fclose(fd_decoded);
+            free(encoded);
+        }
+    }
+    
+    // runs longer than a chunk, which cut windows short when they followed the chunks
+    memset(src, 0, SIZE);
+    options = (unibinary_options_t){ .version = 2, .optimal = 1, .checksum = 1 };
+    assert(unibinary_encode_bytes(src, SIZE, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    FILE *fd_in = tmpfile();
+    FILE *fd_out = tmpfile();
+    assert(fwrite(src, 1, SIZE, fd_in) == SIZE);
+    fflush(fd_in);
+    lseek(fileno(fd_in), 0, SEEK_SET);
+    assert(unibinary_encode_fd(fileno(fd_in), fileno(fd_out), &options) == EXIT_SUCCESS);
+    uint8_t *other = malloc(encoded_len + 1);
+    assert(pread(fileno(fd_out), other, encoded_len + 1, 0) == (ssize_t)encoded_len);
+    assert(memcmp(other, encoded, encoded_len) == 0);
+    free(other);
+    fclose(fd_in);
+    fclose(fd_out);
+    free(encoded);
+    
+    free(src);
+}
+
+void test_stats() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // a run, a pair, a triple and a trailing byte
+    unibinary_stats_t stats = { 0 };
+    unibinary_options_t options = { .stats = &stats };
+    uint8_t *encoded;
+    size_t encoded_len;
+    assert(unibinary_encode_bytes((const uint8_t *)"\x00\x00\x00\x00" "ab\x80\x81\x82\xFF", 10, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    assert(stats.runs == 1 && stats.run_bytes == 4 && stats.pairs == 1 && stats.triples == 1 && stats.singles == 1);
+    assert(stats.newlines == 0 && stats.long_runs == 0);
+    free(encoded);
+    
+    // the encoder and the decoder see the same tokens, which add up to the data
+    size_t SIZE = 300 * 1000;
+    uint8_t *src = malloc(SIZE);
+    srand(44);
+    for(size_t i = 0; i < SIZE; i++) {
+        src[i] = i % 5000 < 2000 ? 0 : (i % 3 ? 'a' + rand() % 26 : rand());
+    }
+    
+    unibinary_stats_t encoder_stats = { 0 };
+    unibinary_stats_t decoder_stats = { 0 };
+    options = (unibinary_options_t){ .wrap_length = 70, .version = 2, .stats = &encoder_stats };
+    
+    FILE *fd_in = fmemopen(src, SIZE, "rb");
+    FILE *fd_out = fopen("/tmp/test_stats", "wb+");
+    assert(unibinary_encode_with_options(fd_in, fd_out, &options) == EXIT_SUCCESS);
+    fclose(fd_in);
+    
+    encoded_len = ftell(fd_out);
+    rewind(fd_out);
+    // room for the NUL fmemopen() writes
+    uint8_t *decoded = malloc(SIZE + 1);
+    FILE *fd_decoded = fmemopen(decoded, SIZE + 1, "wb");
+    options.stats = &decoder_stats;
+    assert(unibinary_decode_with_options(fd_out, fd_decoded, &options) == EXIT_SUCCESS);
+    fclose(fd_decoded);
+    fclose(fd_out);
+    assert(memcmp(src, decoded, SIZE) == 0);
+    
+    assert(encoder_stats.bytes_read == SIZE && encoder_stats.bytes_written == encoded_len);
+    assert(decoder_stats.bytes_read == encoded_len && decoder_stats.bytes_written == SIZE);
+    assert(encoder_stats.reads > 0 && encoder_stats.writes > 0);
+    assert(encoder_stats.run_bytes + 2 * encoder_stats.pairs + 3 * encoder_stats.triples + encoder_stats.singles == SIZE);
+    assert(encoder_stats.newlines == (1 + 2 * encoder_stats.runs + 2 * encoder_stats.long_runs + encoder_stats.pairs + 2 * encoder_stats.triples + encoder_stats.singles) / 70);
+    
+    unibinary_stats_t both[2] = { encoder_stats, decoder_stats };
+    for(int i = 0; i < 2; i++) {
+        both[i].reads = both[i].writes = both[i].bytes_read = both[i].bytes_written = 0;
+        both[i].read_ns = both[i].codec_ns = both[i].write_ns = 0;
+    }
+    assert(memcmp(&both[0], &both[1], sizeof(unibinary_stats_t)) == 0);
+    
+    // the bytes functions, as -e -s and -d -s, see the same tokens
+    unibinary_stats_t bytes_stats[2] = { { 0 }, { 0 } };
+    options = (unibinary_options_t){ .wrap_length = 70, .version = 2, .stats = &bytes_stats[0] };
+    assert(unibinary_encode_bytes(src, SIZE, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    free(decoded);
+    size_t decoded_len;
+    options.stats = &bytes_stats[1];
+    assert(unibinary_decode_bytes_with_options(encoded, encoded_len, &options, &decoded, &decoded_len) == EXIT_SUCCESS);
+    assert(decoded_len == SIZE && memcmp(src, decoded, SIZE) == 0);
+    free(encoded);
+    
+    assert(bytes_stats[0].bytes_read == SIZE && bytes_stats[0].bytes_written == encoded_len);
+    assert(bytes_stats[1].bytes_read == encoded_len && bytes_stats[1].bytes_written == SIZE);
+    assert(bytes_stats[1].codec_ns > 0);
+    for(int i = 0; i < 2; i++) {
+        bytes_stats[i].bytes_read = bytes_stats[i].bytes_written = 0;
+        bytes_stats[i].codec_ns = 0;
+    }
+    assert(memcmp(&bytes_stats[0], &bytes_stats[1], sizeof(unibinary_stats_t)) == 0);
+    assert(memcmp(&bytes_stats[0], &both[0], sizeof(unibinary_stats_t)) == 0);
+    
+    free(src);
+    free(decoded);
+}
+
+void test_validate() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // "test", newline, 0xABCDEF, 'a' repeated 10 times, 'a'
+    const char *src = "\xE9\xAC\xA5\xE9\xAB\xB4\n\xE5\xA2\xBC\xE5\xAF\xAF\xD1\xA1\xE4\xB8\x8A\xD1\xA1";
+    size_t src_len = strlen(src);
+    size_t offset;
+    assert(unibinary_validate((const uint8_t *)src, src_len, &offset) == EXIT_SUCCESS);
+    assert(offset == src_len);
+    
+    // a lone U12b character, at the start of its token
+    assert(unibinary_validate((const uint8_t *)src, 10, &offset) == EXIT_FAILURE);
+    assert(offset == 7);
+    
+    // U+4DFF is out of the ranges, at its own offset
+    assert(unibinary_validate((const uint8_t *)"\xE9\xAC\xA5\xE5\xA2\xBC\xE4\xB7\xBF", 9, &offset) == EXIT_FAILURE);
+    assert(offset == 6);
+    
+    // U12b then U12a, at the start of the token
+    assert(unibinary_validate((const uint8_t *)"\xE9\xAC\xA5\xE5\xA2\xBC\xE9\xAC\xA5", 9, &offset) == EXIT_FAILURE);
+    assert(offset == 3);
+    
+    // long texts with an error after blocks of U12a characters and U12b tokens, read whole and in chunks
+    size_t SIZE = 3 * 1024 * 1024;
+    uint8_t *data = malloc(SIZE);
+    srand(45);
+    for(size_t i = 0; i < SIZE; i++) data[i] = i % 4096 < 2048 ? rand() % 128 : rand();
+    
+    unibinary_options_t options = { .wrap_length = 1000 };
+    uint8_t *encoded;
+    size_t encoded_len;
+    assert(unibinary_encode_bytes(data, SIZE, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    
+    for(int k = 0; k < 4; k++) {
+        size_t position = k == 0 ? encoded_len : (k * encoded_len) / 3 + k;
+        uint8_t saved = position < encoded_len ? encoded[position] : 0;
+        if(position < encoded_len) encoded[position] = 'x';
+        
+        size_t used, len;
+        uint8_t *decoded = malloc(SIZE);
+        int decoded_status = unibinary_decode_buffer(encoded, encoded_len, 1, decoded, SIZE, &used, &len);
+        free(decoded);
+        
+        assert(unibinary_validate(encoded, encoded_len, &offset) == decoded_status);
+        assert(offset == used);
+        
+        FILE *f = fopen("/tmp/test_validate", "wb+");
+        assert(fwrite(encoded, 1, encoded_len, f) == encoded_len);
+        fflush(f);
+        rewind(f);
+        size_t fd_offset;
+        assert(unibinary_validate_fd(fileno(f), &fd_offset) == decoded_status);
+        assert(fd_offset == offset);
+        fclose(f);
+        
+        if(position < encoded_len) encoded[position] = saved;
+    }
+    
+    free(data);
+    free(encoded);
+}
+
+void test_checksum() {
+    
+    printf("== %s ==\n", __func__);
+    
+    // the header with the checksum feature, then the trailer with the CRC32C of "123456789", 0xE3069283
+    unibinary_options_t options = { .checksum = 1 };
+    uint8_t *encoded;
+    size_t encoded_len;
+    assert(unibinary_encode_bytes((const uint8_t *)"123456789", 9, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    assert(memcmp(encoded, "\xe9\xb8\x83", 3) == 0);
+    assert(memcmp(encoded + encoded_len - 12, "\xe9\xbc\x81\xe5\xb0\xb0\xe5\x92\x92\xe4\xba\x83", 12) == 0);
+    assert(unibinary_encoded_length((const uint8_t *)"123456789", 9, &options) == encoded_len);
+    free(encoded);
+    
+    // random, text, and runs long enough to be summed in one step, wrapped or not
+    size_t SIZE = 3 * 1024 * 1024 + 7;
+    uint8_t *src = malloc(SIZE);
+    srand(46);
+    for(size_t i = 0; i < SIZE; i++) {
+        src[i] = i < 1000000 ? rand() : (i < 1500000 ? 'a' + rand() % 26 : (i < 2700000 ? (i < 2000000 ? 0 : 0xAB) : rand()));
+    }
+    
+    for(size_t wrap_length = 0; wrap_length < 100; wrap_length += 64) {
+        
+        options = (unibinary_options_t){ .wrap_length = wrap_length, .checksum = 1 };
+        assert(unibinary_encode_bytes(src, SIZE, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+        assert(unibinary_encoded_length(src, SIZE, &options) == encoded_len);
+        assert(unibinary_encoded_length_max(SIZE, &options) >= encoded_len);
+        
+        // the same characters through a file and the streaming encoder
+        FILE *fd_in = tmpfile();
+        FILE *fd_out = tmpfile();
+        assert(fwrite(src, 1, SIZE, fd_in) == SIZE);
+        fflush(fd_in);
+        lseek(fileno(fd_in), 0, SEEK_SET);
+        assert(unibinary_encode_fd(fileno(fd_in), fileno(fd_out), &options) == EXIT_SUCCESS);
+        uint8_t *file_encoded = malloc(encoded_len + 1);
+        assert(pread(fileno(fd_out), file_encoded, encoded_len + 1, 0) == (ssize_t)encoded_len);
+        assert(memcmp(file_encoded, encoded, encoded_len) == 0);
+        fclose(fd_in);
+        fclose(fd_out);
+        
+        unibinary_encoder_t encoder;
+        assert(unibinary_encoder_init(&encoder, &options) == EXIT_SUCCESS);
+        size_t pos = 0, len = 0, consumed, produced;
+        int done = 0;
+        while(pos < SIZE) {
+            size_t in_len = SIZE - pos < 100000 ? SIZE - pos : 100000;
+            assert(unibinary_encoder_update(&encoder, src + pos, in_len, file_encoded + len, 7777, &consumed, &produced) == EXIT_SUCCESS);
+            pos += consumed;
+            len += produced;
+        }
+        while(!done) {
+            assert(unibinary_encoder_finish(&encoder, file_encoded + len, encoded_len - len < 7777 ? encoded_len - len : 7777, &produced, &done) == EXIT_SUCCESS);
+            len += produced;
+        }
+        unibinary_encoder_end(&encoder);
+        assert(len == encoded_len && memcmp(file_encoded, encoded, encoded_len) == 0);
+        free(file_encoded);
+        
+        // a character changed for another one of its range, a trailer cut, then the intact text
+        size_t position = encoded_len / 2;
+        while((encoded[position] & 0xF0) != 0xE0) position++;
+        
+        for(int k = 0; k < 3; k++) {
+            size_t len_k = k == 1 ? encoded_len - 12 : encoded_len;
+            if(k == 0) encoded[position + 2] ^= 1;
+            
+            uint8_t *decoded;
+            size_t decoded_len;
+            assert(unibinary_decode_bytes(encoded, len_k, &decoded, &decoded_len) == (k == 2 ? EXIT_SUCCESS : EXIT_FAILURE));
+            assert((decoded == NULL) == (k != 2));
+            free(decoded);
+            
+            // unibinary_validate() and unibinary_decode_buffer() do not sum
+            size_t offset, used;
+            assert(unibinary_validate(encoded, len_k, &offset) == EXIT_SUCCESS);
+            decoded = malloc(SIZE + 1);
+            assert(unibinary_decode_buffer(encoded, len_k, 1, decoded, SIZE + 1, &used, &decoded_len) == EXIT_SUCCESS);
+            assert(decoded_len == SIZE);
+            
+            // a changed character is found at the trailer, a cut one at the end
+            unibinary_decoder_t decoder;
+            assert(unibinary_decoder_init(&decoder) == EXIT_SUCCESS);
+            int status = unibinary_decoder_update(&decoder, encoded, len_k, decoded, SIZE + 1, &consumed, &produced);
+            assert(status == (k == 0 ? EXIT_FAILURE : EXIT_SUCCESS));
+            size_t finished;
+            if(status == EXIT_SUCCESS) status = unibinary_decoder_finish(&decoder, decoded + produced, SIZE + 1 - produced, &finished, &done);
+            assert(status == (k == 2 ? EXIT_SUCCESS : EXIT_FAILURE));
+            unibinary_decoder_end(&decoder);
+            free(decoded);
+            
+            // FILE *, with threads, fd and path, with holes
+            char encoded_path[] = "/tmp/unibinary_checksum_XXXXXX";
+            int fd_encoded = mkstemp(encoded_path);
+            assert(fd_encoded >= 0);
+            assert(write(fd_encoded, encoded, len_k) == (ssize_t)len_k);
+            
+            for(int api = 0; api < 4; api++) {
+                fd_in = fdopen(dup(fd_encoded), "rb");
+                fd_out = tmpfile();
+                lseek(fd_encoded, 0, SEEK_SET);
+                
+                unibinary_options_t decoding = { .threads = api == 1 ? 4 : 1, .sparse = api == 3 };
+                if(api < 2) {
+                    status = unibinary_decode_with_options(fd_in, fd_out, &decoding);
+                } else if (api == 2) {
+                    status = unibinary_decode_fd(fileno(fd_in), fileno(fd_out), &decoding);
+                } else {
+                    status = unibinary_decode_path(encoded_path, fileno(fd_out), &decoding);
+                }
+                fflush(fd_out);
+                assert(status == (k == 2 ? EXIT_SUCCESS : EXIT_FAILURE));
+                
+                if(k == 2) {
+                    decoded = malloc(SIZE + 1);
+                    assert(pread(fileno(fd_out), decoded, SIZE + 1, 0) == (ssize_t)SIZE);
+                    assert(memcmp(decoded, src, SIZE) == 0);
+                    free(decoded);
+                }
+                
+                fclose(fd_in);
+                fclose(fd_out);
+            }
+            
+            close(fd_encoded);
+            unlink(encoded_path);
+            
+            if(k == 0) encoded[position + 2] ^= 1;
+        }
+        
+        free(encoded);
+    }
+    
+    // batches between the header and the trailer are decoded and summed on the threads, in place or in order
+    size_t big_len = 8 * 1024 * 1024;
+    uint8_t *big = malloc(big_len);
+    for(size_t i = 0; i < big_len; i++) big[i] = rand();
+    options = (unibinary_options_t){ .checksum = 1 };
+    assert(unibinary_encode_bytes(big, big_len, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    
+    FILE *fd_encoded = tmpfile();
+    assert(fwrite(encoded, 1, encoded_len, fd_encoded) == encoded_len);
+    fflush(fd_encoded);
+    
+    size_t position = encoded_len / 2;
+    while(encoded[position] != 0xE4 && encoded[position] != 0xE5) position++;
+    
+    for(int corrupted = 0; corrupted < 2; corrupted++) {
+        for(int in_place = 0; in_place < 2; in_place++) {
+            FILE *fd_out = in_place ? tmpfile() : fopen("/dev/null", "wb");
+            rewind(fd_encoded);
+            
+            unibinary_options_t decoding = { .threads = 2 };
+            assert(unibinary_decode_with_options(fd_encoded, fd_out, &decoding) == (corrupted ? EXIT_FAILURE : EXIT_SUCCESS));
+            fflush(fd_out);
+            
+            if(in_place && !corrupted) {
+                uint8_t *decoded = malloc(big_len + 1);
+                assert(pread(fileno(fd_out), decoded, big_len + 1, 0) == (ssize_t)big_len);
+                assert(memcmp(decoded, big, big_len) == 0);
+                free(decoded);
+            }
+            
+            fclose(fd_out);
+        }
+        
+        // a U12b character of the middle batch
+        encoded[position + 2] ^= 1;
+        assert(pwrite(fileno(fd_encoded), encoded + position + 2, 1, position + 2) == 1);
+    }
+    
+    fclose(fd_encoded);
+    free(encoded);
+    free(big);
+    
+    // concatenated streams are checked one by one
+    uint8_t *a, *b;
+    size_t a_len, b_len;
+    assert(unibinary_encode_bytes(src, 1000, &options, &a, &a_len) == EXIT_SUCCESS);
+    assert(unibinary_encode_bytes(src + 1000, 1001, &options, &b, &b_len) == EXIT_SUCCESS);
+    uint8_t *both = malloc(a_len + b_len);
+    memcpy(both, a, a_len);
+    memcpy(both + a_len, b, b_len);
+    uint8_t *decoded;
+    size_t decoded_len;
+    assert(unibinary_decode_bytes(both, a_len + b_len, &decoded, &decoded_len) == EXIT_SUCCESS);
+    assert(decoded_len == 2001 && memcmp(decoded, src, 2001) == 0);
+    free(decoded);
+    
+    // but a stream cut before its trailer is not
+    memcpy(both + a_len - 12, b, b_len);
+    assert(unibinary_decode_bytes(both, a_len - 12 + b_len, &decoded, &decoded_len) == EXIT_FAILURE);
+    assert(decoded == NULL);
+    
+    free(a);
+    free(b);
+    free(both);
+    free(src);
+}
+
+void test_block_index() {
+    printf("== %s ==\n", __FUNCTION__);
+    
+    // runs across blocks, lone high bytes at their ends, random bytes and text
+    size_t SIZE = 1500000 + 11;
+    uint8_t *src = malloc(SIZE);
+    srand(47);
+    for(size_t i = 0; i < SIZE; i++) {
+        src[i] = i < 300000 ? rand() : (i < 700000 ? 0 : (i < 1000000 ? (i % 4099 < 3 ? 0xF0 : 'a' + rand() % 26) : rand()));
+    }
+    
+    char src_path[] = "/tmp/unibinary_index_XXXXXX";
+    int fd_src = mkstemp(src_path);
+    assert(fd_src >= 0);
+    assert(write(fd_src, src, SIZE) == (ssize_t)SIZE);
+    
+    size_t block_sizes[] = { 1, 2, 1000, 4096, 65536, 3000000 };
+    
+    for(int b = 0; b < 6; b++) {
+        for(int k = 0; k < 4; k++) {
+            
+            // the whole file for the larger blocks, its first 3001 bytes otherwise
+            size_t len = block_sizes[b] < 1000 ? 3001 : SIZE;
+            unibinary_options_t options = { .wrap_length = k & 1 ? 64 : 0, .checksum = k >> 1, .optimal = b == 0 && k == 3, .block_size = block_sizes[b] };
+            
+            uint8_t *encoded;
+            size_t encoded_len;
+            assert(unibinary_encode_bytes(src, len, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+            assert(unibinary_encoded_length(src, len, &options) == encoded_len);
+            assert(unibinary_encoded_length_max(len, &options) >= encoded_len);
+            
+            // the same text from the other encoders
+            if(len == SIZE) {
+                FILE *fd_out = tmpfile();
+                assert(unibinary_encode_path(src_path, fileno(fd_out), &options) == EXIT_SUCCESS);
+                assert(lseek(fileno(fd_out), 0, SEEK_CUR) == (off_t)encoded_len);
+                
+                uint8_t *file_encoded = malloc(encoded_len);
+                assert(pread(fileno(fd_out), file_encoded, encoded_len, 0) == (ssize_t)encoded_len);
+                assert(memcmp(file_encoded, encoded, encoded_len) == 0);
+                
+                FILE *fd_in = fopen(src_path, "rb");
+                rewind(fd_out);
+                assert(ftruncate(fileno(fd_out), 0) == 0);
+                assert(unibinary_encode_fd(fileno(fd_in), fileno(fd_out), &options) == EXIT_SUCCESS);
+                assert(pread(fileno(fd_out), file_encoded, encoded_len, 0) == (ssize_t)encoded_len);
+                assert(memcmp(file_encoded, encoded, encoded_len) == 0);
+                
+                rewind(fd_in);
+                fclose(fd_out);
+                fd_out = tmpfile();
+                assert(unibinary_encode_with_options(fd_in, fd_out, &options) == EXIT_SUCCESS);
+                fflush(fd_out);
+                assert(pread(fileno(fd_out), file_encoded, encoded_len, 0) == (ssize_t)encoded_len);
+                assert(memcmp(file_encoded, encoded, encoded_len) == 0);
+                
+                free(file_encoded);
+                fclose(fd_in);
+                fclose(fd_out);
+            }
+            
+            // the decoders skip the index
+            uint8_t *decoded;
+            size_t decoded_len;
+            assert(unibinary_decode_bytes(encoded, encoded_len, &decoded, &decoded_len) == EXIT_SUCCESS);
+            assert(decoded_len == len && memcmp(decoded, src, len) == 0);
+            
+            size_t offset;
+            assert(unibinary_validate(encoded, encoded_len, &offset) == EXIT_SUCCESS);
+            
+            // ranges within a block, across blocks, up to the end and past it
+            size_t ranges[][2] = { {0, 0}, {0, 1}, {5, 6}, {999, 1001}, {0, len}, {len - 1, len}, {len / 3, 2 * len / 3}, {4095, 8193}, {len - 2, len + 100}, {len, len + 1}, {len + 5, len + 10} };
+            for(int r = 0; r < 11; r++) {
+                size_t from = ranges[r][0], to = ranges[r][1];
+                size_t expected = (to < len ? to : len) - (from < len ? from : len);
+                
+                memset(decoded, 0x55, len);
+                assert(unibinary_decode_range(encoded, encoded_len, from, to, decoded, len, &decoded_len) == EXIT_SUCCESS);
+                assert(decoded_len == (from < to ? expected : 0));
+                assert(memcmp(decoded, src + (from < len ? from : len), decoded_len) == 0);
+            }
+            
+            // an output too small
+            if(len > 1) assert(unibinary_decode_range(encoded, encoded_len, 0, len, decoded, len - 1, &decoded_len) == EXIT_FAILURE);
+            
+            free(decoded);
+            free(encoded);
+        }
+    }
+    
+    // wrapped text piped through a tool which ends it with a newline
+    unibinary_options_t options = { .wrap_length = 10, .block_size = 100 };
+    uint8_t *encoded;
+    size_t encoded_len;
+    assert(unibinary_encode_bytes(src, 1000, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    encoded = realloc(encoded, encoded_len + 1);
+    encoded[encoded_len] = '\n';
+    uint8_t decoded[1000];
+    size_t decoded_len;
+    assert(unibinary_decode_range(encoded, encoded_len + 1, 150, 420, decoded, sizeof(decoded), &decoded_len) == EXIT_SUCCESS);
+    assert(decoded_len == 270 && memcmp(decoded, src + 150, 270) == 0);
+    
+    // a changed offset of block 2
+    size_t index_start = encoded_len - 18 - 12 * 10;
+    assert(memcmp(encoded + index_start + 24, "\xe9\xbc\x82", 3) == 0);
+    encoded[index_start + 24 + 11] -= 1;
+    assert(unibinary_decode_range(encoded, encoded_len, 150, 420, decoded, sizeof(decoded), &decoded_len) == EXIT_FAILURE);
+    assert(unibinary_decode_range(encoded, encoded_len, 0, 100, decoded, sizeof(decoded), &decoded_len) == EXIT_SUCCESS);
+    free(encoded);
+    
+    // no index
+    options = (unibinary_options_t){ .version = 2 };
+    assert(unibinary_encode_bytes(src, 1000, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+    assert(unibinary_decode_range(encoded, encoded_len, 0, 10, decoded, sizeof(decoded), &decoded_len) == EXIT_FAILURE);
+    free(encoded);
+    
+    // blocks too large, and the streaming encoder
+    options = (unibinary_options_t){ .block_size = 0x1000000 };
+    assert(unibinary_encode_bytes_into(src, 10, &options, decoded, sizeof(decoded), &decoded_len) == EXIT_FAILURE);
+    options.block_size = 4096;
+    unibinary_encoder_t encoder;
+    assert(unibinary_encoder_init(&encoder, &options) == EXIT_FAILURE);
+    
+    close(fd_src);
+    unlink(src_path);
+    free(src);
+}
+
+typedef struct {
+    size_t allocs;
+    size_t frees;
+    pthread_t thread; // the calling thread, the threads of .threads don't allocate
+} counts_t;
+
+static void *counting_alloc(void *ctx, size_t size) {
+    assert(pthread_equal(pthread_self(), ((counts_t *)ctx)->thread));
+    ((counts_t *)ctx)->allocs++;
+    return malloc(size);
+}
+
+static void counting_free(void *ctx, void *p) {
+    assert(p != NULL);
+    assert(pthread_equal(pthread_self(), ((counts_t *)ctx)->thread));
+    ((counts_t *)ctx)->frees++;
+    free(p);
+}
+
+void test_allocator() {
+    
+    printf("== %s ==\n", __func__);
+    
+    size_t SIZE = 300000;
+    uint8_t *src = malloc(SIZE);
+    srand(53);
+    for(size_t i = 0; i < SIZE; i++) {
+        src[i] = i % 5000 < 1000 ? 0 : (i < SIZE / 2 ? 'a' + rand() % 26 : rand());
+    }
+    
+    counts_t counts = { 0, 0, pthread_self() };
+    unibinary_allocator_t allocator = { counting_alloc, counting_free, &counts };
+    
+    // the same output as with malloc(), every allocation given back
+    unibinary_options_t variants[] = {
+        { .wrap_length = 0 },
+        { .wrap_length = 64, .optimal = 1 },
+        { .version = 2, .checksum = 1, .block_size = 4096 },
+        { .wrap_length = 10, .threads = 4 },
+    };
+    
+    for(int v = 0; v < 4; v++) {
+        unibinary_options_t options = variants[v];
+        
+        uint8_t *expected;
+        size_t expected_len;
+        assert(unibinary_encode_bytes(src, SIZE, &options, &expected, &expected_len) == EXIT_SUCCESS);
+        
+        options.allocator = &allocator;
+        size_t allocs = counts.allocs;
+        
+        uint8_t *encoded;
+        size_t encoded_len;
+        assert(unibinary_encode_bytes(src, SIZE, &options, &encoded, &encoded_len) == EXIT_SUCCESS);
+        assert(counts.allocs > allocs);
+        assert(encoded_len == expected_len && memcmp(encoded, expected, encoded_len) == 0);
+        
+        uint8_t *decoded;
+        size_t decoded_len;
+        assert(unibinary_decode_bytes_with_options(encoded, encoded_len, &options, &decoded, &decoded_len) == EXIT_SUCCESS);
+        assert(decoded_len == SIZE && memcmp(decoded, src, SIZE) == 0);
+        counting_free(&counts, decoded);
+        
+        // blocks partly in the range go through a buffer
+        if(options.block_size > 0) {
+            decoded = malloc(SIZE);
+            allocs = counts.allocs;
+            size_t frees = counts.frees;
+            assert(unibinary_decode_range_with_options(encoded, encoded_len, 100, 10000, &options, decoded, SIZE, &decoded_len) == EXIT_SUCCESS);
+            assert(counts.allocs == allocs + 1 && counts.frees == frees + 1);
+            assert(decoded_len == 9900 && memcmp(decoded, src + 100, 9900) == 0);
+            free(decoded);
+        }
+        
+        // files, in parallel with threads
+        FILE *fd_in = tmpfile();
+        FILE *fd_encoded = tmpfile();
+        FILE *fd_out = tmpfile();
+        assert(fwrite(src, 1, SIZE, fd_in) == SIZE);
+        fflush(fd_in);
+        rewind(fd_in);
+        
+        allocs = counts.allocs;
+        assert(unibinary_encode_fd(fileno(fd_in), fileno(fd_encoded), &options) == EXIT_SUCCESS);
+        assert(counts.allocs > allocs);
+        assert(lseek(fileno(fd_encoded), 0, SEEK_CUR) == (off_t)expected_len);
+        
+        lseek(fileno(fd_encoded), 0, SEEK_SET);
+        size_t error_offset;
+        allocs = counts.allocs;
+        size_t frees = counts.frees;
+        assert(unibinary_validate_fd_with_options(fileno(fd_encoded), &options, &error_offset) == EXIT_SUCCESS);
+        assert(counts.allocs > allocs && counts.allocs - allocs == counts.frees - frees);
+        assert(error_offset == expected_len);
+        
+        lseek(fileno(fd_encoded), 0, SEEK_SET);
+        assert(unibinary_decode_fd(fileno(fd_encoded), fileno(fd_out), &options) == EXIT_SUCCESS);
+        decoded = malloc(SIZE + 1);
+        assert(pread(fileno(fd_out), decoded, SIZE + 1, 0) == (ssize_t)SIZE);
+        assert(memcmp(decoded, src, SIZE) == 0);
+        free(decoded);
+        
+        fclose(fd_in);
+        fclose(fd_encoded);
+        fclose(fd_out);
+        
+        counting_free(&counts, encoded);
+        free(expected);
+        assert(counts.allocs == counts.frees);
+    }
+    
+    // strings
+    unibinary_options_t options = { .wrap_length = 7, .allocator = &allocator };
+    wchar_t *w;
+    assert(unibinary_encode_string_with_options("Hello, World!", &w, &options) == EXIT_SUCCESS);
+    char *s;
+    long s_len;
+    assert(unibinary_decode_string_with_options(w, &s, &s_len, &options) == EXIT_SUCCESS);
+    assert(s_len == 13 && strcmp(s, "Hello, World!") == 0);
+    counting_free(&counts, s);
+    counting_free(&counts, w);
+    assert(counts.allocs == counts.frees);
+    
+    // streaming, whose buffers are released by end()
+    size_t capacity = UNIBINARY_ENCODED_MAX_UTF8_WRAPPED_LENGTH(SIZE, 7);
+    uint8_t *encoded = malloc(capacity);
+    uint8_t *decoded = malloc(SIZE);
+    
+    size_t allocs = counts.allocs;
+    unibinary_encoder_t encoder;
+    assert(unibinary_encoder_init(&encoder, &options) == EXIT_SUCCESS);
+    assert(counts.allocs == allocs + 2);
+    
+    size_t consumed, produced, encoded_len;
+    assert(unibinary_encoder_update(&encoder, src, SIZE, encoded, capacity, &consumed, &produced) == EXIT_SUCCESS);
+    assert(consumed == SIZE);
+    encoded_len = produced;
+    int done = 0;
+    while(!done) {
+        assert(unibinary_encoder_finish(&encoder, encoded + encoded_len, capacity - encoded_len, &produced, &done) == EXIT_SUCCESS);
+        encoded_len += produced;
+    }
+    unibinary_encoder_end(&encoder);
+    assert(counts.allocs == counts.frees);
+    
+    unibinary_decoder_t decoder;
+    assert(unibinary_decoder_init_with_options(&decoder, &options) == EXIT_SUCCESS);
+    size_t decoded_len = 0;
+    size_t in_pos = 0;
+    while(in_pos < encoded_len) {
+        assert(unibinary_decoder_update(&decoder, encoded + in_pos, encoded_len - in_pos, decoded + decoded_len, SIZE - decoded_len, &consumed, &produced) == EXIT_SUCCESS);
+        in_pos += consumed;
+        decoded_len += produced;
+    }
+    done = 0;
+    while(!done) {
+        assert(unibinary_decoder_finish(&decoder, decoded + decoded_len, SIZE - decoded_len, &produced, &done) == EXIT_SUCCESS);
+        decoded_len += produced;
+    }
+    unibinary_decoder_end(&decoder);
+    assert(decoded_len == SIZE && memcmp(decoded, src, SIZE) == 0);
+    assert(counts.allocs == counts.frees);
+    
+    // an arena for many small calls, whose chunks are merged by reset()
+    unibinary_arena_t arena;
+    unibinary_arena_init(&arena, 4096);
+    options = (unibinary_options_t){ .version = 2, .checksum = 1, .allocator = &arena.allocator };
+    
+    for(int round = 0; round < 2; round++) {
+        for(size_t i = 0; i < 100; i++) {
+            size_t len = 1 + i * 37;
+            uint8_t *e, *d;
+            size_t e_len, d_len;
+            assert(unibinary_encode_bytes(src + i * 997, len, &options, &e, &e_len) == EXIT_SUCCESS);
+            assert((uintptr_t)e % _Alignof(max_align_t) == 0);
+            assert(unibinary_decode_bytes_with_options(e, e_len, &options, &d, &d_len) == EXIT_SUCCESS);
+            assert(d_len == len && memcmp(d, src + i * 997, len) == 0);
+        }
+        
+        // several chunks the first time, a single one as large as them after reset()
+        size_t chunk_size = arena.chunk_size;
+        assert(arena.chunks != NULL);
+        unibinary_arena_reset(&arena);
+        assert(round == 0 ? arena.chunks == NULL && arena.chunk_size > 4096 : arena.chunks != NULL && arena.chunk_size == chunk_size);
+    }
+    
+    // allocations are taken back in reverse order
+    void *a = arena.allocator.alloc(arena.allocator.ctx, 100);
+    void *b = arena.allocator.alloc(arena.allocator.ctx, 3);
+    arena.allocator.free(arena.allocator.ctx, a); // not the last one, kept
+    arena.allocator.free(arena.allocator.ctx, b);
+    assert(arena.allocator.alloc(arena.allocator.ctx, 3) == b);
+    arena.allocator.free(arena.allocator.ctx, b);
+    arena.allocator.free(arena.allocator.ctx, a);
+    assert(arena.allocator.alloc(arena.allocator.ctx, 100) == a);
+    unibinary_arena_reset(&arena);
+    
+    // the buffers of an optimal streaming encoder are allocated once, 8 MB of steps keep the arena at their size
+    // about 30 MB, most of it the 20 bytes per byte of a v2 window the parse takes
+    options = (unibinary_options_t){ .version = 2, .optimal = 1, .allocator = &arena.allocator };
+    assert(unibinary_encoder_init(&encoder, &options) == EXIT_SUCCESS);
+    size_t step = 64 * 1024;
+    capacity = UNIBINARY_ENCODED_MAX_UTF8_LENGTH(SIZE);
+    for(size_t n = 0; n < 8 * 1024 * 1024; n += step) {
+        const uint8_t *in = src + (n / step % 4) * step;
+        for(size_t in_pos = 0; in_pos < step; in_pos += consumed) {
+            assert(unibinary_encoder_update(&encoder, in + in_pos, step - in_pos, encoded, capacity, &consumed, &produced) == EXIT_SUCCESS);
+        }
+    }
+    for(done = 0; !done; ) {
+        assert(unibinary_encoder_finish(&encoder, encoded, capacity, &produced, &done) == EXIT_SUCCESS);
+    }
+    unibinary_encoder_end(&encoder);
+    
+    unibinary_arena_reset(&arena);
+    assert(arena.chunk_size < 40 * 1024 * 1024);
+    
+    unibinary_arena_end(&arena);
+    assert(arena.chunks == NULL);
+    
+    free(encoded);
+    free(decoded);
+    free(src);
+}
+
 int main(int argc, const char * argv[]) {
     
     setlocale(LC_CTYPE, "UTF-8");
     setlocale(LC_CTYPE, "");
     
-    printf("The current locale is %s.\n", setlocale(LC_CTYPE, ""));
+    // the tests read and write UTF-8 through the wide char functions
+    if(MB_CUR_MAX == 1) setlocale(LC_CTYPE, "C.UTF-8");
+    
+    printf("The current locale is %s.\n", setlocale(LC_CTYPE, NULL));
     
     test_empty_string();
     test_one_char();
@@ -758,6 +2886,30 @@ int main(int argc, const char * argv[]) {
     test_string_encoding();
     test_string_decoding();
     test_string_decoding_with_newline();
+    test_encode_buffer_chunks();
+    test_encode_buffer_utf8();
+    test_decode_buffer();
+    test_bytes_from_u1_u2();
+    test_encode_buffer_utf8_matches_wide();
+    test_decode_buffer_u12b_runs();
+    test_encode_buffer_prescan_matches_scalar();
+    test_encode_with_options_threads();
+    test_decode_with_options_threads();
+    test_encode_decode_path();
+    test_encode_decode_bytes();
+    test_encoded_decoded_length();
+    test_streaming_encoder_decoder();
+    test_encode_decode_fd();
+    test_encode_decode_batch();
+    test_concurrent_calls();
+    test_decode_sparse();
+    test_format_v2();
+    test_encode_optimal();
+    test_stats();
+    test_validate();
+    test_checksum();
+    test_block_index();
+    test_allocator();
 
     printf("-- ALL TESTS ARE OK --\n");
     
@@ -6,23 +6,94 @@
 //  Copyright (c) 2013 Nicolas Seriot. All rights reserved.
 //
 
+#ifdef __linux__
+#define _GNU_SOURCE // fallocate()
+#endif
+
 #include "unibinary.h"
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UNIBINARY_X86_KERNELS 1
+#endif
+
+#if defined(__linux__) && defined(__has_include) && !defined(UNIBINARY_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define UNIBINARY_IO_URING 1
+#endif
+#endif
 
 // encodes ascii 7-bits characters
-wchar_t U12a_0_0_start = 0x5E00; // CJK Unified Ideographs (subset) - encodes 12 bits (2 ascii) - MSB 0,0
-wchar_t U12a_0_1_start = 0x6E00; // CJK Unified Ideographs (subset) - encodes 12 bits (2 ascii) - MSB 0,1
-wchar_t U12a_1_0_start = 0x7E00; // CJK Unified Ideographs (subset) - encodes 12 bits (2 ascii) - MSB 1,0
-wchar_t U12a_1_1_start = 0x8E00; // CJK Unified Ideographs (subset) - encodes 12 bits (2 ascii) - MSB 1,1
-wchar_t U12a_length = 0x1000;
+static const wchar_t U12a_0_0_start = 0x5E00; // CJK Unified Ideographs (subset) - encodes 12 bits (2 ascii) - MSB 0,0
+static const wchar_t U12a_0_1_start = 0x6E00; // CJK Unified Ideographs (subset) - encodes 12 bits (2 ascii) - MSB 0,1
+static const wchar_t U12a_1_0_start = 0x7E00; // CJK Unified Ideographs (subset) - encodes 12 bits (2 ascii) - MSB 1,0
+static const wchar_t U12a_1_1_start = 0x8E00; // CJK Unified Ideographs (subset) - encodes 12 bits (2 ascii) - MSB 1,1
+static const wchar_t U12a_length = 0x1000;
 
 // encodes arbitrary bits
-wchar_t U12b_start = 0x4E00; // CJK Unified Ideographs (subset) - encodes 12 bits
-wchar_t U12b_length = 0x1000;
-wchar_t U8_start = 0x0400;   // Cyrillic                        - encodes 8 bits
-wchar_t U8_length = 0x0100;
+static const wchar_t U12b_start = 0x4E00; // CJK Unified Ideographs (subset) - encodes 12 bits
+static const wchar_t U12b_length = 0x1000;
+static const wchar_t U8_start = 0x0400;   // Cyrillic                        - encodes 8 bits
+static const wchar_t U8_length = 0x0100;
+
+// the U12a ranges follow each other, by the MSB of the two ascii characters
+#define UB_U12A_START(msb) (U12a_0_0_start + (msb) * U12a_length)
+
+// UTF-8 lengths of the characters of the ranges above, which the x86 kernels and the fast paths of decoded_length_of() assume too
+#define UB_U8_UTF8_LENGTH 2
+#define UB_U12_UTF8_LENGTH 3
+
+// format version 2
+static const wchar_t V2_header_start = 0x9E00; // first character, the low byte holds feature bits
+static const wchar_t V2_long_run = 0x9F00;     // then U8(B), U12b(N >> 12), U12b(N & 0xFFF) for runs of up to 0xFFFFF bytes
+static const wchar_t V2_checksum = 0x9F01;     // then U12b(C >> 20), U12b((C >> 8) & 0xFFF), U12b(C & 0xFF), the CRC32C of the bytes since the header
+static const wchar_t V2_block = 0x9F02;        // then 3 U12b, the UTF-8 offset of a block in the text, one per block after the data
+static const wchar_t V2_index = 0x9F03;        // then 5 U12b, the block size << 36 | the decoded length, last
+
+#define UNIBINARY_FEATURE_LONG_RUNS 0x01
+#define UNIBINARY_FEATURE_CHECKSUM 0x02
+#define UNIBINARY_FEATURE_INDEX 0x04
+#define UNIBINARY_KNOWN_FEATURES (UNIBINARY_FEATURE_LONG_RUNS | UNIBINARY_FEATURE_CHECKSUM | UNIBINARY_FEATURE_INDEX)
+
+#define UNIBINARY_CHUNK_SIZE (64 * 1024)
+#define UNIBINARY_MAX_REPEATS 0xFFF
+#define UNIBINARY_V2_MAX_REPEATS 0xFFFFF
+
+// UTF-8 bytes of the longest token, the end of a block index, a checksum trailer takes 12 and a v2 long run 11
+#define UNIBINARY_MAX_TOKEN_LENGTH 18
+
+// decoded bytes written at once, room for a v2 long run
+#define UNIBINARY_DECODED_CHUNK_SIZE (1024 * 1024)
+
+// bytes encoded by each thread, and after a split, bytes in which the serial parse must meet the thread's parse
+#define UNIBINARY_PARALLEL_CHUNK_SIZE (1024 * 1024)
+#define UNIBINARY_RESYNC_WINDOW 4096
+
+// input bytes taken at once by the streaming contexts
+#define UNIBINARY_STREAM_STEP 4096
+
+// shorter runs of zeros are written even to sparse outputs
+#define UNIBINARY_HOLE_LENGTH (64 * 1024)
+
+// bytes read at once by the fd pipeline, while the previous chunk is encoded or decoded
+#define UNIBINARY_PIPELINE_CHUNK_SIZE (1024 * 1024)
+
+// bytes parsed at once by the optimal encoder, and bytes at the end of a window whose tokens wait for the next one
+#define UNIBINARY_OPTIMAL_WINDOW (256 * 1024)
+#define UNIBINARY_OPTIMAL_LOOKAHEAD (UNIBINARY_MAX_REPEATS + 2)
 
 int is_in_U08b(wchar_t i) {
     return i >= U8_start && i < (U8_start + U8_length);
@@ -184,7 +255,32 @@ int int_from_u12b(wchar_t u, wchar_t* i) {
     return EXIT_SUCCESS;
 }
 
-int repeated_bytes_from_unichars(wchar_t u1, wchar_t u2, uint8_t **dst, size_t *dstSize) {
+// class of a code point, looked up with its high byte, all ranges are aligned on 0x100
+enum {
+    UB_INVALID = 0,
+    UB_U8,
+    UB_U12B,
+    UB_HEADER,
+    UB_LONG_RUN,
+    UB_U12A_0_0,
+    UB_U12A_0_1,
+    UB_U12A_1_0,
+    UB_U12A_1_1
+};
+
+static const uint8_t class_from_high_byte[256] = {
+    [0x04]        = UB_U8,       // U8_start
+    [0x4E ... 0x5D] = UB_U12B,     // U12b_start
+    [0x5E ... 0x6D] = UB_U12A_0_0, // U12a_0_0_start
+    [0x6E ... 0x7D] = UB_U12A_0_1, // U12a_0_1_start
+    [0x7E ... 0x8D] = UB_U12A_1_0, // U12a_1_0_start
+    [0x8E ... 0x9D] = UB_U12A_1_1, // U12a_1_1_start
+    [0x9E]        = UB_HEADER,   // V2_header_start
+    [0x9F]        = UB_LONG_RUN, // V2_long_run
+};
+
+// writes n times the byte at *cursor, which must have room for 0xFFF bytes
+int repeated_bytes_from_unichars(wchar_t u1, wchar_t u2, uint8_t **cursor) {
     
     uint8_t b;
     if(int_from_u08b(u1, &b) != 0) return EXIT_FAILURE;
@@ -197,15 +293,8 @@ int repeated_bytes_from_unichars(wchar_t u1, wchar_t u2, uint8_t **dst, size_t *
         return EXIT_FAILURE;
     }
     
-    uint8_t *out = malloc(n * sizeof(uint8_t));
-    if(out == NULL) {
-        return EXIT_FAILURE;
-    }
-    
-    memset(out, b, n);
-    
-    *dstSize = n;
-    *dst = out;
+    memset(*cursor, b, n);
+    *cursor += n;
     
     return EXIT_SUCCESS;
 }
@@ -247,431 +336,4689 @@ int two_bytes_from_unichars(wchar_t u1, wchar_t u2, uint8_t *b1, uint8_t *b2) {
     return EXIT_SUCCESS;
 }
 
-int bytes_from_u1_u2(wchar_t u1, wchar_t u2, uint8_t **buffer, size_t *bufferSize) {
+// number of bytes decoded from a two characters token
+static inline int token_length(wchar_t u2, int k1, int k2, size_t *n) {
     
-    int u1_in_U12b = is_in_U12b(u1);
-    int u2_in_U12b = is_in_U12b(u2);
+    if(k1 == UB_U12B && k2 == UB_U12B) {
+        *n = 3;
+    } else if (k1 == UB_U8 && k2 == UB_U12B) {
+        *n = u2 - U12b_start;
+    } else if (k1 == UB_U8 && k2 == UB_U8) {
+        *n = 2;
+    } else {
+        return EXIT_FAILURE;
+    }
     
-    int u1_in_U8b = is_in_U08b(u1);
-    int u2_in_U8b = is_in_U08b(u2);
+    return EXIT_SUCCESS;
+}
+
+// writes the bytes of a two characters token at *cursor, which must have room for token_length() bytes
+static inline int bytes_from_token(wchar_t u1, int k1, wchar_t u2, int k2, uint8_t **cursor) {
     
-    if(u1_in_U12b && u2_in_U12b) {
-        
-        *buffer = (uint8_t *)malloc(3 * sizeof(uint8_t));
-        if(buffer == NULL) {
-            fprintf(stderr, "-- malloc error\n");
-            return EXIT_FAILURE;
-        }
-        
-        *bufferSize = 3;
-        
-        uint8_t b0, b1, b2;
-        
-        int status = three_bytes_from_unichars(u1, u2, &b0, &b1, &b2);
-        if(status != 0) return EXIT_FAILURE;
-        
-        *(*buffer+0) = b0;
-        *(*buffer+1) = b1;
-        *(*buffer+2) = b2;
-        
-        return EXIT_SUCCESS;
-        
-    } else if (u1_in_U8b && u2_in_U12b) {
-        
-        size_t dstSize;
-        
-        uint8_t *out;
-        
-        int status = repeated_bytes_from_unichars(u1, u2, &out, &dstSize);
-        if(status != 0) return EXIT_FAILURE;
-        
-        *bufferSize = dstSize;
-        
-        *buffer = out;
-        
-        return EXIT_SUCCESS;
-    } else if (u1_in_U8b && u2_in_U8b) {
-        
-        uint8_t b0, b1;
-        int status = two_bytes_from_unichars(u1, u2, &b0, &b1);
-        if(status != 0) return EXIT_FAILURE;
-        
-        uint8_t *out = malloc(2 * sizeof(uint8_t));
-        if(out == NULL) {
-            fprintf(stderr, "-- malloc error\n");
-            return EXIT_FAILURE;
-        }
-        
-        *bufferSize = 2;
-        
-        out[0] = b0;
-        out[1] = b1;
-        
-        *buffer = out;
-        
-        return EXIT_SUCCESS;
-    } else if (u1_in_U8b && u2 == '\n') {
-        
-        *buffer = (uint8_t *)malloc(1 * sizeof(uint8_t));
-        if(buffer == NULL) {
-            fprintf(stderr, "-- malloc error\n");
-            return EXIT_FAILURE;
-        }
-        
-        *bufferSize = 1;
-        
-        uint8_t b0;
-        
-        int success = int_from_u08b(u1, &b0);
-        if(success == EXIT_FAILURE) {
-            fprintf(stderr, "-- error\n");
-            return EXIT_FAILURE;
-        }
-        
-        *buffer[0] = b0;
-        return EXIT_SUCCESS;
+    uint8_t *o = *cursor;
+    
+    if(k1 == UB_U12B && k2 == UB_U12B) {
+        // 3 bytes, same as three_bytes_from_unichars()
+        wchar_t i1 = u1 - U12b_start;
+        wchar_t i2 = u2 - U12b_start;
+        o[0] = i1 >> 4;
+        o[1] = ((i1 & 0xF) << 4) | (i2 >> 8);
+        o[2] = i2 & 0xFF;
+        *cursor = o + 3;
+    } else if (k1 == UB_U8 && k2 == UB_U12B) {
+        return repeated_bytes_from_unichars(u1, u2, cursor);
+    } else if (k1 == UB_U8 && k2 == UB_U8) {
+        o[0] = u1 - U8_start;
+        o[1] = u2 - U8_start;
+        *cursor = o + 2;
+    } else {
+        return EXIT_FAILURE;
     }
     
-    fprintf(stderr, "-- bytes_from_u1_u2() cannot deal with u1:0x%x u2:0x%x\n", u1, u2);
-    fprintf(stderr, "   u1 in U8b:%d U12b:%d, u2 in U8b:%d U12b:%d\n", u1_in_U8b, u1_in_U12b, u2_in_U8b, u2_in_U12b);
-    return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+static inline int class_of(wchar_t u) {
+    return u < 0x10000 ? class_from_high_byte[u >> 8] : UB_INVALID;
 }
 
-int next_non_newline_char(FILE *src, wchar_t *wc) {
-    do {
-        *wc = fgetwc(src);
-    } while (*wc == '\n');
+// writes the bytes of the (u1, u2) token at *cursor, which must have room for 0xFFF bytes
+int bytes_from_u1_u2(wchar_t u1, wchar_t u2, uint8_t **cursor) {
+    
+    int k1 = class_of(u1);
+    int k2 = class_of(u2);
+    
+    if(k1 == UB_U8 && u2 == '\n') {
+        *(*cursor)++ = u1 - U8_start;
+        return EXIT_SUCCESS;
+    }
+    
+    if(bytes_from_token(u1, k1, u2, k2, cursor) != 0) {
+        fprintf(stderr, "-- bytes_from_u1_u2() cannot deal with u1:0x%x u2:0x%x\n", u1, u2);
+        fprintf(stderr, "   u1 in U8b:%d U12b:%d, u2 in U8b:%d U12b:%d\n", k1 == UB_U8, k1 == UB_U12B, k2 == UB_U8, k2 == UB_U12B);
+        return EXIT_FAILURE;
+    }
+    
     return EXIT_SUCCESS;
 }
 
-int unibinary_decode(FILE *src, FILE *dst) {
+enum {
+    UB_CHAR_OK = 0,
+    UB_CHAR_NONE,   // no complete character left
+    UB_CHAR_INVALID
+};
+
+// reads the next character that is not a newline, *p is moved past the newlines even if no character is found
+static inline int next_utf8_char(const uint8_t **p, const uint8_t *end, wchar_t *u, int *class) {
+    
+    const uint8_t *s = *p;
+    
+    while(s < end && *s == '\n') s++;
+    *p = s;
+    
+    if(s == end) return UB_CHAR_NONE;
+    
+    uint8_t b0 = s[0];
+    size_t len;
+    
+    if(b0 >= 0xC0 && b0 < 0xE0) {
+        if(end - s < 2) return UB_CHAR_NONE;
+        if((s[1] & 0xC0) != 0x80) return UB_CHAR_INVALID;
+        *u = ((b0 & 0x1F) << 6) | (s[1] & 0x3F);
+        len = 2;
+    } else if (b0 >= 0xE0 && b0 < 0xF0) {
+        if(end - s < 3) return UB_CHAR_NONE;
+        if((s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80) return UB_CHAR_INVALID;
+        *u = ((b0 & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        len = 3;
+    } else {
+        return UB_CHAR_INVALID;
+    }
+    
+    *class = class_from_high_byte[*u >> 8];
+    
+    // *p stays on a character out of the ranges, for the offsets of errors
+    if(*class == UB_INVALID) return UB_CHAR_INVALID;
+    
+    *p = s + len;
+    
+    return UB_CHAR_OK;
+}
+
+// reads the U8, U12b, U12b characters of a long run whose marker u was just read
+static inline int long_run_after(const uint8_t **p, const uint8_t *end, wchar_t u, uint8_t *b, size_t *n) {
+    
+    wchar_t u1, u2, u3;
+    int k1, k2, k3;
+    
+    if(u != V2_long_run) return UB_CHAR_INVALID;
     
-    int i = 0;
+    int r = next_utf8_char(p, end, &u1, &k1);
+    if(r == UB_CHAR_OK) r = next_utf8_char(p, end, &u2, &k2);
+    if(r == UB_CHAR_OK) r = next_utf8_char(p, end, &u3, &k3);
+    if(r != UB_CHAR_OK) return r;
     
-    wchar_t c, c_next;
+    if(k1 != UB_U8 || k2 != UB_U12B || k3 != UB_U12B) return UB_CHAR_INVALID;
     
-    int fwd_chars_read = 0;
+    *b = u1 - U8_start;
+    *n = ((size_t)(u2 - U12b_start) << 12) | (size_t)(u3 - U12b_start);
     
-    while (1) {
+    // the top 4 bits are reserved, see README
+    return *n > UNIBINARY_V2_MAX_REPEATS ? UB_CHAR_INVALID : UB_CHAR_OK;
+}
+
+// reads the U12b, U12b, U12b characters of a checksum trailer whose marker was just read
+static inline int checksum_after(const uint8_t **p, const uint8_t *end, uint32_t *crc) {
+    
+    wchar_t u1, u2, u3;
+    int k1, k2, k3;
+    
+    int r = next_utf8_char(p, end, &u1, &k1);
+    if(r == UB_CHAR_OK) r = next_utf8_char(p, end, &u2, &k2);
+    if(r == UB_CHAR_OK) r = next_utf8_char(p, end, &u3, &k3);
+    if(r != UB_CHAR_OK) return r;
+    
+    if(k1 != UB_U12B || k2 != UB_U12B || k3 != UB_U12B || u3 - U12b_start > 0xFF) return UB_CHAR_INVALID;
+    
+    *crc = (uint32_t)(u1 - U12b_start) << 20 | (uint32_t)(u2 - U12b_start) << 8 | (uint32_t)(u3 - U12b_start);
+    
+    return UB_CHAR_OK;
+}
+
+// reads the U12b characters of a block index token whose marker u was just read, 3 for a block and 5 for the end
+static inline int index_after(const uint8_t **p, const uint8_t *end, wchar_t u, uint64_t *value) {
+    
+    *value = 0;
+    
+    for(int i = 0; i < (u == V2_index ? 5 : 3); i++) {
+        wchar_t c;
+        int k;
         
-        if(fwd_chars_read == 0) {
-            next_non_newline_char(src, &c);
-            next_non_newline_char(src, &c_next);
-            fwd_chars_read = 2;
-        } else if (fwd_chars_read == 1) {
-            c = c_next;
-            next_non_newline_char(src, &c_next);
-            fwd_chars_read = 2;
-        } else {
-            // pass
-        }
+        int r = next_utf8_char(p, end, &c, &k);
+        if(r != UB_CHAR_OK) return r;
+        if(k != UB_U12B) return UB_CHAR_INVALID;
         
-        if(is_in_U12a(c)) {
-            uint8_t b0;
-            uint8_t b1;
-            
-            int error = U12a_to_8_8(c, &b0, &b1);
-            if(error != 0) {
-                fprintf(stderr, "-- error in U12a_to_8_8()\n");
-                return EXIT_FAILURE;
-            }
-            
-            fwrite(&b0, 1, 1, dst);
-            fwrite(&b1, 1, 1, dst);
-            
-            i += 1;
-            
-            fwd_chars_read -= 1;
-            
-        } else if (c != WEOF && c_next != WEOF) {
-            wchar_t u1 = c;
-            wchar_t u2 = c_next;
-            
-            uint8_t *outBuffer;
-            size_t outBufferSize;
-            
-            int error = bytes_from_u1_u2(u1, u2, &outBuffer, &outBufferSize);
-            if(error != 0) {
-                fprintf(stderr, "-- error in bytes_from_u1_u2()\n");
-                return EXIT_FAILURE;
-            }
-            
-            if(outBuffer == NULL) {
-                fprintf(stderr, "-- outBuffer == NULL\n");
-            }
-            
-            fwrite(outBuffer, 1, outBufferSize, dst);
-            
-            i += 2;
-            
-            fwd_chars_read -= 2;
-            
-        } else if (is_in_U08b(c)) {
-            uint8_t b0;
-            int status = int_from_u08b(c, &b0);
-            if(status != 0) {
-                fprintf(stderr, "-- error in int_from_u08b()\n");
-                return EXIT_FAILURE;
-            }
-            
-            fwrite(&b0, 1, 1, dst);
-            
-            i += 1;
-            
-            fwd_chars_read -= 1;
-            
-        } else if (c == '\n') {
-            i += 1;
-            
-            if(fwd_chars_read > 0) {
-                fwd_chars_read -= 1;
-            }
-        } else if (c == WEOF) {
-            break;
-        } else {
-            fprintf(stderr, "-- cannot decode character at index %u\n", i);
-            return EXIT_FAILURE;
-        }
+        *value = *value << 12 | (uint64_t)(c - U12b_start);
     }
     
-    return EXIT_SUCCESS;
+    return UB_CHAR_OK;
 }
 
-int put_wc(FILE *fd_out, wchar_t wc, size_t *count, size_t wrap_length) {
-    if(fputwc(wc, fd_out) == EOF) return EXIT_FAILURE;
+static inline int is_index(wchar_t u) {
+    return u == V2_block || u == V2_index;
+}
 
-    *count += 1;
-    if(wrap_length > 0) {
-        *count = *count % wrap_length;
-    }
+// a U8 character followed by the next stream, by a checksum trailer or by a block index is a single byte
+static inline int ends_stream(int r, wchar_t u, int class) {
+    return r == UB_CHAR_OK && (class == UB_HEADER || u == V2_checksum || is_index(u));
+}
+
+// a header with features this decoder does not know is an error, not something to skip
+static inline int header_ok(wchar_t u) {
+    return ((u & 0xFF) & ~UNIBINARY_KNOWN_FEATURES) == 0;
+}
+
+// versions past UNIBINARY_MAX_VERSION are errors, not v2, options may be NULL
+static int version_ok(const unibinary_options_t *options) {
     
-    if(*count == 0) {
-        if(fputwc('\n', fd_out) == EOF) return EXIT_FAILURE;
-    }
-    return EXIT_SUCCESS;
+    if(options == NULL || options->version <= UNIBINARY_MAX_VERSION) return EXIT_SUCCESS;
+    
+    fprintf(stderr, "-- unknown format version %u, the latest is %d\n", options->version, UNIBINARY_MAX_VERSION);
+    return EXIT_FAILURE;
 }
 
-int unibinary_encode_string(const char *src, wchar_t **dst, size_t wrap_length) {
+// v2 outputs start with a header and take long runs, options may be NULL, a checksum or a block index implies v2
+static inline int is_v2(const unibinary_options_t *options) {
+    return options != NULL && (options->version >= 2 || options->checksum || options->block_size > 0);
+}
+
+// threads of the parallel codecs, which size their batches and jobs with it
+static inline unsigned int threads_of(const unibinary_options_t *options) {
+    return options->threads < UNIBINARY_MAX_THREADS ? options->threads : UNIBINARY_MAX_THREADS;
+}
+
+// the parallel encoder splices greedy parses of short runs
+static inline int encodes_in_parallel(const unibinary_options_t *options) {
+    return options->threads > 1 && !is_v2(options) && !options->optimal;
+}
+
+// v2 outputs which end with the CRC32C of their bytes, options may be NULL
+static inline int has_checksum(const unibinary_options_t *options) {
+    return options != NULL && options->checksum;
+}
+
+// v2 outputs with a token boundary every block_size input bytes, followed by where each block starts, options may be NULL
+static inline int has_index(const unibinary_options_t *options) {
+    return options != NULL && options->block_size > 0;
+}
+
+// allocations
+
+// NULL for malloc() and free(), options may be NULL
+static inline const unibinary_allocator_t *allocator_of(const unibinary_options_t *options) {
+    return options != NULL ? options->allocator : NULL;
+}
+
+static inline void *allocate(const unibinary_allocator_t *allocator, size_t size) {
+    return allocator != NULL ? allocator->alloc(allocator->ctx, size) : malloc(size);
+}
+
+static inline void release(const unibinary_allocator_t *allocator, void *p) {
+    if(allocator == NULL) free(p);
+    else if(p != NULL) allocator->free(allocator->ctx, p);
+}
+
+struct unibinary_arena_chunk {
+    unibinary_arena_chunk_t *next;
+    size_t capacity;
+    size_t used;
+    max_align_t data[];
+};
+
+// each allocation follows its rounded up size, so that they can be taken back in reverse order
+#define UB_ARENA_ALIGN _Alignof(max_align_t)
+
+static void *arena_alloc(void *ctx, size_t size) {
     
-    // 1. write src into a temporary file
+    unibinary_arena_t *arena = ctx;
+    unibinary_arena_chunk_t *chunk = arena->chunks;
     
-    FILE *fd_in = tmpfile();
-    if(fd_in == NULL) return EXIT_FAILURE;
+    size_t aligned = (size + UB_ARENA_ALIGN - 1) / UB_ARENA_ALIGN * UB_ARENA_ALIGN;
+    if(aligned < size || aligned > SIZE_MAX - UB_ARENA_ALIGN) return NULL;
+    size_t total = UB_ARENA_ALIGN + aligned;
     
-    size_t src_len = strlen(src);
-    size_t written = fwrite(src, 1, src_len, fd_in);
-    if(written != src_len) {
-        fclose(fd_in);
-        return EXIT_FAILURE;
+    if(chunk == NULL || chunk->capacity - chunk->used < total) {
+        size_t capacity = total > arena->chunk_size ? total : arena->chunk_size;
+        if(capacity > SIZE_MAX - sizeof(unibinary_arena_chunk_t)) return NULL;
+        
+        chunk = malloc(sizeof(unibinary_arena_chunk_t) + capacity);
+        if(chunk == NULL) return NULL;
+        
+        chunk->next = arena->chunks;
+        chunk->capacity = capacity;
+        chunk->used = 0;
+        arena->chunks = chunk;
     }
-    rewind(fd_in);
     
-    // 2. open another temporary file to write the encoded string
+    uint8_t *p = (uint8_t *)chunk->data + chunk->used + UB_ARENA_ALIGN;
+    memcpy(p - UB_ARENA_ALIGN, &aligned, sizeof(size_t));
+    chunk->used += total;
     
-    FILE *fd_out = tmpfile();
-    if(fd_in == NULL) {
-        fclose(fd_in);
-        return EXIT_FAILURE;
+    return p;
+}
+
+// takes back p if it is the last allocation of the current chunk
+static void arena_free(void *ctx, void *p) {
+    
+    unibinary_arena_t *arena = ctx;
+    unibinary_arena_chunk_t *chunk = arena->chunks;
+    
+    size_t aligned;
+    memcpy(&aligned, (uint8_t *)p - UB_ARENA_ALIGN, sizeof(size_t));
+    
+    if(chunk != NULL && (uint8_t *)p + aligned == (uint8_t *)chunk->data + chunk->used) {
+        chunk->used -= UB_ARENA_ALIGN + aligned;
     }
+}
+
+void unibinary_arena_init(unibinary_arena_t *arena, size_t chunk_size) {
+    
+    memset(arena, 0, sizeof(unibinary_arena_t));
+    arena->allocator = (unibinary_allocator_t){ arena_alloc, arena_free, arena };
+    arena->chunk_size = chunk_size;
+}
+
+void unibinary_arena_reset(unibinary_arena_t *arena) {
     
-    int status = unibinary_encode(fd_in, fd_out, wrap_length);
-    fclose(fd_in);
+    unibinary_arena_chunk_t *chunk = arena->chunks;
     
-    if(status != 0) return EXIT_FAILURE;
+    if(chunk == NULL) return;
     
-    // 3. read the encoded string and fill *dst
+    if(chunk->next == NULL) {
+        chunk->used = 0;
+        return;
+    }
     
-    long file_size = ftell(fd_out);
+    // the next allocations take one malloc() at most
+    size_t total = 0;
+    for(; chunk != NULL; chunk = chunk->next) total += chunk->capacity;
     
-    rewind(fd_out);
+    unibinary_arena_end(arena);
+    if(total > arena->chunk_size) arena->chunk_size = total;
+}
+
+void unibinary_arena_end(unibinary_arena_t *arena) {
     
-    long max_wchar_bytes_possible = file_size * MB_CUR_MAX;
+    unibinary_arena_chunk_t *chunk = arena->chunks;
     
-    if(max_wchar_bytes_possible > INTMAX_MAX) {
-        fclose(fd_out);
-        return EXIT_FAILURE;
+    while(chunk != NULL) {
+        unibinary_arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
     
-    char *map = mmap(0, file_size, PROT_READ, MAP_SHARED, fileno(fd_out), 0);
+    arena->chunks = NULL;
+}
 
-    fclose(fd_out);
+// CRC32C (Castagnoli) as in iSCSI and ext4, crc32c(0, "123456789", 9) is 0xE3069283
+// calls can be chained, crc32c(crc32c(0, a, n), b, m) is the CRC32C of a then b
 
-    if(map == NULL) {
-        return EXIT_FAILURE;
-    }
+#define UNIBINARY_CRC32C_POLY 0x82F63B78u // reflected, bit 31 is x^0
+
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+// a * b modulo the polynomial, in the reflected bit order of the registers
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
     
-    *dst = (wchar_t *)malloc(file_size * MB_CUR_MAX);
-    if(dst == NULL) {
-        fprintf(stderr, "-- malloc error\n");
-        return EXIT_FAILURE;
+    uint32_t p = 0;
+    
+    for(int i = 0; i < 32; i++) {
+        p ^= b & -(a >> 31);
+        a <<= 1;
+        b = (b >> 1) ^ (UNIBINARY_CRC32C_POLY & -(b & 1));
     }
     
-    size_t length = mbstowcs(*dst, map, file_size * MB_CUR_MAX);
+    return p;
+}
 
-    if(length == -1) {
-        return EXIT_FAILURE;
+#ifdef UNIBINARY_X86_KERNELS
+
+// The crc32 instruction has a latency of 3 cycles and a throughput of 1, so 3 blocks are summed at once
+// and joined by shifting the registers of the first ones over the length of the next ones.
+#define UNIBINARY_CRC32C_BLOCK 4096
+#define UNIBINARY_CRC32C_BLOCK_SHIFT 0x35D73A62u // x^(8 * 4096) modulo the polynomial
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n) {
+    
+    uint64_t c0 = ~crc;
+    
+    while(n >= 3 * UNIBINARY_CRC32C_BLOCK) {
+        uint64_t c1 = 0, c2 = 0;
+        
+        for(size_t i = 0; i < UNIBINARY_CRC32C_BLOCK; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + UNIBINARY_CRC32C_BLOCK + i, 8);
+            memcpy(&w2, p + 2 * UNIBINARY_CRC32C_BLOCK + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        
+        c0 = crc32c_multiply(UNIBINARY_CRC32C_BLOCK_SHIFT, (uint32_t)c0) ^ (uint32_t)c1;
+        c0 = crc32c_multiply(UNIBINARY_CRC32C_BLOCK_SHIFT, (uint32_t)c0) ^ (uint32_t)c2;
+        
+        p += 3 * UNIBINARY_CRC32C_BLOCK;
+        n -= 3 * UNIBINARY_CRC32C_BLOCK;
     }
     
-    return EXIT_SUCCESS;
+    for(; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c0 = _mm_crc32_u64(c0, w);
+    }
+    
+    uint32_t c = (uint32_t)c0;
+    while(n--) c = _mm_crc32_u8(c, *p++);
+    
+    return ~c;
 }
 
-int unibinary_decode_string(const wchar_t *src, char **dst, long *dst_len) {
+#endif
+
+static uint32_t crc32c(uint32_t crc, const uint8_t *p, size_t n) {
     
-    // 1. write src into a temporary file
+#ifdef UNIBINARY_X86_KERNELS
+    if(__builtin_cpu_supports("sse4.2")) return crc32c_sse42(crc, p, n);
+#endif
     
-    FILE *fd_in = tmpfile();
-    if(fd_in == NULL) return EXIT_FAILURE;
+    crc = ~crc;
+    while(n--) crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xFF];
     
-    int status = fputws(src, fd_in);
-    if(status != 0) {
-        fclose(fd_in);
-        return EXIT_FAILURE;
+    return ~crc;
+}
+
+// crc32c() of a then b from crc32c() of a, crc32c(0, b, n) and n, as zlib's crc32_combine()
+// the register of a is shifted over the n bytes, x^(8n) is squared up from x^8 as in crc32c_run()
+static uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t n) {
+    
+    uint32_t p = 1u << 31; // x^0
+    uint32_t x = 1u << 23; // x^8
+    
+    for(; n > 0; n >>= 1) {
+        if(n & 1) p = crc32c_multiply(x, p);
+        if(n == 1) break;
+        x = crc32c_multiply(x, x);
     }
     
-    rewind(fd_in);
+    return crc32c_multiply(p, crc_a) ^ crc_b;
+}
+
+// runs at least this long are summed by crc32c_run() instead of byte by byte
+#define UNIBINARY_CRC32C_RUN (64 * 1024)
+
+// the encoder sums its input and the decoder its output every 3 blocks of crc32c_sse42(), while they are in cache
+#define UNIBINARY_CRC32C_STEP (3 * 4096)
+
+// crc32c() of n times the byte b in O(log n), for long runs and the holes of sparse outputs
+// the register goes over 1, 2, 4... bytes b, each power r -> r * x^(8m) + crc of m bytes b from 0
+static uint32_t crc32c_run(uint32_t crc, uint8_t b, size_t n) {
     
-    // 2. open another temporary file to write decoded data
+    uint32_t r = ~crc;
+    uint32_t x = 1u << 23;       // x^(8m), x^8 for m = 1
+    uint32_t m = crc32c_table[b]; // the register of m bytes b from 0
     
-    FILE *fd_out = tmpfile();
-    if(fd_in == NULL) {
-        fclose(fd_in);
-        return EXIT_FAILURE;
+    for(; n > 0; n >>= 1) {
+        if(n & 1) r = crc32c_multiply(x, r) ^ m;
+        if(n == 1) break;
+        m ^= crc32c_multiply(x, m);
+        x = crc32c_multiply(x, x);
     }
     
-    int status2 = unibinary_decode(fd_in, fd_out);
-    fclose(fd_in);
+    return ~r;
+}
+
+// the checksum of the stream being decoded, from a header with the checksum feature to its trailer
+typedef struct {
+    int active;
+    uint32_t crc;
+} checksum_t;
+
+// a stream with the checksum feature ends with its trailer, else it was cut
+static int checksum_end(const checksum_t *checksum) {
+    
+    if(!checksum->active) return EXIT_SUCCESS;
     
-    if(status2 != 0) return EXIT_FAILURE;
+    fprintf(stderr, "-- missing UniBinary checksum\n");
     
-    // 3. read the resulting string and fill **dst
+    return EXIT_FAILURE;
+}
+
+// stats of the call, NULL when options are or none were asked for
+static inline unibinary_stats_t *stats_of(const unibinary_options_t *options) {
+    return options != NULL ? options->stats : NULL;
+}
+
+// monotonic nanoseconds, read only when stats are kept
+static inline uint64_t stats_clock(const unibinary_stats_t *stats) {
     
-    long file_size = ftell(fd_out);
+    if(stats == NULL) return 0;
     
-    *dst_len = file_size;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
     
-    rewind(fd_out);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static inline void stats_read(unibinary_stats_t *stats, size_t len, uint64_t since) {
     
-    *dst = (char *)malloc(file_size * sizeof(char));
-    if(dst == NULL) {
-        fprintf(stderr, "-- malloc error\n");
-        return EXIT_FAILURE;
-    }
+    if(stats == NULL) return;
     
-    size_t read = fread(*dst, sizeof(char), file_size, fd_out);
-    fclose(fd_out);
+    stats->reads++;
+    stats->bytes_read += len;
+    stats->read_ns += stats_clock(stats) - since;
+}
 
-    if(read != file_size) {
-        return EXIT_FAILURE;
-    }
+static inline void stats_write(unibinary_stats_t *stats, size_t len, uint64_t since) {
     
-    return EXIT_SUCCESS;
+    if(stats == NULL) return;
+    
+    stats->writes += len > 0;
+    stats->bytes_written += len;
+    stats->write_ns += stats_clock(stats) - since;
 }
 
-int unibinary_encode(FILE *fd_in, FILE *fd_out, size_t wrap_length) {
+static inline void stats_codec(unibinary_stats_t *stats, uint64_t since) {
+    if(stats != NULL) stats->codec_ns += stats_clock(stats) - since;
+}
+
+// adds the tokens and newlines of the encoded s to stats, up to the first invalid or incomplete one
+// returns the number of characters read, newlines excluded
+static size_t stats_tokens(unibinary_stats_t *stats, const uint8_t *s, size_t n) {
     
-    size_t out_count = 0;
+    const uint8_t *p = s;
+    const uint8_t *end = s + n;
+    size_t characters = 0;
+    
+    if(stats == NULL) return 0;
+    
+    for(size_t i = 0; i < n; i++) {
+        stats->newlines += s[i] == '\n';
+    }
     
     while(1) {
+        wchar_t u0, u1;
+        int k0, k1;
         
-        unsigned char c0, c1, c2;
-        size_t read_c0 = fread(&c0, 1, 1, fd_in);
-        if(read_c0 == 0) break;
+        if(next_utf8_char(&p, end, &u0, &k0) != UB_CHAR_OK) break;
+        characters++;
         
-        size_t read_c1 = 0;
+        if(k0 >= UB_U12A_0_0) {
+            stats->pairs++;
+            continue;
+        }
         
-        long number_of_repeats = 1;
-        unsigned char cc;
-        size_t read_cc = fread(&cc, 1, 1, fd_in);
+        if(k0 == UB_HEADER) continue;
         
-        while(read_cc != 0 && cc == c0 && number_of_repeats < 0xFFF) {
-            number_of_repeats += 1;
-            read_cc = fread(&cc, 1, 1, fd_in);
+        if(u0 == V2_checksum) {
+            uint32_t crc;
+            if(checksum_after(&p, end, &crc) != UB_CHAR_OK) break;
+            characters += 3;
+            continue;
         }
         
-        /**/
-        
-        if(number_of_repeats >= 3) {
-            if(read_cc != 0) {
-                if(ungetc(cc, fd_in) == EOF) return EXIT_FAILURE;
-            }
-
-            long n = number_of_repeats;
-            
-            wchar_t u0, u1;
-            int error = two_unichr_to_repeat_byte_ntimes(c0, (int)n, &u0, &u1);
-            if(error) return EXIT_FAILURE;
-            
-            put_wc(fd_out, u0, &out_count, wrap_length);
-            put_wc(fd_out, u1, &out_count, wrap_length);
-            
+        if(is_index(u0)) {
+            uint64_t value;
+            if(index_after(&p, end, u0, &value) != UB_CHAR_OK) break;
+            characters += u0 == V2_index ? 5 : 3;
             continue;
-        } else if (number_of_repeats == 2) {
-            if(read_cc != 0) {
-                if(ungetc(cc, fd_in) == EOF) return EXIT_FAILURE;
-            }
-
-            read_c0 = 1;
-            read_c1 = 1;
-//            c0 = c0;
-            c1 = c0;
-
-        } else if (read_cc != 0) {
-            read_c1 = 1;
-            c1 = cc;
         }
         
-        /**/
+        if(k0 == UB_LONG_RUN) {
+            uint8_t b;
+            size_t len;
+            if(long_run_after(&p, end, u0, &b, &len) != UB_CHAR_OK) break;
+            characters += 3;
+            stats->runs++;
+            stats->long_runs++;
+            stats->run_bytes += len;
+            continue;
+        }
+        
+        int r = next_utf8_char(&p, end, &u1, &k1);
+        
+        if(k0 == UB_U8 && (r == UB_CHAR_NONE || ends_stream(r, u1, k1))) {
+            // trailing single byte, the header or the trailer is read again
+            stats->singles++;
+            if(r == UB_CHAR_NONE) break;
+            p -= 3;
+            continue;
+        }
+        
+        if(r != UB_CHAR_OK) break;
+        characters++;
+        
+        if(k0 == UB_U8 && k1 == UB_U12B) {
+            stats->runs++;
+            stats->run_bytes += u1 - U12b_start;
+        } else if (k0 == UB_U8 && k1 == UB_U8) {
+            stats->singles += 2;
+        } else if (k0 == UB_U12B && k1 == UB_U12B) {
+            stats->triples++;
+        } else {
+            break;
+        }
+    }
+    
+    return characters;
+}
+
+// the encoded s, followed by the newlines wrapping it from column on, returns their number
+static size_t stats_encoded(unibinary_stats_t *stats, const uint8_t *s, size_t n, size_t column, size_t wrap_length) {
+    
+    size_t characters = stats_tokens(stats, s, n);
+    size_t newlines = stats != NULL && wrap_length ? (column + characters) / wrap_length : 0;
+    
+    if(stats != NULL) stats->newlines += newlines;
+    
+    return newlines;
+}
+
+#ifdef UNIBINARY_X86_KERNELS
+
+// Decodes runs of U12b U12b tokens in UTF-8, 2 tokens per 128 bits.
+// Stops on the first character which is not U12b, newlines included, the scalar decoder handles it.
+// Returns the number of tokens decoded, reads up to 32 bytes and writes up to 16 bytes past the decoded ones.
+
+// per character bits from the byte and 16 bits lanes masks of 4 characters
+static inline uint32_t u12b_characters(uint32_t utf8_ok, uint32_t range_ok, int count) {
+    
+    uint32_t all_bytes_ok = utf8_ok & (utf8_ok >> 1) & (utf8_ok >> 2);
+    uint32_t ok = 0;
+    
+    for(int c = 0; c < count; c++) {
+        ok |= ((all_bytes_ok >> (3 * c)) & (range_ok >> (2 * c)) & 1) << c;
+    }
+    
+    return ok;
+}
+
+__attribute__((target("ssse3")))
+static inline uint32_t bytes_from_u12b_ssse3(__m128i in, __m128i *out) {
+    
+    // E4 or E5 lead bytes followed by two continuation bytes
+    const __m128i pattern_mask = _mm_setr_epi8(0xFE, 0xC0, 0xC0, 0xFE, 0xC0, 0xC0, 0xFE, 0xC0, 0xC0, 0xFE, 0xC0, 0xC0, 0, 0, 0, 0);
+    const __m128i pattern = _mm_setr_epi8(0xE4, 0x80, 0x80, 0xE4, 0x80, 0x80, 0xE4, 0x80, 0x80, 0xE4, 0x80, 0x80, 0, 0, 0, 0);
+    uint32_t utf8_ok = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(in, pattern_mask), pattern));
+    
+    // 16 bits lanes (lead, second) and (third) of each character
+    const __m128i lead_second = _mm_setr_epi8(1, 0, 4, 3, 7, 6, 10, 9, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i third = _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m128i a = _mm_shuffle_epi8(in, lead_second);
+    __m128i b = _mm_shuffle_epi8(in, third);
+    
+    __m128i u = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, _mm_set1_epi16(0x0F00)), 4),
+                             _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, _mm_set1_epi16(0x3F)), 6),
+                                          _mm_and_si128(b, _mm_set1_epi16(0x3F))));
+    
+    __m128i v = _mm_sub_epi16(u, _mm_set1_epi16(0x4E00)); // U12b_start
+    uint32_t range_ok = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xF000)), _mm_setzero_si128()));
+    
+    // (v0 << 12 | v1) in 32 bits lanes, then big endian 3 bytes
+    __m128i t = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xFFFF)), 12), _mm_srli_epi32(v, 16));
+    *out = _mm_shuffle_epi8(t, _mm_setr_epi8(2, 1, 0, 6, 5, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    
+    return u12b_characters(utf8_ok, range_ok, 4);
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_u12b_tokens_ssse3(const uint8_t *p, const uint8_t *end, uint8_t *o, const uint8_t *o_end) {
+    
+    size_t tokens = 0;
+    
+    while(end - p >= 16 && o_end - o >= 16) {
+        __m128i out;
+        uint32_t ok = bytes_from_u12b_ssse3(_mm_loadu_si128((const __m128i *)p), &out);
+        
+        size_t n = __builtin_ctz(~ok) / 2;
+        if(n == 0) break;
+        
+        _mm_storel_epi64((__m128i *)o, out);
+        
+        p += 6 * n;
+        o += 3 * n;
+        tokens += n;
+        
+        if(n < 2) break;
+    }
+    
+    return tokens;
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t bytes_from_u12b_avx2(__m256i in, __m256i *out) {
+    
+    // same as bytes_from_u12b_ssse3(), in each 128 bits lane
+    const __m256i pattern_mask = _mm256_broadcastsi128_si256(_mm_setr_epi8(0xFE, 0xC0, 0xC0, 0xFE, 0xC0, 0xC0, 0xFE, 0xC0, 0xC0, 0xFE, 0xC0, 0xC0, 0, 0, 0, 0));
+    const __m256i pattern = _mm256_broadcastsi128_si256(_mm_setr_epi8(0xE4, 0x80, 0x80, 0xE4, 0x80, 0x80, 0xE4, 0x80, 0x80, 0xE4, 0x80, 0x80, 0, 0, 0, 0));
+    uint32_t utf8_ok = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(in, pattern_mask), pattern));
+    
+    const __m256i lead_second = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 0, 4, 3, 7, 6, 10, 9, -1, -1, -1, -1, -1, -1, -1, -1));
+    const __m256i third = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    __m256i a = _mm256_shuffle_epi8(in, lead_second);
+    __m256i b = _mm256_shuffle_epi8(in, third);
+    
+    __m256i u = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(a, _mm256_set1_epi16(0x0F00)), 4),
+                                _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(a, _mm256_set1_epi16(0x3F)), 6),
+                                                _mm256_and_si256(b, _mm256_set1_epi16(0x3F))));
+    
+    __m256i v = _mm256_sub_epi16(u, _mm256_set1_epi16(0x4E00)); // U12b_start
+    uint32_t range_ok = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(v, _mm256_set1_epi16((short)0xF000)), _mm256_setzero_si256()));
+    
+    __m256i t = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0xFFFF)), 12), _mm256_srli_epi32(v, 16));
+    *out = _mm256_shuffle_epi8(t, _mm256_broadcastsi128_si256(_mm_setr_epi8(2, 1, 0, 6, 5, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)));
+    
+    return u12b_characters(utf8_ok, range_ok, 4) | (u12b_characters(utf8_ok >> 16, range_ok >> 16, 4) << 4);
+}
+
+__attribute__((target("avx2")))
+static size_t decode_u12b_tokens_avx2(const uint8_t *p, const uint8_t *end, uint8_t *o, const uint8_t *o_end) {
+    
+    size_t tokens = 0;
+    
+    while(end - p >= 28 && o_end - o >= 16) {
+        // 4 characters in each 128 bits lane
+        __m128i lo = _mm_loadu_si128((const __m128i *)p);
+        __m128i hi = _mm_loadu_si128((const __m128i *)(p + 12));
+        
+        __m256i out;
+        uint32_t ok = bytes_from_u12b_avx2(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), &out);
+        
+        size_t n = __builtin_ctz(~ok) / 2;
+        if(n == 0) break;
+        
+        _mm_storel_epi64((__m128i *)o, _mm256_castsi256_si128(out));
+        _mm_storel_epi64((__m128i *)(o + 6), _mm256_extracti128_si256(out, 1));
+        
+        p += 6 * n;
+        o += 3 * n;
+        tokens += n;
+        
+        if(n < 4) break;
+    }
+    
+    return tokens;
+}
+
+typedef size_t (*u12b_kernel_t)(const uint8_t *p, const uint8_t *end, uint8_t *o, const uint8_t *o_end);
+
+static u12b_kernel_t u12b_kernel(void) {
+    
+    if(__builtin_cpu_supports("avx2")) return decode_u12b_tokens_avx2;
+    if(__builtin_cpu_supports("ssse3")) return decode_u12b_tokens_ssse3;
+    
+    return NULL;
+}
+
+// Checks U12a characters and U12b U12b tokens in UTF-8 with the default ranges, 16 characters per 48 bytes.
+// Stops before the first other character, or the first U12b which ends an odd run, on a token boundary.
+// Returns the number of bytes checked, *decoded is increased by their decoded length.
+__attribute__((target("ssse3,popcnt")))
+static size_t cjk_tokens_ssse3(const uint8_t *p, const uint8_t *end, size_t *decoded) {
+    
+    // the 3 bytes of the 16 characters in 48 bytes, gathered from the 3 loads
+    const __m128i lead_a = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i lead_b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i lead_c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i second_a = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i second_b = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i second_c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i third_a = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i third_b = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i third_c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+    
+    const uint8_t *start = p;
+    size_t a_characters = 0;
+    size_t b_characters = 0;
+    uint32_t odd = 0; // the last U12b is the first of its token
+    
+    while(end - p >= 48) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+        
+        __m128i lead = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, lead_a), _mm_shuffle_epi8(b, lead_b)), _mm_shuffle_epi8(c, lead_c));
+        __m128i second = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, second_a), _mm_shuffle_epi8(b, second_b)), _mm_shuffle_epi8(c, second_c));
+        __m128i third = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, third_a), _mm_shuffle_epi8(b, third_b)), _mm_shuffle_epi8(c, third_c));
+        
+        const __m128i top = _mm_set1_epi8((char)0xC0);
+        __m128i continuations = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(second, top), _mm_set1_epi8((char)0x80)),
+                                              _mm_cmpeq_epi8(_mm_and_si128(third, top), _mm_set1_epi8((char)0x80)));
+        
+        // U12b from E4 B8 80 to E5 B7 BF, U12a from E5 B8 80 to E9 B7 BF, B8 and above have bits 0x38 set
+        __m128i high = _mm_cmpeq_epi8(_mm_and_si128(second, _mm_set1_epi8(0x38)), _mm_set1_epi8(0x38));
+        __m128i e4 = _mm_cmpeq_epi8(lead, _mm_set1_epi8((char)0xE4));
+        __m128i e5 = _mm_cmpeq_epi8(lead, _mm_set1_epi8((char)0xE5));
+        __m128i e9 = _mm_cmpeq_epi8(lead, _mm_set1_epi8((char)0xE9));
+        __m128i e6_e8 = _mm_sub_epi8(lead, _mm_set1_epi8((char)0xE6));
+        e6_e8 = _mm_cmpeq_epi8(_mm_min_epu8(e6_e8, _mm_set1_epi8(2)), e6_e8);
+        
+        __m128i u12b = _mm_or_si128(_mm_and_si128(e4, high), _mm_andnot_si128(high, e5));
+        __m128i u12a = _mm_or_si128(_mm_or_si128(_mm_and_si128(e5, high), e6_e8), _mm_andnot_si128(high, e9));
+        
+        uint32_t a_mask = _mm_movemask_epi8(_mm_and_si128(u12a, continuations));
+        uint32_t b_mask = _mm_movemask_epi8(_mm_and_si128(u12b, continuations));
+        
+        // characters up to the first other one
+        int count = __builtin_ctz(~(a_mask | b_mask) | 0x10000);
+        uint32_t prefix = (1u << count) - 1;
+        a_mask &= prefix;
+        b_mask &= prefix;
+        
+        // a U12b run ends at the character after it, its length is odd when its start and end have different parities
+        // the first U12b completes the token of the previous block
+        uint32_t runs = b_mask & ~odd;
+        uint32_t starts = runs & ~(runs << 1);
+        uint32_t even_starts = starts & 0x55555555;
+        uint32_t odd_starts = starts & 0xAAAAAAAA;
+        uint32_t odd_ends = (((runs + even_starts) & ~runs) & 0xAAAAAAAA) | (((runs + odd_starts) & ~runs) & 0x55555555);
+        
+        if(odd && !(b_mask & 1)) odd_ends |= 1;
+        
+        // up to the U12a or other character after an odd run, whose last U12b is left for the scalar decoder to reject
+        if(odd_ends & prefix) {
+            count = __builtin_ctz(odd_ends & prefix);
+            prefix = (1u << count) - 1;
+            a_characters += __builtin_popcount(a_mask & prefix);
+            b_characters += __builtin_popcount(b_mask & prefix);
+            p += 3 * count;
+            odd = 1;
+            break;
+        }
+        
+        odd = (odd_ends >> count) & 1;
+        a_characters += __builtin_popcount(a_mask);
+        b_characters += __builtin_popcount(b_mask);
+        p += 3 * count;
+        
+        if(count < 16) break;
+    }
+    
+    // back to a token boundary
+    if(odd) {
+        b_characters--;
+        p -= 3;
+    }
+    
+    *decoded += 2 * a_characters + 3 * (b_characters / 2);
+    
+    return p - start;
+}
+
+typedef size_t (*cjk_kernel_t)(const uint8_t *p, const uint8_t *end, size_t *decoded);
+
+static cjk_kernel_t cjk_kernel(void) {
+    return __builtin_cpu_supports("ssse3") ? cjk_tokens_ssse3 : NULL;
+}
+
+#endif
+
+// bytes of the consecutive (U8, U12b) and long runs of byte b at src, at most max, *after is the end of their tokens
+static size_t runs_at(const uint8_t *src, const uint8_t *end, uint8_t b, size_t max, const uint8_t **after) {
+    
+    const uint8_t *p = src;
+    size_t total = 0;
+    
+    *after = src;
+    
+    while(1) {
+        wchar_t u0, u1;
+        int k0, k1;
+        
+        if(next_utf8_char(&p, end, &u0, &k0) != UB_CHAR_OK) break;
+        
+        uint8_t c;
+        size_t n;
+        
+        if(k0 == UB_LONG_RUN) {
+            if(long_run_after(&p, end, u0, &c, &n) != UB_CHAR_OK || c != b) break;
+        } else {
+            if(k0 != UB_U8 || u0 - U8_start != b) break;
+            if(next_utf8_char(&p, end, &u1, &k1) != UB_CHAR_OK || k1 != UB_U12B) break;
+            n = u1 - U12b_start;
+        }
+        
+        if(n > max - total) break;
+        
+        total += n;
+        *after = p;
+    }
+    
+    return total;
+}
+
+// unibinary_decode_buffer(), stopping before the runs of zeros of at least hole_length bytes unless it is 0
+// checksum, when not NULL, is carried from call to call and checked at each trailer, trailers are skipped otherwise
+static int decode_tokens(const uint8_t *src, size_t src_len, int is_last, uint8_t *dst, size_t dst_capacity, size_t hole_length, checksum_t *checksum, size_t *src_used, size_t *dst_len) {
+    
+    const uint8_t *p = src;
+    const uint8_t *end = src + src_len;
+    uint8_t *o = dst;
+    uint8_t *o_end = dst + dst_capacity;
+    uint8_t *summed = dst; // the bytes before are in checksum->crc
+    int summing = checksum != NULL && checksum->active; // read once, uint8_t stores may alias *checksum
+    
+#ifdef UNIBINARY_X86_KERNELS
+    u12b_kernel_t kernel = u12b_kernel();
+#endif
+    
+    int status = EXIT_SUCCESS;
+    
+    while(1) {
+        
+        wchar_t u0, u1;
+        int k0, k1;
+        
+        if(summing && (size_t)(o - summed) >= UNIBINARY_CRC32C_STEP) {
+            checksum->crc = crc32c(checksum->crc, summed, o - summed);
+            summed = o;
+        }
+        
+        int r = next_utf8_char(&p, end, &u0, &k0);
+        const uint8_t *token = p;
+        
+        if(r == UB_CHAR_NONE) {
+            // truncated UTF-8 sequence
+            if(is_last && p != end) status = EXIT_FAILURE;
+            break;
+        }
+        
+        if(r == UB_CHAR_INVALID) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        token = p - (u0 < 0x800 ? 2 : 3);
         
-        size_t read_c2 = fread(&c2, 1, 1, fd_in);
+        if(k0 >= UB_U12A_0_0) {
+            // 2 ASCII characters
+            if(o_end - o < 2) {
+                p = token;
+                break;
+            }
+            
+            uint8_t msb = k0 - UB_U12A_0_0;
+            wchar_t value = u0 - UB_U12A_START(msb);
+            o[0] = ((value >> 6) & 0x3F) | ((msb & 2) << 5);
+            o[1] = (value & 0x3F) | ((msb & 1) << 6);
+            o += 2;
+            continue;
+        }
         
-        int two_ASCII_7bits_chars_available = read_c0 != 0 && read_c1 != 0 && c0 < 128 && c1 < 128;
-        int three_bytes_available = read_c0 != 0 && read_c1 != 0 && read_c2 != 0;
+        if(k0 == UB_HEADER) {
+            // a v2 stream starts here, concatenated streams decode to the concatenated data
+            if(!header_ok(u0)) {
+                fprintf(stderr, "-- unsupported UniBinary features 0x%02x\n", (unsigned int)(u0 & 0xFF));
+                p = token;
+                status = EXIT_FAILURE;
+                break;
+            }
+            
+            if(checksum != NULL) {
+                if(checksum_end(checksum) != EXIT_SUCCESS) {
+                    p = token;
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                checksum->active = summing = (u0 & UNIBINARY_FEATURE_CHECKSUM) != 0;
+                checksum->crc = 0;
+                summed = o;
+            }
+            continue;
+        }
         
-        if(two_ASCII_7bits_chars_available) {
+        if(u0 == V2_checksum) {
+            uint32_t crc;
+            r = checksum_after(&p, end, &crc);
             
-            // put 2 x 7 bits into a unichar
-            wchar_t u0;
-            int error = unichr_12a_from_two_ascii(c0, c1, &u0);
-            if(error) return EXIT_FAILURE;
+            if(r != UB_CHAR_OK) {
+                if(r == UB_CHAR_INVALID || is_last) status = EXIT_FAILURE;
+                p = token;
+                break;
+            }
             
-            put_wc(fd_out, u0, &out_count, wrap_length);
+            if(checksum == NULL) continue;
             
-            if(read_c2 != 0) {
-                if(ungetc(c2, fd_in) == EOF) return EXIT_FAILURE;
+            if(!summing || crc32c(checksum->crc, summed, o - summed) != crc) {
+                fprintf(stderr, summing ? "-- UniBinary checksum mismatch\n" : "-- UniBinary checksum without a header\n");
+                p = token;
+                status = EXIT_FAILURE;
+                break;
             }
             
-        } else if (three_bytes_available) {
-            // read 3 bytes, yield 2 unichars
-            wchar_t u0, u1;
-            int error = two_twelve_bits_values_from_three_bytes(c0, c1, c2, &u0, &u1);
-            if(error) return EXIT_FAILURE;
+            checksum->active = summing = 0;
+            summed = o;
+            continue;
+        }
+        
+        if(is_index(u0)) {
+            // for unibinary_decode_range(), nothing to decode
+            uint64_t value;
+            r = index_after(&p, end, u0, &value);
+            
+            if(r != UB_CHAR_OK) {
+                if(r == UB_CHAR_INVALID || is_last) status = EXIT_FAILURE;
+                p = token;
+                break;
+            }
+            continue;
+        }
+        
+        uint8_t b;
+        size_t n;
+        
+        if(k0 == UB_LONG_RUN) {
+            r = long_run_after(&p, end, u0, &b, &n);
             
-            wchar_t o0, o1;
-            error = to_U12(u0, &o0);
-            if(error != 0) return EXIT_FAILURE;
-            error = to_U12(u1, &o1);
-            if(error != 0) return EXIT_FAILURE;
+            if(r != UB_CHAR_OK) {
+                if(r == UB_CHAR_INVALID || is_last) status = EXIT_FAILURE;
+                p = token;
+                break;
+            }
+        } else {
+            r = next_utf8_char(&p, end, &u1, &k1);
             
-            put_wc(fd_out, o0, &out_count, wrap_length);
-            put_wc(fd_out, o1, &out_count, wrap_length);
+            if(r == UB_CHAR_NONE && !is_last) {
+                p = token;
+                break;
+            }
             
-        } else if (read_c0 != 0) {
-            // read 1 byte, encode 1 unichar
-            wchar_t u0;
-            int error = to_U08(c0, &u0);
-            if(error) return EXIT_FAILURE;
+            if(k0 == UB_U8 && ((r == UB_CHAR_NONE && p == end) || ends_stream(r, u1, k1))) {
+                // trailing single byte, of this stream or of one followed by another or by its trailer
+                if(o_end - o < 1) {
+                    p = token;
+                    break;
+                }
+                *o++ = u0 - U8_start;
+                if(r == UB_CHAR_OK) p -= 3;
+                continue;
+            }
             
-            put_wc(fd_out, u0, &out_count, wrap_length);
+            if(r != UB_CHAR_OK) {
+                // a lone U12b character, or an invalid second character
+                if(r == UB_CHAR_NONE) p = token;
+                status = EXIT_FAILURE;
+                break;
+            }
             
-            if(read_c1 != 0) {
-                if(ungetc(c1, fd_in) == EOF) return EXIT_FAILURE;
+            if(token_length(u1, k0, k1, &n) != 0) {
+                p = token;
+                status = EXIT_FAILURE;
+                break;
             }
             
-        } else {
+            b = u0 - U8_start;
+        }
+        
+        if((size_t)(o_end - o) < n) {
+            p = token;
+            break;
+        }
+        
+        if(k0 == UB_LONG_RUN || (k0 == UB_U8 && k1 == UB_U12B)) {
+            const uint8_t *after;
+            
+            if(b == 0 && hole_length && n + runs_at(p, end, 0, hole_length, &after) >= hole_length) {
+                p = token;
+                break;
+            }
+            
+            // the next runs of the same byte are filled at once
+            size_t more = runs_at(p, end, b, (o_end - o) - n, &after);
+            if(n + more >= UNIBINARY_CRC32C_RUN && summing) {
+                checksum->crc = crc32c_run(crc32c(checksum->crc, summed, o - summed), b, n + more);
+                summed = o + n + more;
+            }
+            memset(o, b, n + more);
+            o += n + more;
+            p = after;
+            continue;
+        }
+        
+        bytes_from_token(u0, k0, u1, k1, &o);
+        
+#ifdef UNIBINARY_X86_KERNELS
+        // binary data, see if the next tokens are U12b U12b too
+        if(kernel != NULL && k0 == UB_U12B) {
+            size_t tokens = kernel(p, end, o, summing && o_end - o > UNIBINARY_CRC32C_STEP ? o + UNIBINARY_CRC32C_STEP : o_end);
+            p += 6 * tokens;
+            o += 3 * tokens;
+        }
+#endif
+    }
+    
+    // the decoded bytes are summed while in cache
+    if(summing) checksum->crc = crc32c(checksum->crc, summed, o - summed);
+    
+    *src_used = p - src;
+    *dst_len = o - dst;
+    
+    return status;
+}
+
+int unibinary_decode_buffer(const uint8_t *src, size_t src_len, int is_last, uint8_t *dst, size_t dst_capacity, size_t *src_used, size_t *dst_len) {
+    return decode_tokens(src, src_len, is_last, dst, dst_capacity, 0, NULL, src_used, dst_len);
+}
+
+// decodes in through out into dst, offset is the position of in[0] in the input for error messages
+// used is the length of the leading complete tokens
+static int decode_chunk(const uint8_t *in, size_t in_len, int is_last, uint8_t *out, size_t out_capacity, FILE *dst, size_t offset, checksum_t *checksum, unibinary_stats_t *stats, size_t *used) {
+    
+    int status = EXIT_SUCCESS;
+    size_t start = 0;
+    
+    while(1) {
+        size_t chunk_used, out_len;
+        uint64_t since = stats_clock(stats);
+        status = decode_tokens(in + start, in_len - start, is_last, out, out_capacity, 0, checksum, &chunk_used, &out_len);
+        stats_codec(stats, since);
+        stats_tokens(stats, in + start, chunk_used);
+        
+        since = stats_clock(stats);
+        size_t written = fwrite(out, 1, out_len, dst);
+        stats_write(stats, written, since);
+        
+        if(written != out_len) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        start += chunk_used;
+        
+        if(status != EXIT_SUCCESS) {
+            fprintf(stderr, "-- cannot decode character at offset %zu\n", offset + start);
             break;
         }
         
+        if(start == in_len || (chunk_used == 0 && out_len == 0)) break;
     }
     
-    return EXIT_SUCCESS;
+    *used = start;
+    
+    return status;
+}
+
+static int decode_file(FILE *src, FILE *dst, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    // the carried over bytes are an incomplete token at most, newlines are dropped
+    size_t in_capacity = UNIBINARY_CHUNK_SIZE + UNIBINARY_MAX_TOKEN_LENGTH;
+    size_t out_capacity = UNIBINARY_DECODED_CHUNK_SIZE;
+    
+    uint8_t *in = allocate(allocator, in_capacity);
+    uint8_t *out = allocate(allocator, out_capacity);
+    if(in == NULL || out == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        release(allocator, in);
+        release(allocator, out);
+        return EXIT_FAILURE;
+    }
+    
+    int status = EXIT_SUCCESS;
+    size_t carry = 0;
+    size_t offset = 0; // of in[0] in src
+    checksum_t checksum = {0};
+    unibinary_stats_t *stats = stats_of(options);
+    
+    while(status == EXIT_SUCCESS) {
+        
+        uint64_t since = stats_clock(stats);
+        size_t read = fread(in + carry, 1, UNIBINARY_CHUNK_SIZE, src);
+        stats_read(stats, read, since);
+        if(ferror(src)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        int is_last = read < UNIBINARY_CHUNK_SIZE;
+        size_t in_len = carry + read;
+        size_t start;
+        
+        status = decode_chunk(in, in_len, is_last, out, out_capacity, dst, offset, &checksum, stats, &start);
+        
+        if(is_last) {
+            if(status == EXIT_SUCCESS) status = checksum_end(&checksum);
+            break;
+        }
+        
+        carry = 0;
+        for(size_t i = start; i < in_len; i++) {
+            if(in[i] != '\n') {
+                in[carry++] = in[i];
+            }
+        }
+        
+        // the dropped newlines count in the offsets of the next chunk
+        offset += in_len - carry;
+        if(stats != NULL) stats->newlines += in_len - start - carry;
+    }
+    
+    release(allocator, in);
+    release(allocator, out);
+    
+    return status;
+}
+
+int unibinary_decode(FILE *src, FILE *dst) {
+    return decode_file(src, dst, NULL);
+}
+
+static inline size_t number_of_repeats_at(const uint8_t *p, const uint8_t *end) {
+    
+    const uint8_t *limit = (size_t)(end - p) > UNIBINARY_MAX_REPEATS ? p + UNIBINARY_MAX_REPEATS : end;
+    const uint8_t *q = p + 1;
+    
+    while(q < limit && *q == *p) q++;
+    
+    return q - p;
+}
+
+// bytes of the run at p taken by one token, 0 when it depends on bytes after end
+// with long_runs, a v2 long run when v1 would need more than two tokens
+static inline size_t run_token_length(const uint8_t *p, const uint8_t *end, int is_last, int long_runs) {
+    
+    size_t n = number_of_repeats_at(p, end);
+    
+    if(!long_runs || n < UNIBINARY_MAX_REPEATS) {
+        return p + n == end && n < UNIBINARY_MAX_REPEATS && !is_last ? 0 : n;
+    }
+    
+    const uint8_t *limit = (size_t)(end - p) > UNIBINARY_V2_MAX_REPEATS ? p + UNIBINARY_V2_MAX_REPEATS : end;
+    const uint8_t *q = p + n;
+    
+    // 8 bytes at a time
+    uint64_t word = 0x0101010101010101ULL * *p;
+    while(limit - q >= 8) {
+        uint64_t w;
+        memcpy(&w, q, 8);
+        if(w != word) break;
+        q += 8;
+    }
+    
+    while(q < limit && *q == *p) q++;
+    
+    size_t m = q - p;
+    
+    if(q == end && m < UNIBINARY_V2_MAX_REPEATS && !is_last) return 0;
+    
+    return m > 2 * UNIBINARY_MAX_REPEATS ? m : n;
+}
+
+// U8 and U12 code points are below 0x10000, so they take 2 or 3 bytes in UTF-8
+static inline uint8_t *put_utf8(uint8_t *o, wchar_t u) {
+    
+    if(u < 0x800) {
+        o[0] = 0xC0 | (u >> 6);
+        o[1] = 0x80 | (u & 0x3F);
+        return o + 2;
+    }
+    
+    o[0] = 0xE0 | (u >> 12);
+    o[1] = 0x80 | ((u >> 6) & 0x3F);
+    o[2] = 0x80 | (u & 0x3F);
+    return o + 3;
+}
+
+// the header of a v2 output, returns o unchanged for v1
+static inline uint8_t *put_header(uint8_t *o, const unibinary_options_t *options) {
+    
+    if(!is_v2(options)) return o;
+    
+    return put_utf8(o, V2_header_start | UNIBINARY_FEATURE_LONG_RUNS | (has_checksum(options) ? UNIBINARY_FEATURE_CHECKSUM : 0) | (has_index(options) ? UNIBINARY_FEATURE_INDEX : 0));
+}
+
+// UTF-8 bytes of the checksum trailer
+#define UNIBINARY_TRAILER_LENGTH 12
+
+// the trailer of an output with the checksum feature, crc is the CRC32C of its bytes, returns o unchanged otherwise
+static inline uint8_t *put_trailer(uint8_t *o, const unibinary_options_t *options, uint32_t crc) {
+    
+    if(!has_checksum(options)) return o;
+    
+    o = put_utf8(o, V2_checksum);
+    o = put_utf8(o, U12b_start + (crc >> 20));
+    o = put_utf8(o, U12b_start + ((crc >> 8) & 0xFFF));
+    return put_utf8(o, U12b_start + (crc & 0xFF));
+}
+
+#ifdef UNIBINARY_X86_KERNELS
+
+// Encodes runs of 3 bytes tokens into U12b U12b in UTF-8, 4 tokens per 128 bits.
+// A token at p[j] is 3 bytes unless p[j..j+2] is a run or p[j], p[j+1] are ASCII, as in encode_tokens().
+// Returns the number of tokens encoded, reads up to 33 bytes and writes up to 24 bytes past the encoded ones.
+
+// bits of the bytes starting a token, every 3 bytes
+#define TOKEN_STARTS_4 0x249u
+#define TOKEN_STARTS_8 0x249249u
+
+static inline size_t leading_three_bytes_tokens(uint32_t eq_next, uint32_t high, uint32_t token_starts, size_t max_tokens) {
+    
+    uint32_t runs = eq_next & (eq_next >> 1);
+    uint32_t ascii_pairs = ~high & ~(high >> 1);
+    uint32_t stops = (runs | ascii_pairs) & token_starts;
+    
+    return stops == 0 ? max_tokens : (size_t)__builtin_ctz(stops) / 3;
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i utf8_from_u12b_ssse3(__m128i in, __m128i *tail) {
+    
+    // 16 bits lanes, big endian pairs of bytes: (b0, b1) (b1, b2) for each 3 bytes
+    const __m128i pairs = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    __m128i s = _mm_shuffle_epi8(in, pairs);
+    
+    // (b0 << 4 | b1 >> 4) in even lanes, ((b1 & 0xF) << 8 | b2) in odd lanes
+    const __m128i even = _mm_setr_epi16(-1, 0, -1, 0, -1, 0, -1, 0);
+    __m128i v = _mm_or_si128(_mm_and_si128(even, _mm_srli_epi16(s, 4)), _mm_andnot_si128(even, s));
+    v = _mm_and_si128(v, _mm_set1_epi16(0x0FFF));
+    
+    __m128i u = _mm_add_epi16(v, _mm_set1_epi16(0x4E00)); // U12b_start
+    
+    __m128i t0 = _mm_or_si128(_mm_srli_epi16(u, 12), _mm_set1_epi16(0xE0));
+    __m128i t1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(u, 6), _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+    __m128i t2 = _mm_or_si128(_mm_and_si128(u, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+    
+    __m128i a = _mm_packus_epi16(t0, t1); // lead bytes, then second bytes
+    __m128i b = _mm_packus_epi16(t2, t2); // third bytes
+    
+    const __m128i a0 = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5);
+    const __m128i b0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i a1 = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+    
+    *tail = _mm_or_si128(_mm_shuffle_epi8(a, a1), _mm_shuffle_epi8(b, b1));
+    return _mm_or_si128(_mm_shuffle_epi8(a, a0), _mm_shuffle_epi8(b, b0));
+}
+
+__attribute__((target("ssse3")))
+static size_t encode_three_bytes_tokens_ssse3(const uint8_t *p, const uint8_t *end, uint8_t *o) {
+    
+    size_t tokens = 0;
+    
+    while(end - p >= 33) {
+        __m128i in = _mm_loadu_si128((const __m128i *)p);
+        __m128i next = _mm_loadu_si128((const __m128i *)(p + 1));
+        
+        uint32_t eq_next = _mm_movemask_epi8(_mm_cmpeq_epi8(in, next));
+        uint32_t high = _mm_movemask_epi8(in);
+        size_t n = leading_three_bytes_tokens(eq_next, high, TOKEN_STARTS_4, 4);
+        if(n == 0) break;
+        
+        __m128i tail;
+        __m128i head = utf8_from_u12b_ssse3(in, &tail);
+        _mm_storeu_si128((__m128i *)o, head);
+        _mm_storel_epi64((__m128i *)(o + 16), tail);
+        
+        p += 3 * n;
+        o += 6 * n;
+        tokens += n;
+        
+        if(n < 4) break;
+    }
+    
+    return tokens;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i utf8_from_u12b_avx2(__m256i in, __m256i *tail) {
+    
+    // same as utf8_from_u12b_ssse3(), in each 128 bits lane
+    const __m256i pairs = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m256i s = _mm256_shuffle_epi8(in, pairs);
+    
+    const __m256i even = _mm256_setr_epi16(-1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0);
+    __m256i v = _mm256_or_si256(_mm256_and_si256(even, _mm256_srli_epi16(s, 4)), _mm256_andnot_si256(even, s));
+    v = _mm256_and_si256(v, _mm256_set1_epi16(0x0FFF));
+    
+    __m256i u = _mm256_add_epi16(v, _mm256_set1_epi16(0x4E00)); // U12b_start
+    
+    __m256i t0 = _mm256_or_si256(_mm256_srli_epi16(u, 12), _mm256_set1_epi16(0xE0));
+    __m256i t1 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(u, 6), _mm256_set1_epi16(0x3F)), _mm256_set1_epi16(0x80));
+    __m256i t2 = _mm256_or_si256(_mm256_and_si256(u, _mm256_set1_epi16(0x3F)), _mm256_set1_epi16(0x80));
+    
+    __m256i a = _mm256_packus_epi16(t0, t1);
+    __m256i b = _mm256_packus_epi16(t2, t2);
+    
+    const __m256i a0 = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5));
+    const __m256i b0 = _mm256_broadcastsi128_si256(_mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1));
+    const __m256i a1 = _mm256_broadcastsi128_si256(_mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    const __m256i b1 = _mm256_broadcastsi128_si256(_mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1));
+    
+    *tail = _mm256_or_si256(_mm256_shuffle_epi8(a, a1), _mm256_shuffle_epi8(b, b1));
+    return _mm256_or_si256(_mm256_shuffle_epi8(a, a0), _mm256_shuffle_epi8(b, b0));
+}
+
+__attribute__((target("avx2")))
+static size_t encode_three_bytes_tokens_avx2(const uint8_t *p, const uint8_t *end, uint8_t *o) {
+    
+    size_t tokens = 0;
+    
+    while(end - p >= 33) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)p);
+        __m256i next = _mm256_loadu_si256((const __m256i *)(p + 1));
+        
+        uint32_t eq_next = _mm256_movemask_epi8(_mm256_cmpeq_epi8(in, next));
+        uint32_t high = _mm256_movemask_epi8(in);
+        size_t n = leading_three_bytes_tokens(eq_next, high, TOKEN_STARTS_8, 8);
+        if(n == 0) break;
+        
+        // 12 bytes in each 128 bits lane
+        __m128i hi = _mm_loadu_si128((const __m128i *)(p + 12));
+        __m256i lanes = _mm256_inserti128_si256(in, hi, 1);
+        
+        __m256i tail;
+        __m256i head = utf8_from_u12b_avx2(lanes, &tail);
+        _mm_storeu_si128((__m128i *)o, _mm256_castsi256_si128(head));
+        _mm_storel_epi64((__m128i *)(o + 16), _mm256_castsi256_si128(tail));
+        _mm_storeu_si128((__m128i *)(o + 24), _mm256_extracti128_si256(head, 1));
+        _mm_storel_epi64((__m128i *)(o + 40), _mm256_extracti128_si256(tail, 1));
+        
+        p += 3 * n;
+        o += 6 * n;
+        tokens += n;
+        
+        if(n < 8) break;
+    }
+    
+    return tokens;
+}
+
+// bit j of eq_next is set when p[j] == p[j+1], bit j of high when p[j] >= 0x80, reads 65 bytes
+__attribute__((target("sse2")))
+static void byte_masks_sse2(const uint8_t *p, uint64_t *eq_next, uint64_t *high) {
+    
+    uint64_t eq = 0;
+    uint64_t hi = 0;
+    
+    for(int k = 0; k < 4; k++) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+        __m128i next = _mm_loadu_si128((const __m128i *)(p + 16 * k + 1));
+        eq |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(in, next)) << (16 * k);
+        hi |= (uint64_t)(uint16_t)_mm_movemask_epi8(in) << (16 * k);
+    }
+    
+    *eq_next = eq;
+    *high = hi;
+}
+
+__attribute__((target("avx2")))
+static void byte_masks_avx2(const uint8_t *p, uint64_t *eq_next, uint64_t *high) {
+    
+    __m256i in0 = _mm256_loadu_si256((const __m256i *)p);
+    __m256i in1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+    __m256i next0 = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i next1 = _mm256_loadu_si256((const __m256i *)(p + 33));
+    
+    *eq_next = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(in0, next0)) | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(in1, next1)) << 32;
+    *high = (uint32_t)_mm256_movemask_epi8(in0) | (uint64_t)(uint32_t)_mm256_movemask_epi8(in1) << 32;
+}
+
+typedef void (*byte_masks_t)(const uint8_t *p, uint64_t *eq_next, uint64_t *high);
+
+static byte_masks_t byte_masks_builder(void) {
+    
+    if(__builtin_cpu_supports("avx2")) return byte_masks_avx2;
+    if(__builtin_cpu_supports("sse2")) return byte_masks_sse2;
+    
+    return NULL;
+}
+
+typedef size_t (*three_bytes_kernel_t)(const uint8_t *p, const uint8_t *end, uint8_t *o);
+
+static three_bytes_kernel_t three_bytes_kernel(void) {
+    
+    if(__builtin_cpu_supports("avx2")) return encode_three_bytes_tokens_avx2;
+    if(__builtin_cpu_supports("ssse3")) return encode_three_bytes_tokens_ssse3;
+    
+    return NULL;
+}
+
+#endif
+
+// encodes either into wide characters (wdst) or into UTF-8 (udst)
+// with long_runs, runs of more than 2 * 0xFFF bytes are v2 long runs
+static inline void encode_tokens(const uint8_t *src, size_t src_len, int is_last, int long_runs, wchar_t *wdst, uint8_t *udst, size_t *src_used, size_t *dst_len, uint32_t *crc) {
+    
+    const uint8_t *p = src;
+    const uint8_t *end = src + src_len;
+    wchar_t *ow = wdst;
+    uint8_t *o8 = udst;
+    const uint8_t *summed = src; // with crc, the bytes before are in *crc
+    
+#ifdef UNIBINARY_X86_KERNELS
+    // the kernels write past their output, which is fine as long as 33 bytes or more are left to encode
+    three_bytes_kernel_t kernel = udst != NULL ? three_bytes_kernel() : NULL;
+    byte_masks_t byte_masks = byte_masks_builder();
+    
+    // with crc, they stop in time for the next sum
+    size_t kernel_span = crc != NULL ? UNIBINARY_CRC32C_STEP : SIZE_MAX;
+#endif
+    
+#define EMIT(u) do { if(udst) o8 = put_utf8(o8, (u)); else *ow++ = (u); } while(0)
+#define EMIT_RUN(at, n) do { \
+    uint8_t b = *(at); \
+    if((n) >= UNIBINARY_CRC32C_RUN && crc != NULL) { \
+        *crc = crc32c_run(crc32c(*crc, summed, (at) - summed), b, (n)); \
+        summed = (at) + (n); \
+    } \
+    if((n) > UNIBINARY_MAX_REPEATS) { \
+        EMIT(V2_long_run); \
+        EMIT(U8_start + (b)); \
+        EMIT(U12b_start + (wchar_t)((n) >> 12)); \
+        EMIT(U12b_start + (wchar_t)((n) & 0xFFF)); \
+    } else { \
+        EMIT(U8_start + (b)); \
+        EMIT(U12b_start + (wchar_t)(n)); \
+    } \
+} while(0)
+    
+    while(p < end) {
+        
+        size_t left = end - p;
+        
+        if(crc != NULL && (size_t)(p - summed) >= UNIBINARY_CRC32C_STEP) {
+            *crc = crc32c(*crc, summed, p - summed);
+            summed = p;
+        }
+        
+#ifdef UNIBINARY_X86_KERNELS
+        if(byte_masks != NULL && left >= 65) {
+            
+            // same decisions as below, taken from the masks of the next 64 bytes
+            uint64_t eq_next, high;
+            byte_masks(p, &eq_next, &high);
+            
+            uint64_t runs = eq_next & (eq_next >> 1); // valid up to bit 62
+            uint64_t stops = runs | high;
+            
+            size_t j = 0;
+            int undecided = 0;
+            
+            while(j < 62) {
+                
+                if((runs >> j) & 1) {
+                    // byte repeated N times, counted in the mask unless it goes past the window
+                    uint64_t ends = ~(eq_next >> j);
+                    size_t n = ends ? __builtin_ctzll(ends) + 1 : 65;
+                    if(j + n > 64) {
+                        n = run_token_length(p + j, end, is_last, long_runs);
+                        if(n == 0) {
+                            undecided = 1;
+                            break;
+                        }
+                    }
+                    
+                    EMIT_RUN(p + j, n);
+                    j += n;
+                } else if (((high >> j) & 3) == 0) {
+                    // ASCII pairs, up to the next high byte or run
+                    uint64_t next_stops = stops >> j;
+                    size_t stretch = next_stops ? __builtin_ctzll(next_stops) : 64 - j;
+                    size_t pairs = stretch < 2 ? 1 : stretch / 2;
+                    
+                    for(size_t k = 0; k < pairs; k++) {
+                        uint8_t c0 = p[j];
+                        uint8_t c1 = p[j+1];
+                        EMIT(UB_U12A_START(((c0 >> 6) << 1) | (c1 >> 6)) + ((c0 & 0x3F) << 6) + (c1 & 0x3F));
+                        j += 2;
+                    }
+                } else {
+                    // 3 bytes
+                    EMIT(U12b_start + ((p[j] << 4) | (p[j+1] >> 4)));
+                    EMIT(U12b_start + (((p[j+1] & 0xF) << 8) | p[j+2]));
+                    j += 3;
+                    
+                    if(kernel != NULL) {
+                        size_t n = kernel(p + j, (size_t)(end - (p + j)) > kernel_span ? p + j + kernel_span : end, o8);
+                        j += 3 * n;
+                        o8 += 6 * n;
+                    }
+                }
+            }
+            
+            p += j;
+            
+            if(undecided) break;
+            continue;
+        }
+#endif
+        
+        // the next token depends on bytes we don't have yet
+        if(left < 3 && !is_last) break;
+        
+        uint8_t c0 = p[0];
+        
+        if(left >= 3 && p[1] == c0 && p[2] == c0) {
+            // byte repeated N times -> U8(B), U12(N)
+            size_t n = run_token_length(p, end, is_last, long_runs);
+            if(n == 0) break;
+            
+            EMIT_RUN(p, n);
+            p += n;
+        } else if (left >= 2 && c0 < 128 && p[1] < 128) {
+            // ASCII characters A1, A2 -> U12a(A1, A2), same as unichr_12a_from_two_ascii()
+            uint8_t c1 = p[1];
+            EMIT(UB_U12A_START(((c0 >> 6) << 1) | (c1 >> 6)) + ((c0 & 0x3F) << 6) + (c1 & 0x3F));
+            p += 2;
+        } else if (left >= 3) {
+            // bytes B1, B2, B3 -> U12b, U12b
+            EMIT(U12b_start + ((c0 << 4) | (p[1] >> 4)));
+            EMIT(U12b_start + (((p[1] & 0xF) << 8) | p[2]));
+            p += 3;
+            
+#ifdef UNIBINARY_X86_KERNELS
+            // high entropy data, see if the next tokens are 3 bytes too
+            if(kernel != NULL) {
+                size_t n = kernel(p, (size_t)(end - p) > kernel_span ? p + kernel_span : end, o8);
+                p += 3 * n;
+                o8 += 6 * n;
+            }
+#endif
+        } else {
+            // byte B -> U8(B)
+            EMIT(U8_start + c0);
+            p += 1;
+        }
+    }
+    
+#undef EMIT_RUN
+#undef EMIT
+    
+    if(crc != NULL) *crc = crc32c(*crc, summed, p - summed);
+    
+    *src_used = p - src;
+    *dst_len = udst ? (size_t)(o8 - udst) : (size_t)(ow - wdst);
+}
+
+int unibinary_encode_buffer(const uint8_t *src, size_t src_len, int is_last, wchar_t *dst, size_t *src_used, size_t *dst_len) {
+    
+    encode_tokens(src, src_len, is_last, 0, dst, NULL, src_used, dst_len, NULL);
+    
+    return EXIT_SUCCESS;
+}
+
+int unibinary_encode_buffer_utf8(const uint8_t *src, size_t src_len, int is_last, uint8_t *dst, size_t *src_used, size_t *dst_len) {
+    
+    encode_tokens(src, src_len, is_last, 0, NULL, dst, src_used, dst_len, NULL);
+    
+    return EXIT_SUCCESS;
+}
+
+enum {
+    UB_STEP_RUN = 0,
+    UB_STEP_LONG_RUN,
+    UB_STEP_PAIR,
+    UB_STEP_TRIPLE,
+    UB_STEP_BYTE // at the end only
+};
+
+#define UB_STEP(kind, n) ((uint32_t)(kind) << 24 | (uint32_t)(n))
+#define UB_COST(characters, bytes) ((uint64_t)(characters) << 32 | (bytes))
+#define UB_NO_COST UINT64_MAX
+
+// endpoints of the run tokens starting at i, with the cheapest one in front, the longest of equal ones
+// so that a run cut by the end of a window is cut in the lookahead
+typedef struct {
+    uint32_t *ends;
+    size_t head, tail; // ends[head..tail) decrease, costs do not decrease
+} run_ends_t;
+
+static inline void run_ends_push(run_ends_t *r, const uint64_t *best, uint32_t j) {
+    while(r->tail > r->head && best[r->ends[r->tail - 1]] > best[j]) r->tail--;
+    r->ends[r->tail++] = j;
+}
+
+static inline size_t run_ends_min(run_ends_t *r, uint32_t last) {
+    while(r->ends[r->head] > last) r->head++;
+    return r->ends[r->head];
+}
+
+// the arrays of encode_tokens_optimal(), grown by the calls which need more and kept between them
+struct unibinary_scratch {
+    uint64_t *best;
+    uint32_t *steps;
+    uint32_t *runs;
+    uint32_t *long_runs;
+    size_t capacity; // entries of each
+    const unibinary_allocator_t *allocator;
+};
+
+typedef struct unibinary_scratch scratch_t;
+
+static void scratch_release(scratch_t *scratch) {
+    
+    release(scratch->allocator, scratch->long_runs);
+    release(scratch->allocator, scratch->runs);
+    release(scratch->allocator, scratch->steps);
+    release(scratch->allocator, scratch->best);
+    scratch->best = NULL;
+    scratch->steps = NULL;
+    scratch->runs = NULL;
+    scratch->long_runs = NULL;
+    scratch->capacity = 0;
+}
+
+// at least capacity entries, twice the previous ones up to limit so that growing takes a few calls
+static int scratch_reserve(scratch_t *scratch, size_t capacity, size_t limit) {
+    
+    if(scratch->capacity >= capacity) return EXIT_SUCCESS;
+    
+    size_t twice = 2 * scratch->capacity < limit ? 2 * scratch->capacity : limit;
+    if(twice > capacity) capacity = twice;
+    
+    scratch_release(scratch);
+    
+    scratch->best = allocate(scratch->allocator, capacity * sizeof(uint64_t));
+    scratch->steps = allocate(scratch->allocator, capacity * sizeof(uint32_t));
+    scratch->runs = allocate(scratch->allocator, capacity * sizeof(uint32_t));
+    scratch->long_runs = allocate(scratch->allocator, capacity * sizeof(uint32_t));
+    
+    if(scratch->best == NULL || scratch->steps == NULL || scratch->runs == NULL || scratch->long_runs == NULL) {
+        scratch_release(scratch);
+        return EXIT_FAILURE;
+    }
+    
+    scratch->capacity = capacity;
+    
+    return EXIT_SUCCESS;
+}
+
+// windows hold a whole long run, which is then never cut
+static inline size_t optimal_window(int long_runs) {
+    return long_runs ? UNIBINARY_V2_MAX_REPEATS + UNIBINARY_OPTIMAL_WINDOW : UNIBINARY_OPTIMAL_WINDOW;
+}
+
+// same contract as encode_tokens() into UTF-8, with the token sequence of fewest characters, then of fewest bytes
+// a dynamic programming parse over windows, whose ends are only committed in the last window
+// the decoder reads it as any other encoding
+static void encode_tokens_optimal(const uint8_t *src, size_t src_len, int is_last, int long_runs, uint8_t *dst, size_t *src_used, size_t *dst_len, scratch_t *scratch) {
+    
+    size_t window = optimal_window(long_runs);
+    
+    // windows are whole but at the end of the input, so that they don't depend on how it was chunked
+    if(!is_last && src_len < window + UNIBINARY_OPTIMAL_LOOKAHEAD) {
+        *src_used = 0;
+        *dst_len = 0;
+        return;
+    }
+    
+    if(scratch_reserve(scratch, (src_len < window ? src_len : window) + 1, window + 1) != EXIT_SUCCESS) {
+        // still a valid encoding
+        encode_tokens(src, src_len, is_last, long_runs, NULL, dst, src_used, dst_len, NULL);
+        return;
+    }
+    
+    uint64_t *best = scratch->best;
+    uint32_t *steps = scratch->steps;
+    run_ends_t runs = { scratch->runs, 0, 0 };
+    run_ends_t long_runs_ends = { scratch->long_runs, 0, 0 };
+    
+    const uint64_t run_cost = UB_COST(2, UB_U8_UTF8_LENGTH + UB_U12_UTF8_LENGTH);
+    const uint64_t long_run_cost = UB_COST(4, 3 + UB_U8_UTF8_LENGTH + 2 * UB_U12_UTF8_LENGTH);
+    const uint64_t pair_cost = UB_COST(1, UB_U12_UTF8_LENGTH);
+    const uint64_t triple_cost = UB_COST(2, 2 * UB_U12_UTF8_LENGTH);
+    const uint64_t byte_cost = UB_COST(1, UB_U8_UTF8_LENGTH);
+    
+    const uint8_t *p = src;
+    const uint8_t *end = src + src_len;
+    uint8_t *o = dst;
+    
+    while(p < end) {
+        
+        size_t left = end - p;
+        if(!is_last && left < window + UNIBINARY_OPTIMAL_LOOKAHEAD) break;
+        
+        size_t w = left < window ? left : window;
+        int last = is_last && w == left;
+        
+        // cheapest encoding of p[i..w), backwards
+        best[w] = 0;
+        size_t run = 0;
+        
+        for(size_t i = w; i-- > 0; ) {
+            
+            uint64_t cost = UB_NO_COST;
+            uint32_t step = 0;
+            size_t rest = w - i;
+            
+#define UB_TRY(c, j, s) do { if(best[j] != UB_NO_COST && (c) + best[j] < cost) { cost = (c) + best[j]; step = (s); } } while(0)
+            
+            if(rest >= 2 && p[i] < 128 && p[i+1] < 128) UB_TRY(pair_cost, i + 2, UB_STEP(UB_STEP_PAIR, 2));
+            if(rest >= 3) UB_TRY(triple_cost, i + 3, UB_STEP(UB_STEP_TRIPLE, 3));
+            // lone U8 only end the input, elsewhere they end every parse in the lookahead, where nothing is committed
+            if(rest <= 2) UB_TRY(rest * byte_cost, w, UB_STEP(UB_STEP_BYTE, rest));
+            
+            // runs of 3 bytes or more, any length up to the end of the run
+            if(rest >= 2 && p[i] == p[i+1]) {
+                run++;
+            } else {
+                run = 1;
+                runs.head = runs.tail = 0;
+                long_runs_ends.head = long_runs_ends.tail = 0;
+            }
+            
+            if(run >= 3) {
+                run_ends_push(&runs, best, i + 3);
+                size_t j = run_ends_min(&runs, i + (run < UNIBINARY_MAX_REPEATS ? run : UNIBINARY_MAX_REPEATS));
+                UB_TRY(run_cost, j, UB_STEP(UB_STEP_RUN, j - i));
+            }
+            
+            if(long_runs && run > UNIBINARY_MAX_REPEATS) {
+                run_ends_push(&long_runs_ends, best, i + UNIBINARY_MAX_REPEATS + 1);
+                size_t j = run_ends_min(&long_runs_ends, i + (run < UNIBINARY_V2_MAX_REPEATS ? run : UNIBINARY_V2_MAX_REPEATS));
+                UB_TRY(long_run_cost, j, UB_STEP(UB_STEP_LONG_RUN, j - i));
+            }
+            
+#undef UB_TRY
+            
+            best[i] = cost;
+            steps[i] = step;
+        }
+        
+        // the tokens starting in the lookahead are parsed again with the next bytes
+        // and so are those of a run at the end which could still become a longer long run, as in encode_tokens()
+        size_t commit = last ? w : w - UNIBINARY_OPTIMAL_LOOKAHEAD;
+        
+        if(!last && long_runs) {
+            size_t r = w - 1;
+            while(r > 0 && p[r-1] == p[w-1]) r--;
+            if(w - r > UNIBINARY_MAX_REPEATS && w - r < UNIBINARY_V2_MAX_REPEATS && r < commit) commit = r;
+        }
+        
+        size_t i = 0;
+        
+        while(i < commit) {
+            uint32_t kind = steps[i] >> 24;
+            size_t n = steps[i] & 0xFFFFFF;
+            const uint8_t *t = p + i;
+            
+            switch(kind) {
+                case UB_STEP_RUN:
+                    o = put_utf8(o, U8_start + t[0]);
+                    o = put_utf8(o, U12b_start + (wchar_t)n);
+                    break;
+                case UB_STEP_LONG_RUN:
+                    o = put_utf8(o, V2_long_run);
+                    o = put_utf8(o, U8_start + t[0]);
+                    o = put_utf8(o, U12b_start + (wchar_t)(n >> 12));
+                    o = put_utf8(o, U12b_start + (wchar_t)(n & 0xFFF));
+                    break;
+                case UB_STEP_PAIR:
+                    o = put_utf8(o, UB_U12A_START(((t[0] >> 6) << 1) | (t[1] >> 6)) + ((t[0] & 0x3F) << 6) + (t[1] & 0x3F));
+                    break;
+                case UB_STEP_TRIPLE:
+                    o = put_utf8(o, U12b_start + ((t[0] << 4) | (t[1] >> 4)));
+                    o = put_utf8(o, U12b_start + (((t[1] & 0xF) << 8) | t[2]));
+                    break;
+                default:
+                    for(size_t k = 0; k < n; k++) o = put_utf8(o, U8_start + t[k]);
+                    break;
+            }
+            
+            i += n;
+        }
+        
+        p += i;
+        
+        if(i == 0) break;
+    }
+    
+    *src_used = p - src;
+    *dst_len = o - dst;
+}
+
+#undef UB_STEP
+#undef UB_COST
+#undef UB_NO_COST
+
+// the tokens of options into UTF-8, options may be NULL, and so may scratch without optimal
+// with a checksum, the bytes used are added to *crc unless it is NULL, by the greedy parse as it goes
+static inline void encode_tokens_of(const unibinary_options_t *options, scratch_t *scratch, const uint8_t *src, size_t src_len, int is_last, uint8_t *dst, size_t *src_used, size_t *dst_len, uint32_t *crc) {
+    
+    if(!has_checksum(options)) crc = NULL;
+    
+    if(options != NULL && options->optimal) {
+        encode_tokens_optimal(src, src_len, is_last, is_v2(options), dst, src_used, dst_len, scratch);
+        if(crc != NULL) *crc = crc32c(*crc, src, *src_used);
+    } else {
+        encode_tokens(src, src_len, is_last, is_v2(options), NULL, dst, src_used, dst_len, crc);
+    }
+}
+
+// input bytes an encoder keeps between chunks until their tokens are known, a whole long run for v2, a whole window when optimal
+static inline size_t carry_capacity(int long_runs, int optimal) {
+    
+    if(optimal) return optimal_window(long_runs) + UNIBINARY_OPTIMAL_LOOKAHEAD;
+    
+    return (long_runs ? UNIBINARY_V2_MAX_REPEATS : UNIBINARY_MAX_REPEATS) + 2;
+}
+
+// block index
+
+// largest block size, and offsets and lengths in the index are below 1 << 36
+#define UNIBINARY_MAX_BLOCK_SIZE 0xFFFFFF
+#define UNIBINARY_INDEX_LIMIT ((uint64_t)1 << 36)
+
+// UTF-8 bytes of the index of count blocks, 4 characters a block and 6 for its end
+#define UNIBINARY_INDEX_LENGTH(count) (12 * (count) + 18)
+
+typedef struct {
+    size_t block_size;    // 0 without an index
+    size_t wrap_length;
+    uint64_t position;    // input bytes encoded
+    uint64_t characters;  // characters output, the header included
+    uint64_t bytes;       // and their UTF-8 bytes, without newlines
+    uint64_t *offsets;    // of the first character of each block in the text, newlines included
+    size_t count;
+    size_t capacity;
+    const unibinary_allocator_t *allocator;
+} block_index_t;
+
+// the header is counted, all indexed outputs start with one
+// every encoder but the streaming one starts here, which checks the version for all of them
+static int index_init(block_index_t *index, const unibinary_options_t *options) {
+    
+    memset(index, 0, sizeof(block_index_t));
+    
+    if(version_ok(options) != EXIT_SUCCESS) return EXIT_FAILURE;
+    
+    if(!has_index(options)) return EXIT_SUCCESS;
+    
+    if(options->block_size > UNIBINARY_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "-- block size over %d bytes\n", UNIBINARY_MAX_BLOCK_SIZE);
+        return EXIT_FAILURE;
+    }
+    
+    index->block_size = options->block_size;
+    index->wrap_length = options->wrap_length;
+    index->allocator = options->allocator;
+    index->characters = 1;
+    index->bytes = 3;
+    
+    return EXIT_SUCCESS;
+}
+
+static void index_end(block_index_t *index) {
+    release(index->allocator, index->offsets);
+    index->offsets = NULL;
+}
+
+// a block starts at the current position
+static int index_push(block_index_t *index) {
+    
+    uint64_t offset = index->bytes + (index->wrap_length ? index->characters / index->wrap_length : 0);
+    
+    if(offset >= UNIBINARY_INDEX_LIMIT || index->position + index->block_size >= UNIBINARY_INDEX_LIMIT) {
+        fprintf(stderr, "-- too large for a block index\n");
+        return EXIT_FAILURE;
+    }
+    
+    if(index->count == index->capacity) {
+        size_t capacity = index->capacity ? 2 * index->capacity : 1024;
+        uint64_t *offsets = allocate(index->allocator, capacity * sizeof(uint64_t));
+        if(offsets == NULL) {
+            fprintf(stderr, "-- malloc error\n");
+            return EXIT_FAILURE;
+        }
+        if(index->count > 0) memcpy(offsets, index->offsets, index->count * sizeof(uint64_t));
+        release(index->allocator, index->offsets);
+        index->offsets = offsets;
+        index->capacity = capacity;
+    }
+    
+    index->offsets[index->count++] = offset;
+    
+    return EXIT_SUCCESS;
+}
+
+// the next block may start with U8 or U12a, which cannot follow a single U8, so an odd one ends as a run of 1 byte
+static size_t end_block(uint8_t *o, size_t len) {
+    
+    size_t singles = 0;
+    
+    // U8 characters take 2 bytes, the others 3 and none starts with 110xxxxx in its last 2 bytes
+    while(len >= 2 * (singles + 1) && (o[len - 2 * (singles + 1)] & 0xE0) == 0xC0) singles++;
+    
+    if(singles % 2 == 0) return len;
+    
+    return put_utf8(o + len, U12b_start + 1) - o;
+}
+
+// characters of the UTF-8 tokens at s, without newlines, from their continuation bytes 10xxxxxx counted 8 at a time
+static size_t token_characters(const uint8_t *s, size_t n) {
+    
+    size_t continuations = 0;
+    size_t i = 0;
+    
+    for(; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        uint64_t ones = (w & ~(w << 1) & 0x8080808080808080ull) >> 7;
+        continuations += (ones * 0x0101010101010101ull) >> 56; // the sum of the bytes in the top one
+    }
+    
+    for(; i < n; i++) continuations += (s[i] & 0xC0) == 0x80;
+    
+    return n - continuations;
+}
+
+// encode_tokens_of(), cut at each block boundary and counted in index, which may be NULL
+static int encode_blocks(const unibinary_options_t *options, scratch_t *scratch, block_index_t *index, const uint8_t *src, size_t src_len, int is_last, uint8_t *dst, size_t *src_used, size_t *dst_len, uint32_t *crc) {
+    
+    if(index == NULL || index->block_size == 0) {
+        encode_tokens_of(options, scratch, src, src_len, is_last, dst, src_used, dst_len, crc);
+        return EXIT_SUCCESS;
+    }
+    
+    size_t pos = 0;
+    uint8_t *o = dst;
+    
+    while(pos < src_len) {
+        
+        size_t block_left = index->block_size - index->position % index->block_size;
+        
+        // once, the tokens of a block may take several calls
+        if(block_left == index->block_size && index->count == index->position / index->block_size) {
+            if(index_push(index) != EXIT_SUCCESS) return EXIT_FAILURE;
+        }
+        
+        size_t len = src_len - pos < block_left ? src_len - pos : block_left;
+        int ends = is_last || len == block_left;
+        
+        size_t used, out_len;
+        encode_tokens_of(options, scratch, src + pos, len, ends, o, &used, &out_len, crc);
+        if(ends) out_len = end_block(o, out_len);
+        
+        // characters only count for the newlines
+        index->position += used;
+        if(index->wrap_length) index->characters += token_characters(o, out_len);
+        index->bytes += out_len;
+        pos += used;
+        o += out_len;
+        
+        if(used < len) break;
+    }
+    
+    *src_used = pos;
+    *dst_len = o - dst;
+    
+    return EXIT_SUCCESS;
+}
+
+// the index after the text, on a line of its own if the text is wrapped and its last line is not complete
+static uint8_t *put_index(uint8_t *o, const block_index_t *index, size_t column) {
+    
+    if(column != 0) *o++ = '\n';
+    
+    for(size_t i = 0; i < index->count; i++) {
+        o = put_utf8(o, V2_block);
+        for(int shift = 24; shift >= 0; shift -= 12) o = put_utf8(o, U12b_start + (wchar_t)((index->offsets[i] >> shift) & 0xFFF));
+    }
+    
+    uint64_t end = (uint64_t)index->block_size << 36 | index->position;
+    o = put_utf8(o, V2_index);
+    for(int shift = 48; shift >= 0; shift -= 12) o = put_utf8(o, U12b_start + (wchar_t)((end >> shift) & 0xFFF));
+    
+    return o;
+}
+
+// put_index() into a buffer of the allocator
+static uint8_t *index_text(const block_index_t *index, size_t column, size_t *len) {
+    
+    uint8_t *text = allocate(index->allocator, 1 + UNIBINARY_INDEX_LENGTH(index->count));
+    if(text == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        return NULL;
+    }
+    
+    *len = put_index(text, index, column) - text;
+    
+    return text;
+}
+
+// writes UTF-8 encoded characters, with a newline every wrap_length characters
+// copies the n bytes of UTF-8 characters at s into line with a newline every wrap_length characters, returns the length of line
+static size_t wrap_utf8(const uint8_t *s, size_t n, uint8_t *line, size_t *count, size_t wrap_length) {
+    
+    const uint8_t *end = s + n;
+    uint8_t *l = line;
+    
+    while(s < end) {
+        size_t char_len = *s >= 0xE0 ? 3 : 2;
+        memcpy(l, s, char_len);
+        l += char_len;
+        s += char_len;
+        
+        *count = (*count + 1) % wrap_length;
+        
+        if(*count == 0) {
+            *l++ = '\n';
+        }
+    }
+    
+    return l - line;
+}
+
+int put_utf8_wrapped(FILE *fd_out, const uint8_t *s, size_t n, uint8_t *line, size_t *count, size_t wrap_length) {
+    
+    if(wrap_length == 0) {
+        return fwrite(s, 1, n, fd_out) == n ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    size_t line_len = wrap_utf8(s, n, line, count, wrap_length);
+    return fwrite(line, 1, line_len, fd_out) == line_len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// put_utf8_wrapped() of encoded text, counted in the stats of options
+static int write_encoded(FILE *fd_out, const uint8_t *s, size_t n, uint8_t *line, size_t *count, const unibinary_options_t *options) {
+    
+    unibinary_stats_t *stats = stats_of(options);
+    size_t newlines = stats_encoded(stats, s, n, *count, options->wrap_length);
+    
+    uint64_t since = stats_clock(stats);
+    int status = put_utf8_wrapped(fd_out, s, n, line, count, options->wrap_length);
+    stats_write(stats, n + newlines, since);
+    
+    return status;
+}
+
+static int encode_file(FILE *fd_in, FILE *fd_out, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    int v2 = is_v2(options);
+    
+    // room for the bytes carried over from the previous chunk
+    size_t in_capacity = UNIBINARY_CHUNK_SIZE + carry_capacity(v2, options->optimal);
+    
+    size_t out_capacity = unibinary_encoded_length_max(in_capacity, options);
+    
+    block_index_t index;
+    if(index_init(&index, options) != EXIT_SUCCESS) return EXIT_FAILURE;
+    scratch_t scratch = { .allocator = allocator };
+    
+    uint8_t *in = allocate(allocator, in_capacity);
+    uint8_t *out = allocate(allocator, out_capacity);
+    // encoded characters take at least 2 bytes, plus one newline each at most
+    uint8_t *line = allocate(allocator, out_capacity + out_capacity / 2);
+    if(in == NULL || out == NULL || line == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        release(allocator, in);
+        release(allocator, out);
+        release(allocator, line);
+        return EXIT_FAILURE;
+    }
+    
+    int status = EXIT_SUCCESS;
+    size_t carry = 0;
+    size_t out_count = 0;
+    uint32_t crc = 0;
+    
+    unibinary_stats_t *stats = stats_of(options);
+    
+    size_t header_len = put_header(out, options) - out;
+    if(header_len > 0 && write_encoded(fd_out, out, header_len, line, &out_count, options) != 0) status = EXIT_FAILURE;
+    
+    while(status == EXIT_SUCCESS) {
+        
+        uint64_t since = stats_clock(stats);
+        size_t read = fread(in + carry, 1, UNIBINARY_CHUNK_SIZE, fd_in);
+        stats_read(stats, read, since);
+        if(ferror(fd_in)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        int is_last = read < UNIBINARY_CHUNK_SIZE;
+        size_t in_len = carry + read;
+        
+        size_t used, out_len;
+        since = stats_clock(stats);
+        if(encode_blocks(options, &scratch, &index, in, in_len, is_last, out, &used, &out_len, &crc) != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        if(is_last) out_len = put_trailer(out + out_len, options, crc) - out;
+        stats_codec(stats, since);
+        
+        if(write_encoded(fd_out, out, out_len, line, &out_count, options) != 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        if(is_last && index.block_size) {
+            size_t index_len;
+            uint8_t *text = index_text(&index, out_count, &index_len);
+            since = stats_clock(stats);
+            if(text == NULL || fwrite(text, 1, index_len, fd_out) != index_len) status = EXIT_FAILURE;
+            stats_write(stats, index_len, since);
+            release(allocator, text);
+        }
+        
+        if(is_last) break;
+        
+        carry = in_len - used;
+        memmove(in, in + used, carry);
+    }
+    
+    scratch_release(&scratch);
+    release(allocator, in);
+    release(allocator, out);
+    release(allocator, line);
+    index_end(&index);
+    
+    return status;
+}
+
+int unibinary_encode(FILE *fd_in, FILE *fd_out, size_t wrap_length) {
+    
+    unibinary_options_t options = { .wrap_length = wrap_length };
+    
+    return encode_file(fd_in, fd_out, &options);
+}
+
+// bytes of the token encode_tokens() emits at p, and its number of characters
+// 0 when it depends on bytes after end
+static inline size_t token_at(const uint8_t *p, const uint8_t *end, int is_last, int long_runs, size_t *characters) {
+    
+    size_t left = end - p;
+    
+    if(left < 3 && !is_last) return 0;
+    
+    if(left >= 3 && p[1] == p[0] && p[2] == p[0]) {
+        size_t n = run_token_length(p, end, is_last, long_runs);
+        *characters = n > UNIBINARY_MAX_REPEATS ? 4 : 2;
+        return n;
+    }
+    
+    if(left >= 2 && p[0] < 128 && p[1] < 128) {
+        *characters = 1;
+        return 2;
+    }
+    
+    if(left >= 3) {
+        *characters = 2;
+        return 3;
+    }
+    
+    *characters = 1;
+    return 1;
+}
+
+// walks the serial parse from the token boundary pos and the parse started at start until they meet
+// returns the meeting point and the characters emitted from start before it, or -1 if they don't meet in the window
+static int resync(const uint8_t *src, size_t src_len, int is_last, size_t pos, size_t start, size_t *meet, size_t *skipped) {
+    
+    const uint8_t *end = src + src_len;
+    size_t limit = start + UNIBINARY_RESYNC_WINDOW;
+    size_t a = pos;
+    size_t b = start;
+    size_t characters = 0;
+    
+    while(a != b) {
+        if(a > limit || b > limit) return -1;
+        
+        size_t c;
+        if(a < b) {
+            size_t n = token_at(src + a, end, is_last, 0, &c);
+            if(n == 0) return -1;
+            a += n;
+        } else {
+            size_t n = token_at(src + b, end, is_last, 0, &c);
+            if(n == 0) return -1;
+            b += n;
+            characters += c;
+        }
+    }
+    
+    *meet = a;
+    *skipped = characters;
+    
+    return EXIT_SUCCESS;
+}
+
+// runs job on each of the count elements of jobs, the first one on the calling thread
+// jobs run on the calling thread too when a thread cannot be created
+static void run_jobs(void *(*job)(void *), void *jobs, size_t job_size, unsigned int count, const unibinary_allocator_t *allocator) {
+    
+    pthread_t *tids = allocate(allocator, count * sizeof(pthread_t));
+    int *started = allocate(allocator, count * sizeof(int));
+    if(started != NULL) memset(started, 0, count * sizeof(int));
+    
+    for(unsigned int k = 1; k < count && tids != NULL && started != NULL; k++) {
+        started[k] = pthread_create(&tids[k], NULL, job, (uint8_t *)jobs + k * job_size) == 0;
+    }
+    
+    job(jobs);
+    
+    for(unsigned int k = 1; k < count; k++) {
+        if(started != NULL && started[k]) {
+            pthread_join(tids[k], NULL);
+        } else {
+            job((uint8_t *)jobs + k * job_size);
+        }
+    }
+    
+    release(allocator, started);
+    release(allocator, tids);
+}
+
+typedef struct {
+    const uint8_t *src;
+    size_t src_len;
+    int is_last;
+    uint8_t *dst;
+    size_t src_used;
+    size_t dst_len;
+} encode_job_t;
+
+static void *encode_job(void *arg) {
+    
+    encode_job_t *job = arg;
+    unibinary_encode_buffer_utf8(job->src, job->src_len, job->is_last, job->dst, &job->src_used, &job->dst_len);
+    
+    return NULL;
+}
+
+// encodes batches of one chunk per thread, the output is the same as unibinary_encode()
+static int encode_parallel(FILE *fd_in, FILE *fd_out, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    unsigned int threads = threads_of(options);
+    size_t batch_size = threads * UNIBINARY_PARALLEL_CHUNK_SIZE;
+    
+    // room for the bytes carried over from the previous batch
+    size_t in_capacity = batch_size + UNIBINARY_MAX_REPEATS + 2;
+    
+    // a chunk can grow up to the next split, plus the carry or the bytes left by the previous chunk
+    size_t out_capacity = UNIBINARY_ENCODED_MAX_UTF8_LENGTH(2 * UNIBINARY_PARALLEL_CHUNK_SIZE + UNIBINARY_MAX_REPEATS + 2);
+    
+    uint8_t *in = allocate(allocator, in_capacity);
+    uint8_t *scratch = allocate(allocator, out_capacity);
+    uint8_t *line = options->wrap_length ? allocate(allocator, out_capacity + out_capacity / 2) : NULL;
+    encode_job_t *jobs = allocate(allocator, threads * sizeof(encode_job_t));
+    size_t *splits = allocate(allocator, (threads + 1) * sizeof(size_t));
+    if(jobs != NULL) memset(jobs, 0, threads * sizeof(encode_job_t));
+    
+    int status = EXIT_SUCCESS;
+    
+    if(in == NULL || scratch == NULL || (options->wrap_length && line == NULL) || jobs == NULL || splits == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        status = EXIT_FAILURE;
+        goto cleanup;
+    }
+    
+    for(unsigned int k = 0; k < threads; k++) {
+        jobs[k].dst = allocate(allocator, out_capacity);
+        if(jobs[k].dst == NULL) {
+            fprintf(stderr, "-- malloc error\n");
+            status = EXIT_FAILURE;
+            goto cleanup;
+        }
+    }
+    
+    size_t carry = 0;
+    size_t out_count = 0;
+    unibinary_stats_t *stats = stats_of(options);
+    
+    while(1) {
+        
+        uint64_t since = stats_clock(stats);
+        size_t read = fread(in + carry, 1, batch_size, fd_in);
+        stats_read(stats, read, since);
+        if(ferror(fd_in)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        int is_last = read < batch_size;
+        size_t in_len = carry + read;
+        
+        // split after a byte change, where the serial parse has a token boundary at most 2 bytes later
+        size_t chunk_len = in_len / threads;
+        splits[0] = 0;
+        splits[threads] = in_len;
+        for(unsigned int k = 1; k < threads; k++) {
+            if(chunk_len < UNIBINARY_RESYNC_WINDOW) {
+                splits[k] = in_len;
+                continue;
+            }
+            
+            size_t s = k * chunk_len > splits[k-1] ? k * chunk_len : splits[k-1];
+            size_t limit = k + 1 < threads ? (k + 1) * chunk_len : in_len;
+            while(s < limit && in[s] == in[s-1]) s++;
+            splits[k] = s;
+        }
+        
+        for(unsigned int k = 0; k < threads; k++) {
+            encode_job_t *job = &jobs[k];
+            job->src = in + splits[k];
+            job->src_len = splits[k+1] - splits[k];
+            job->is_last = is_last && k == threads - 1;
+        }
+        
+        since = stats_clock(stats);
+        run_jobs(encode_job, jobs, sizeof(encode_job_t), threads, allocator);
+        stats_codec(stats, since);
+        
+        // splice the chunks in order, pos is the next token boundary of the serial parse
+        size_t pos = 0;
+        
+        for(unsigned int k = 0; k < threads; k++) {
+            
+            encode_job_t *job = &jobs[k];
+            size_t start = splits[k];
+            size_t meet = start;
+            size_t skipped = 0;
+            
+            if(pos < start) {
+                if(resync(in, in_len, is_last, pos, start, &meet, &skipped) != 0 || meet > start + job->src_used) {
+                    // the parses don't meet, encode the chunk again from pos
+                    size_t used, scratch_len;
+                    unibinary_encode_buffer_utf8(in + pos, splits[k+1] - pos, job->is_last, scratch, &used, &scratch_len);
+                    pos += used;
+                    
+                    if(write_encoded(fd_out, scratch, scratch_len, line, &out_count, options) != 0) {
+                        status = EXIT_FAILURE;
+                        break;
+                    }
+                    continue;
+                }
+                
+                size_t used, scratch_len;
+                unibinary_encode_buffer_utf8(in + pos, meet - pos, 1, scratch, &used, &scratch_len);
+                
+                if(write_encoded(fd_out, scratch, scratch_len, line, &out_count, options) != 0) {
+                    status = EXIT_FAILURE;
+                    break;
+                }
+            }
+            
+            const uint8_t *o = job->dst;
+            for(size_t i = 0; i < skipped; i++) {
+                o += *o >= 0xE0 ? 3 : 2;
+            }
+            
+            if(write_encoded(fd_out, o, job->dst_len - (o - job->dst), line, &out_count, options) != 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            
+            pos = start + job->src_used;
+        }
+        
+        if(status != EXIT_SUCCESS || is_last) break;
+        
+        carry = in_len - pos;
+        memmove(in, in + pos, carry);
+    }
+    
+cleanup:
+    for(unsigned int k = 0; jobs != NULL && k < threads; k++) {
+        release(allocator, jobs[k].dst);
+    }
+    release(allocator, in);
+    release(allocator, scratch);
+    release(allocator, line);
+    release(allocator, jobs);
+    release(allocator, splits);
+    
+    return status;
+}
+
+int unibinary_encode_with_options(FILE *fd_in, FILE *fd_out, const unibinary_options_t *options) {
+    
+    if(encodes_in_parallel(options)) {
+        return encode_parallel(fd_in, fd_out, options);
+    }
+    
+    return encode_file(fd_in, fd_out, options);
+}
+
+// decoded length of the leading complete tokens of src, same checks as unibinary_decode_buffer()
+// *framed, unless framed is NULL, is set if a header with the checksum feature or a trailer was read
+static int decoded_length_of(const uint8_t *src, size_t src_len, int is_last, int *framed, size_t *src_used, size_t *dst_len) {
+    
+    const uint8_t *p = src;
+    const uint8_t *end = src + src_len;
+    size_t n = 0;
+    int status = EXIT_SUCCESS;
+    
+    // U12b characters are the UTF-8 sequences from E4 B8 80 to E5 B7 BF, U12a ones from E5 B8 80 to E9 B7 BF
+    
+#define UB_CJK_UTF8(s, from, to) ((unsigned)((((s)[0] << 8) | (s)[1]) - (from)) <= (to) - (from) && ((s)[1] & 0xC0) == 0x80 && ((s)[2] & 0xC0) == 0x80)
+    
+#ifdef UNIBINARY_X86_KERNELS
+    cjk_kernel_t kernel = cjk_kernel();
+#endif
+    
+    while(1) {
+        
+        wchar_t u0, u1;
+        int k0, k1;
+        
+#ifdef UNIBINARY_X86_KERNELS
+        if(kernel != NULL) p += kernel(p, end, &n);
+#endif
+        
+        // U12a characters and U12b U12b tokens in a row, anything else goes through next_utf8_char()
+        while(end - p >= 6) {
+            if(UB_CJK_UTF8(p, 0xE5B8, 0xE9B7)) {
+                p += 3;
+                n += 2;
+            } else if (UB_CJK_UTF8(p, 0xE4B8, 0xE5B7) && UB_CJK_UTF8(p + 3, 0xE4B8, 0xE5B7)) {
+                p += 6;
+                n += 3;
+            } else {
+                break;
+            }
+        }
+        
+        int r = next_utf8_char(&p, end, &u0, &k0);
+        
+        if(r == UB_CHAR_NONE) {
+            if(is_last && p != end) status = EXIT_FAILURE;
+            break;
+        }
+        
+        if(r == UB_CHAR_INVALID) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        const uint8_t *token = p - (u0 < 0x800 ? 2 : 3);
+        
+        if(k0 >= UB_U12A_0_0) {
+            n += 2;
+            continue;
+        }
+        
+        if(k0 == UB_HEADER) {
+            if(!header_ok(u0)) {
+                fprintf(stderr, "-- unsupported UniBinary features 0x%02x\n", (unsigned int)(u0 & 0xFF));
+                p = token;
+                status = EXIT_FAILURE;
+                break;
+            }
+            if(framed != NULL && (u0 & UNIBINARY_FEATURE_CHECKSUM)) *framed = 1;
+            continue;
+        }
+        
+        if(k0 == UB_LONG_RUN) {
+            uint8_t b;
+            uint32_t crc;
+            uint64_t value;
+            size_t token_n = 0;
+            r = u0 == V2_checksum ? checksum_after(&p, end, &crc) : (is_index(u0) ? index_after(&p, end, u0, &value) : long_run_after(&p, end, u0, &b, &token_n));
+            
+            if(r != UB_CHAR_OK) {
+                if(r == UB_CHAR_INVALID || is_last) status = EXIT_FAILURE;
+                p = token;
+                break;
+            }
+            
+            if(framed != NULL && u0 == V2_checksum) *framed = 1;
+            n += token_n;
+            continue;
+        }
+        
+        r = next_utf8_char(&p, end, &u1, &k1);
+        
+        if(r == UB_CHAR_NONE && !is_last) {
+            p = token;
+            break;
+        }
+        
+        if(k0 == UB_U8 && ((r == UB_CHAR_NONE && p == end) || ends_stream(r, u1, k1))) {
+            if(r == UB_CHAR_OK) p -= 3;
+            n += 1;
+            continue;
+        }
+        
+        // same offsets as decode_tokens(), an invalid second character or the start of the token
+        size_t token_n;
+        if(r != UB_CHAR_OK || token_length(u1, k0, k1, &token_n) != 0) {
+            if(r != UB_CHAR_INVALID) p = token;
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        n += token_n;
+    }
+    
+#undef UB_CJK_UTF8
+    
+    *src_used = p - src;
+    *dst_len = n;
+    
+    return status;
+}
+
+// first position in [from, limit) where the serial parse has a token boundary, or limit
+// the character there is U12a or U8, or follows U12a or a header, and does not follow U8 or a long run marker
+static size_t next_safe_split(const uint8_t *src, size_t src_len, size_t from, size_t limit) {
+    
+    const uint8_t *end = src + src_len;
+    const uint8_t *p = src + from;
+    
+    // first character start, UTF-8 lead bytes
+    while(p < end && *p < 0xC0) p++;
+    
+    wchar_t u;
+    int previous, class;
+    if(next_utf8_char(&p, end, &u, &previous) != UB_CHAR_OK) return limit;
+    
+    while(1) {
+        if(next_utf8_char(&p, end, &u, &class) != UB_CHAR_OK) return limit;
+        
+        size_t position = p - (u < 0x800 ? 2 : 3) - src;
+        if(position >= limit) return limit;
+        
+        if(previous != UB_U8 && previous != UB_LONG_RUN && (class != UB_U12B || previous >= UB_U12A_0_0 || previous == UB_HEADER)) return position;
+        
+        previous = class;
+    }
+}
+
+static int pwrite_all(int fd, const uint8_t *s, size_t n, off_t offset) {
+    
+    while(n > 0) {
+        ssize_t written = pwrite(fd, s, n, offset);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return EXIT_FAILURE;
+        }
+        s += written;
+        n -= written;
+        offset += written;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+typedef struct {
+    const uint8_t *src;
+    size_t src_len;
+    int is_last;
+    int status;
+    int framed;   // see decoded_length_of()
+    size_t src_used;
+    size_t dst_len;
+    uint8_t *dst; // decoded bytes in order, or NULL to write them into fd at offset
+    int fd;
+    off_t offset;
+    int summing;  // inside a stream with a checksum, crc is then the CRC32C of the decoded bytes
+    uint32_t crc;
+    uint8_t *out; // UNIBINARY_DECODED_CHUNK_SIZE bytes between the decoder and pwrite(), allocated by the calling thread
+} decode_job_t;
+
+static void *count_job(void *arg) {
+    
+    decode_job_t *job = arg;
+    job->framed = 0;
+    job->status = decoded_length_of(job->src, job->src_len, job->is_last, &job->framed, &job->src_used, &job->dst_len);
+    
+    return NULL;
+}
+
+static void *decode_job(void *arg) {
+    
+    decode_job_t *job = arg;
+    size_t used, len;
+    
+    job->crc = 0;
+    
+    if(job->dst != NULL) {
+        job->status = unibinary_decode_buffer(job->src, job->src_used, job->is_last, job->dst, job->dst_len, &used, &len);
+        if(job->summing) job->crc = crc32c(0, job->dst, len);
+        return NULL;
+    }
+    
+    uint8_t *out = job->out;
+    size_t start = 0;
+    off_t offset = job->offset;
+    job->status = EXIT_SUCCESS;
+    
+    while(start < job->src_used && job->status == EXIT_SUCCESS) {
+        job->status = unibinary_decode_buffer(job->src + start, job->src_used - start, job->is_last, out, UNIBINARY_DECODED_CHUNK_SIZE, &used, &len);
+        if(job->summing) job->crc = crc32c(job->crc, out, len);
+        if(pwrite_all(job->fd, out, len, offset) != 0) job->status = EXIT_FAILURE;
+        
+        start += used;
+        offset += len;
+    }
+    
+    return NULL;
+}
+
+// decodes batches of one chunk per thread, split where the serial parse has a token boundary
+// pieces are counted first, then written in place with pwrite() into regular files, or in order otherwise
+static int decode_parallel(FILE *src, FILE *dst, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    unsigned int threads = threads_of(options);
+    size_t batch_size = threads * UNIBINARY_PARALLEL_CHUNK_SIZE;
+    
+    // run length encoded batches which decode into more than this are decoded serially into dst
+    size_t ordered_capacity = 16 * batch_size;
+    
+    size_t in_capacity = batch_size + UNIBINARY_MAX_TOKEN_LENGTH;
+    
+    uint8_t *in = allocate(allocator, in_capacity);
+    uint8_t *out = allocate(allocator, UNIBINARY_DECODED_CHUNK_SIZE);
+    decode_job_t *jobs = allocate(allocator, threads * sizeof(decode_job_t));
+    size_t *splits = allocate(allocator, (threads + 1) * sizeof(size_t));
+    if(jobs != NULL) memset(jobs, 0, threads * sizeof(decode_job_t));
+    
+    int status = EXIT_SUCCESS;
+    
+    if(in == NULL || out == NULL || jobs == NULL || splits == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        status = EXIT_FAILURE;
+        goto cleanup;
+    }
+    
+    // pwrite() ignores the offset on files opened for appending
+    int fd = fileno(dst);
+    struct stat st;
+    int in_place = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && !(fcntl(fd, F_GETFL) & O_APPEND);
+    
+    size_t carry = 0;
+    size_t offset = 0; // of in[0] in src
+    checksum_t checksum = {0};
+    unibinary_stats_t *stats = stats_of(options);
+    
+    while(status == EXIT_SUCCESS) {
+        
+        uint64_t since = stats_clock(stats);
+        size_t read = fread(in + carry, 1, batch_size, src);
+        stats_read(stats, read, since);
+        if(ferror(src)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        int is_last = read < batch_size;
+        size_t in_len = carry + read;
+        
+        size_t chunk_len = in_len / threads;
+        splits[0] = 0;
+        splits[threads] = in_len;
+        for(unsigned int k = 1; k < threads; k++) {
+            if(chunk_len < UNIBINARY_RESYNC_WINDOW) {
+                splits[k] = in_len;
+                continue;
+            }
+            
+            size_t from = k * chunk_len > splits[k-1] ? k * chunk_len : splits[k-1];
+            size_t limit = k + 1 < threads ? (k + 1) * chunk_len : in_len;
+            splits[k] = next_safe_split(in, in_len, from, limit);
+        }
+        
+        for(unsigned int k = 0; k < threads; k++) {
+            decode_job_t *job = &jobs[k];
+            job->src = in + splits[k];
+            job->src_len = splits[k+1] - splits[k];
+            job->is_last = k == threads - 1 ? is_last : 1;
+        }
+        
+        since = stats_clock(stats);
+        run_jobs(count_job, jobs, sizeof(decode_job_t), threads, allocator);
+        stats_codec(stats, since);
+        
+        size_t total = 0;
+        int counted = 1;
+        int framed = 0;
+        for(unsigned int k = 0; k < threads; k++) {
+            counted = counted && jobs[k].status == EXIT_SUCCESS;
+            framed = framed || jobs[k].framed;
+            total += jobs[k].dst_len;
+            
+            // each piece of a stream with a checksum is summed from 0, then combined in order
+            jobs[k].summing = checksum.active;
+        }
+        
+        size_t start = splits[threads - 1] + jobs[threads - 1].src_used;
+        
+        int serial = !counted || framed || (!in_place && total > ordered_capacity);
+        
+        if(serial) {
+            // reports the offset of an invalid character, headers and trailers open and check checksums in order
+            status = decode_chunk(in, in_len, is_last, out, UNIBINARY_DECODED_CHUNK_SIZE, dst, offset, &checksum, stats, &start);
+        } else if (in_place) {
+            stats_tokens(stats, in, start);
+            
+            fflush(dst);
+            off_t base = ftello(dst);
+            
+            off_t piece_offset = base;
+            for(unsigned int k = 0; k < threads && status == EXIT_SUCCESS; k++) {
+                if(jobs[k].out == NULL) jobs[k].out = allocate(allocator, UNIBINARY_DECODED_CHUNK_SIZE);
+                if(jobs[k].out == NULL) {
+                    fprintf(stderr, "-- malloc error\n");
+                    status = EXIT_FAILURE;
+                }
+                jobs[k].dst = NULL;
+                jobs[k].fd = fd;
+                jobs[k].offset = piece_offset;
+                piece_offset += jobs[k].dst_len;
+            }
+            
+            if(status != EXIT_SUCCESS) break;
+            
+            // the threads write their pieces as they decode them
+            since = stats_clock(stats);
+            run_jobs(decode_job, jobs, sizeof(decode_job_t), threads, allocator);
+            stats_write(stats, total, since);
+            
+            if(base < 0 || fseeko(dst, base + total, SEEK_SET) != 0) status = EXIT_FAILURE;
+        } else {
+            uint8_t *ordered = allocate(allocator, total + 1);
+            if(ordered == NULL) {
+                fprintf(stderr, "-- malloc error\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+            
+            uint8_t *piece = ordered;
+            for(unsigned int k = 0; k < threads; k++) {
+                jobs[k].dst = piece;
+                piece += jobs[k].dst_len;
+            }
+            
+            stats_tokens(stats, in, start);
+            
+            since = stats_clock(stats);
+            run_jobs(decode_job, jobs, sizeof(decode_job_t), threads, allocator);
+            stats_codec(stats, since);
+            
+            since = stats_clock(stats);
+            if(fwrite(ordered, 1, total, dst) != total) status = EXIT_FAILURE;
+            stats_write(stats, total, since);
+            release(allocator, ordered);
+        }
+        
+        for(unsigned int k = 0; k < threads && !serial; k++) {
+            if(jobs[k].status != EXIT_SUCCESS) status = EXIT_FAILURE;
+            if(jobs[k].summing) checksum.crc = crc32c_combine(checksum.crc, jobs[k].crc, jobs[k].dst_len);
+        }
+        
+        if(is_last) {
+            if(status == EXIT_SUCCESS) status = checksum_end(&checksum);
+            break;
+        }
+        
+        carry = 0;
+        for(size_t i = start; i < in_len; i++) {
+            if(in[i] != '\n') {
+                in[carry++] = in[i];
+            }
+        }
+        
+        // the dropped newlines count in the offsets of the next chunk
+        offset += in_len - carry;
+        if(stats != NULL) stats->newlines += in_len - start - carry;
+    }
+    
+cleanup:
+    for(unsigned int k = 0; jobs != NULL && k < threads; k++) {
+        release(allocator, jobs[k].out);
+    }
+    release(allocator, in);
+    release(allocator, out);
+    release(allocator, jobs);
+    release(allocator, splits);
+    
+    return status;
+}
+
+int unibinary_decode_with_options(FILE *src, FILE *dst, const unibinary_options_t *options) {
+    
+    if(options->threads > 1) {
+        return decode_parallel(src, dst, options);
+    }
+    
+    return decode_file(src, dst, options);
+}
+
+static int write_all(int fd, const uint8_t *s, size_t n) {
+    
+    while(n > 0) {
+        ssize_t written = write(fd, s, n);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return EXIT_FAILURE;
+        }
+        s += written;
+        n -= written;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+// options->sparse applies to regular files only, pipes and terminals need the zeros
+static int sparse_output(int fd, const unibinary_options_t *options) {
+    
+    struct stat st;
+    return options->sparse && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// moves the position of fd past n zeros, a hole past the end of the file, a punched one over existing data
+static int skip_zeros(int fd, size_t n) {
+    
+    static const uint8_t zeros[4096];
+    
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    struct stat st;
+    if(pos < 0 || fstat(fd, &st) != 0) return EXIT_FAILURE;
+    
+    if(pos < st.st_size) {
+        size_t len = (size_t)(st.st_size - pos) < n ? (size_t)(st.st_size - pos) : n;
+        int punched = 0;
+#ifdef FALLOC_FL_PUNCH_HOLE
+        punched = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len) == 0;
+#endif
+        for(size_t i = 0; !punched && i < len; i += sizeof(zeros)) {
+            if(write_all(fd, zeros, len - i < sizeof(zeros) ? len - i : sizeof(zeros)) != 0) return EXIT_FAILURE;
+        }
+    }
+    
+    return lseek(fd, pos + n, SEEK_SET) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// a hole at the end of the output is in the file size only once it is truncated to the position
+static int end_holes(int fd) {
+    
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    struct stat st;
+    if(pos < 0 || fstat(fd, &st) != 0) return EXIT_FAILURE;
+    
+    if(st.st_size < pos && ftruncate(fd, pos) != 0) return EXIT_FAILURE;
+    
+    return EXIT_SUCCESS;
+}
+
+// maps the file at path for reading once, returns NULL with *len set if it is empty, MAP_FAILED if it cannot be mapped
+static const uint8_t *map_path(const char *path, size_t *len) {
+    
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return MAP_FAILED;
+    
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return MAP_FAILED;
+    }
+    
+    *len = st.st_size;
+    if(*len == 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    const uint8_t *map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    
+    if(map != MAP_FAILED) {
+        madvise((void *)map, *len, MADV_SEQUENTIAL);
+    }
+    
+    return map;
+}
+
+// streams fd_in through the FILE * codec, for threads
+static int codec_with_fds(int fd_in, int fd_out, const unibinary_options_t *options, int (*codec)(FILE *, FILE *, const unibinary_options_t *)) {
+    
+    int fd_a = dup(fd_in);
+    int fd_b = dup(fd_out);
+    FILE *fp_in = fd_a < 0 ? NULL : fdopen(fd_a, "rb");
+    FILE *fp_out = fd_b < 0 ? NULL : fdopen(fd_b, "wb");
+    if(fp_in == NULL || fp_out == NULL) {
+        if(fp_in != NULL) fclose(fp_in); else if(fd_a >= 0) close(fd_a);
+        if(fp_out != NULL) fclose(fp_out); else if(fd_b >= 0) close(fd_b);
+        return EXIT_FAILURE;
+    }
+    
+    int status = codec(fp_in, fp_out, options);
+    
+    if(fclose(fp_out) != 0) status = EXIT_FAILURE;
+    fclose(fp_in);
+    
+    return status;
+}
+
+// streams path through the FILE * codec, for inputs which cannot be mapped and for threads
+static int codec_with_files(const char *path, int fd_out, const unibinary_options_t *options, int (*codec)(FILE *, FILE *, const unibinary_options_t *)) {
+    
+    int fd_in = open(path, O_RDONLY);
+    if(fd_in < 0) return EXIT_FAILURE;
+    
+    int status = codec_with_fds(fd_in, fd_out, options, codec);
+    
+    close(fd_in);
+    
+    return status;
+}
+
+int unibinary_encode_path(const char *path, int fd_out, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    size_t src_len = 0;
+    const uint8_t *src = encodes_in_parallel(options) ? MAP_FAILED : map_path(path, &src_len);
+    
+    if(src == MAP_FAILED) {
+        return codec_with_files(path, fd_out, options, unibinary_encode_with_options);
+    }
+    
+    // chunks are longer than what an encoder carries over, so each one takes some bytes
+    size_t chunk_size = UNIBINARY_PARALLEL_CHUNK_SIZE + carry_capacity(is_v2(options), options->optimal);
+    size_t out_capacity = unibinary_encoded_length_max(chunk_size, options);
+    uint8_t *out = allocate(allocator, out_capacity);
+    uint8_t *line = options->wrap_length ? allocate(allocator, out_capacity + out_capacity / 2) : NULL;
+    
+    int status = EXIT_SUCCESS;
+    
+    if(out == NULL || (options->wrap_length && line == NULL)) {
+        fprintf(stderr, "-- malloc error\n");
+        status = EXIT_FAILURE;
+    }
+    
+    block_index_t index;
+    if(index_init(&index, options) != EXIT_SUCCESS) status = EXIT_FAILURE;
+    scratch_t scratch = { .allocator = allocator };
+    
+    size_t pos = 0;
+    size_t count = 0;
+    uint32_t crc = 0;
+    
+    unibinary_stats_t *stats = stats_of(options);
+    if(stats != NULL) stats->bytes_read += src_len;
+    
+    // the header goes in front of the first chunk, and the first chunk of an empty file, the trailer after the last one
+    size_t header_len = status == EXIT_SUCCESS ? put_header(out, options) - out : 0;
+    
+    while(status == EXIT_SUCCESS && (pos < src_len || header_len > 0)) {
+        
+        size_t left = src_len - pos;
+        size_t len = left < chunk_size ? left : chunk_size;
+        
+        size_t used = 0, out_len = 0;
+        uint64_t since = stats_clock(stats);
+        if(len > 0 && encode_blocks(options, &scratch, &index, src + pos, len, len == left, out + header_len, &used, &out_len, &crc) != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        stats_codec(stats, since);
+        out_len += header_len;
+        if(len == left) out_len = put_trailer(out + out_len, options, crc) - out;
+        header_len = 0;
+        pos += used;
+        
+        stats_encoded(stats, out, out_len, count, options->wrap_length);
+        
+        since = stats_clock(stats);
+        if(options->wrap_length) {
+            out_len = wrap_utf8(out, out_len, line, &count, options->wrap_length);
+        }
+        
+        if(write_all(fd_out, options->wrap_length ? line : out, out_len) != 0) status = EXIT_FAILURE;
+        stats_write(stats, out_len, since);
+    }
+    
+    if(status == EXIT_SUCCESS && index.block_size) {
+        size_t index_len;
+        uint8_t *text = index_text(&index, count, &index_len);
+        uint64_t since = stats_clock(stats);
+        if(text == NULL || write_all(fd_out, text, index_len) != 0) status = EXIT_FAILURE;
+        stats_write(stats, index_len, since);
+        release(allocator, text);
+    }
+    
+    if(src != NULL) munmap((void *)src, src_len);
+    scratch_release(&scratch);
+    release(allocator, out);
+    release(allocator, line);
+    index_end(&index);
+    
+    return status;
+}
+
+int unibinary_decode_path(const char *path, int fd_out, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    // zeros cost about as much as their tokens, holes are left on the calling thread
+    int sparse = sparse_output(fd_out, options);
+    
+    size_t src_len = 0;
+    const uint8_t *src = options->threads > 1 && !sparse ? MAP_FAILED : map_path(path, &src_len);
+    
+    if(src == MAP_FAILED) {
+        return codec_with_files(path, fd_out, options, unibinary_decode_with_options);
+    }
+    
+    uint8_t *out = allocate(allocator, UNIBINARY_PARALLEL_CHUNK_SIZE);
+    
+    int status = EXIT_SUCCESS;
+    
+    if(out == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        status = EXIT_FAILURE;
+    }
+    
+    size_t pos = 0;
+    checksum_t checksum = {0};
+    
+    unibinary_stats_t *stats = stats_of(options);
+    if(stats != NULL) stats->bytes_read += src_len;
+    
+    while(status == EXIT_SUCCESS && pos < src_len) {
+        
+        if(sparse) {
+            const uint8_t *after;
+            size_t zeros = runs_at(src + pos, src + src_len, 0, SIZE_MAX, &after);
+            
+            if(zeros >= UNIBINARY_HOLE_LENGTH) {
+                stats_tokens(stats, src + pos, after - (src + pos));
+                if(checksum.active) checksum.crc = crc32c_run(checksum.crc, 0, zeros);
+                status = skip_zeros(fd_out, zeros);
+                pos = after - src;
+                continue;
+            }
+        }
+        
+        size_t used, out_len;
+        uint64_t since = stats_clock(stats);
+        status = decode_tokens(src + pos, src_len - pos, 1, out, UNIBINARY_PARALLEL_CHUNK_SIZE, sparse ? UNIBINARY_HOLE_LENGTH : 0, &checksum, &used, &out_len);
+        stats_codec(stats, since);
+        stats_tokens(stats, src + pos, used);
+        pos += used;
+        
+        since = stats_clock(stats);
+        int written = write_all(fd_out, out, out_len);
+        stats_write(stats, out_len, since);
+        
+        if(written != 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        if(status != EXIT_SUCCESS) {
+            fprintf(stderr, "-- cannot decode character at offset %zu\n", pos);
+            break;
+        }
+        
+        if(used == 0 && out_len == 0) break;
+    }
+    
+    if(status == EXIT_SUCCESS) status = checksum_end(&checksum);
+    if(sparse && end_holes(fd_out) != 0) status = EXIT_FAILURE;
+    
+    if(src != NULL) munmap((void *)src, src_len);
+    release(allocator, out);
+    
+    return status;
+}
+
+// a read or a write of a whole buffer, resubmitted after short transfers
+// reads stop early only at the end of the input
+typedef struct {
+    int fd;
+    int is_write;
+    unsigned int buf_index; // in the buffers given to io_backend_init()
+    uint8_t *buf;
+    size_t len;
+    size_t done;
+    int in_flight;
+    int error;
+    pthread_t thread;
+} io_op_t;
+
+// io_uring with registered buffers when the kernel allows it, else a thread per operation
+typedef struct {
+    int ring_fd; // -1 for threads
+#ifdef UNIBINARY_IO_URING
+    int fixed;   // buffers are registered
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+} io_backend_t;
+
+static void io_backend_end(io_backend_t *io) {
+    
+#ifdef UNIBINARY_IO_URING
+    if(io->sqes != NULL && io->sqes != MAP_FAILED) munmap(io->sqes, io->sqes_len);
+    if(io->cq_map != NULL && io->cq_map != MAP_FAILED && io->cq_map != io->sq_map) munmap(io->cq_map, io->cq_map_len);
+    if(io->sq_map != NULL && io->sq_map != MAP_FAILED) munmap(io->sq_map, io->sq_map_len);
+    if(io->ring_fd >= 0) close(io->ring_fd);
+#endif
+    
+    io->ring_fd = -1;
+}
+
+static void io_backend_init(io_backend_t *io, uint8_t **buffers, const size_t *lengths, unsigned int count) {
+    
+    memset(io, 0, sizeof(io_backend_t));
+    io->ring_fd = -1;
+    
+#ifdef UNIBINARY_IO_URING
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    
+    int fd = syscall(__NR_io_uring_setup, 8, &params);
+    if(fd < 0) return;
+    
+    io->ring_fd = fd;
+    
+    // offset -1 reads and writes at the file position, for pipes and files alike
+    if(!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        io_backend_end(io);
+        return;
+    }
+    
+    io->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    int single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_map && io->cq_map_len > io->sq_map_len) io->sq_map_len = io->cq_map_len;
+    
+    io->sq_map = mmap(NULL, io->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    io->cq_map = single_map ? io->sq_map : mmap(NULL, io->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    io->sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(io->sq_map == MAP_FAILED || io->cq_map == MAP_FAILED || io->sqes == MAP_FAILED) {
+        io_backend_end(io);
+        return;
+    }
+    
+    io->sq_tail = (unsigned *)((uint8_t *)io->sq_map + params.sq_off.tail);
+    io->sq_mask = (unsigned *)((uint8_t *)io->sq_map + params.sq_off.ring_mask);
+    io->sq_array = (unsigned *)((uint8_t *)io->sq_map + params.sq_off.array);
+    io->cq_head = (unsigned *)((uint8_t *)io->cq_map + params.cq_off.head);
+    io->cq_tail = (unsigned *)((uint8_t *)io->cq_map + params.cq_off.tail);
+    io->cq_mask = (unsigned *)((uint8_t *)io->cq_map + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)((uint8_t *)io->cq_map + params.cq_off.cqes);
+    
+    // registered buffers are pinned once instead of at each operation, plain reads and writes if the memlock limit is too low
+    struct iovec iovecs[8];
+    for(unsigned int i = 0; i < count && i < 8; i++) {
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = lengths[i];
+    }
+    io->fixed = count <= 8 && syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs, count) == 0;
+#endif
+}
+
+#ifdef UNIBINARY_IO_URING
+static void io_uring_push(io_backend_t *io, io_op_t *op) {
+    
+    size_t left = op->len - op->done;
+    
+    // only this thread moves the tail
+    unsigned tail = *io->sq_tail;
+    unsigned index = tail & *io->sq_mask;
+    
+    struct io_uring_sqe *sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    
+    if(io->fixed) {
+        sqe->opcode = op->is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = op->buf_index;
+    } else {
+        sqe->opcode = op->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = op->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uintptr_t)(op->buf + op->done);
+    sqe->len = left < (1u << 30) ? left : (1u << 30);
+    sqe->user_data = (uintptr_t)op;
+    
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    
+    while(syscall(__NR_io_uring_enter, io->ring_fd, 1, 0, 0, NULL, 0) < 0) {
+        if(errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+        
+        // not consumed by the kernel, taken back
+        __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+        op->error = 1;
+        op->in_flight = 0;
+        break;
+    }
+}
+#endif
+
+static void *io_thread(void *arg) {
+    
+    io_op_t *op = arg;
+    
+    while(op->done < op->len) {
+        ssize_t n = op->is_write ? write(op->fd, op->buf + op->done, op->len - op->done) : read(op->fd, op->buf + op->done, op->len - op->done);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            op->error = 1;
+            break;
+        }
+        if(n == 0) {
+            if(op->is_write) op->error = 1;
+            break;
+        }
+        op->done += n;
+    }
+    
+    return NULL;
+}
+
+static void io_submit(io_backend_t *io, io_op_t *op, int fd, int is_write, unsigned int buf_index, uint8_t *buf, size_t len) {
+    
+    op->fd = fd;
+    op->is_write = is_write;
+    op->buf_index = buf_index;
+    op->buf = buf;
+    op->len = len;
+    op->done = 0;
+    op->error = 0;
+    op->in_flight = 1;
+    
+#ifdef UNIBINARY_IO_URING
+    if(io->ring_fd >= 0) {
+        io_uring_push(io, op);
+        return;
+    }
+#endif
+    
+    // on the calling thread if none can be started
+    if(pthread_create(&op->thread, NULL, io_thread, op) != 0) {
+        io_thread(op);
+        op->in_flight = 0;
+    }
+}
+
+// waits for op, and with io_uring handles the completions of the other operations on the way
+static int io_wait(io_backend_t *io, io_op_t *op) {
+    
+    while(op->in_flight) {
+        
+        if(io->ring_fd < 0) {
+            pthread_join(op->thread, NULL);
+            op->in_flight = 0;
+            break;
+        }
+        
+#ifdef UNIBINARY_IO_URING
+        unsigned head = *io->cq_head;
+        if(head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+            syscall(__NR_io_uring_enter, io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+        io_op_t *completed = (io_op_t *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+        
+        if(res == -EINTR || res == -EAGAIN) {
+            io_uring_push(io, completed);
+        } else if (res < 0 || (res == 0 && completed->is_write)) {
+            completed->error = 1;
+            completed->in_flight = 0;
+        } else {
+            completed->done += res;
+            if(res > 0 && completed->done < completed->len) {
+                io_uring_push(io, completed);
+            } else {
+                completed->in_flight = 0;
+            }
+        }
+#endif
+    }
+    
+    return op->error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int unibinary_encode_fd(int fd_in, int fd_out, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    int v2 = is_v2(options);
+    
+    if(encodes_in_parallel(options)) {
+        return codec_with_fds(fd_in, fd_out, options, unibinary_encode_with_options);
+    }
+    
+    size_t wrap_length = options->wrap_length;
+    
+    // the bytes carried over from the previous chunk go in front of the next one
+    size_t head = carry_capacity(v2, options->optimal);
+    size_t in_capacity = head + UNIBINARY_PIPELINE_CHUNK_SIZE;
+    size_t out_capacity = unibinary_encoded_length_max(in_capacity, options);
+    
+    // two buffers for reads, two for writes, and the characters before wrapping
+    uint8_t *buffers[4] = { allocate(allocator, in_capacity), allocate(allocator, in_capacity), allocate(allocator, out_capacity), allocate(allocator, out_capacity) };
+    size_t lengths[4] = { in_capacity, in_capacity, out_capacity, out_capacity };
+    uint8_t *encoded = wrap_length ? allocate(allocator, out_capacity) : NULL;
+    
+    block_index_t index;
+    if(index_init(&index, options) != EXIT_SUCCESS) {
+        for(int i = 0; i < 4; i++) release(allocator, buffers[i]);
+        release(allocator, encoded);
+        return EXIT_FAILURE;
+    }
+    scratch_t scratch = { .allocator = allocator };
+    
+    if(buffers[0] == NULL || buffers[1] == NULL || buffers[2] == NULL || buffers[3] == NULL || (wrap_length && encoded == NULL)) {
+        fprintf(stderr, "-- malloc error\n");
+        for(int i = 0; i < 4; i++) release(allocator, buffers[i]);
+        release(allocator, encoded);
+        return EXIT_FAILURE;
+    }
+    
+    io_backend_t io;
+    io_backend_init(&io, buffers, lengths, 4);
+    
+    io_op_t reads[2];
+    io_op_t writes[2];
+    memset(reads, 0, sizeof(reads));
+    memset(writes, 0, sizeof(writes));
+    
+    int status = EXIT_SUCCESS;
+    size_t carry = 0;
+    size_t count = 0;
+    uint32_t crc = 0;
+    unibinary_stats_t *stats = stats_of(options);
+    
+    io_submit(&io, &reads[0], fd_in, 0, 0, buffers[0] + head, UNIBINARY_PIPELINE_CHUNK_SIZE);
+    
+    for(size_t k = 0; ; k++) {
+        
+        io_op_t *read = &reads[k & 1];
+        uint64_t since = stats_clock(stats);
+        int read_status = io_wait(&io, read);
+        stats_read(stats, read->done, since);
+        if(read_status != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        int is_last = read->done < UNIBINARY_PIPELINE_CHUNK_SIZE;
+        size_t next = (k + 1) & 1;
+        
+        // chunk k + 1 is read while chunk k is encoded and chunk k - 1 written
+        if(!is_last) {
+            io_submit(&io, &reads[next], fd_in, 0, next, buffers[next] + head, UNIBINARY_PIPELINE_CHUNK_SIZE);
+        }
+        
+        uint8_t *chunk = read->buf - carry;
+        size_t chunk_len = carry + read->done;
+        uint8_t *out = buffers[2 + (k & 1)];
+        
+        uint8_t *o = wrap_length ? encoded : out;
+        size_t header_len = k == 0 ? put_header(o, options) - o : 0;
+        
+        size_t used, out_len;
+        since = stats_clock(stats);
+        if(encode_blocks(options, &scratch, &index, chunk, chunk_len, is_last, o + header_len, &used, &out_len, &crc) != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        stats_codec(stats, since);
+        out_len += header_len;
+        if(is_last) out_len = put_trailer(o + out_len, options, crc) - o;
+        
+        stats_encoded(stats, o, out_len, count, wrap_length);
+        
+        since = stats_clock(stats);
+        if(wrap_length) {
+            out_len = wrap_utf8(encoded, out_len, out, &count, wrap_length);
+        }
+        
+        // writes are in order, one at a time
+        int write_status = io_wait(&io, &writes[next]);
+        stats_write(stats, out_len, since);
+        if(write_status != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        if(out_len > 0) {
+            io_submit(&io, &writes[k & 1], fd_out, 1, 2 + (k & 1), out, out_len);
+        }
+        
+        if(is_last) break;
+        
+        carry = chunk_len - used;
+        memcpy(buffers[next] + head - carry, chunk + used, carry);
+    }
+    
+    // nothing is freed under the kernel or a thread
+    uint64_t since = stats_clock(stats);
+    for(int i = 0; i < 2; i++) {
+        io_wait(&io, &reads[i]);
+        if(io_wait(&io, &writes[i]) != EXIT_SUCCESS) status = EXIT_FAILURE;
+    }
+    stats_write(stats, 0, since);
+    
+    // after all the chunks
+    if(status == EXIT_SUCCESS && index.block_size) {
+        size_t index_len;
+        uint8_t *text = index_text(&index, count, &index_len);
+        since = stats_clock(stats);
+        if(text == NULL || write_all(fd_out, text, index_len) != 0) status = EXIT_FAILURE;
+        stats_write(stats, index_len, since);
+        release(allocator, text);
+    }
+    
+    io_backend_end(&io);
+    scratch_release(&scratch);
+    for(int i = 0; i < 4; i++) release(allocator, buffers[i]);
+    release(allocator, encoded);
+    index_end(&index);
+    
+    return status;
+}
+
+int unibinary_decode_fd(int fd_in, int fd_out, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    int sparse = sparse_output(fd_out, options);
+    
+    if(options->threads > 1 && !sparse) {
+        return codec_with_fds(fd_in, fd_out, options, unibinary_decode_with_options);
+    }
+    
+    // the carried over bytes are an incomplete token at most, as in unibinary_decode()
+    size_t head = UNIBINARY_MAX_TOKEN_LENGTH;
+    size_t in_capacity = head + UNIBINARY_PIPELINE_CHUNK_SIZE;
+    size_t out_capacity = UNIBINARY_PIPELINE_CHUNK_SIZE;
+    
+    uint8_t *buffers[4] = { allocate(allocator, in_capacity), allocate(allocator, in_capacity), allocate(allocator, out_capacity), allocate(allocator, out_capacity) };
+    size_t lengths[4] = { in_capacity, in_capacity, out_capacity, out_capacity };
+    
+    if(buffers[0] == NULL || buffers[1] == NULL || buffers[2] == NULL || buffers[3] == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        for(int i = 0; i < 4; i++) release(allocator, buffers[i]);
+        return EXIT_FAILURE;
+    }
+    
+    io_backend_t io;
+    io_backend_init(&io, buffers, lengths, 4);
+    
+    io_op_t reads[2];
+    io_op_t writes[2];
+    memset(reads, 0, sizeof(reads));
+    memset(writes, 0, sizeof(writes));
+    
+    int status = EXIT_SUCCESS;
+    size_t carry = 0;
+    size_t offset = 0; // of the chunk in the input
+    size_t w = 0;      // writes submitted
+    checksum_t checksum = {0};
+    unibinary_stats_t *stats = stats_of(options);
+    
+    io_submit(&io, &reads[0], fd_in, 0, 0, buffers[0] + head, UNIBINARY_PIPELINE_CHUNK_SIZE);
+    
+    for(size_t k = 0; status == EXIT_SUCCESS; k++) {
+        
+        io_op_t *read = &reads[k & 1];
+        uint64_t since = stats_clock(stats);
+        int read_status = io_wait(&io, read);
+        stats_read(stats, read->done, since);
+        if(read_status != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        int is_last = read->done < UNIBINARY_PIPELINE_CHUNK_SIZE;
+        size_t next = (k + 1) & 1;
+        
+        if(!is_last) {
+            io_submit(&io, &reads[next], fd_in, 0, next, buffers[next] + head, UNIBINARY_PIPELINE_CHUNK_SIZE);
+        }
+        
+        uint8_t *chunk = read->buf - carry;
+        size_t chunk_len = carry + read->done;
+        size_t start = 0;
+        
+        // a chunk can decode into many output buffers, each written while the next one is filled
+        while(start < chunk_len) {
+            
+            if(sparse) {
+                const uint8_t *after;
+                size_t zeros = runs_at(chunk + start, chunk + chunk_len, 0, SIZE_MAX, &after);
+                
+                if(zeros >= UNIBINARY_HOLE_LENGTH) {
+                    stats_tokens(stats, chunk + start, after - (chunk + start));
+                    
+                    // the file position moves once the writes are done
+                    for(int i = 0; i < 2; i++) {
+                        if(io_wait(&io, &writes[i]) != EXIT_SUCCESS) status = EXIT_FAILURE;
+                    }
+                    if(status != EXIT_SUCCESS || skip_zeros(fd_out, zeros) != EXIT_SUCCESS) {
+                        status = EXIT_FAILURE;
+                        break;
+                    }
+                    if(checksum.active) checksum.crc = crc32c_run(checksum.crc, 0, zeros);
+                    start = after - chunk;
+                    continue;
+                }
+            }
+            
+            uint8_t *out = buffers[2 + (w & 1)];
+            
+            size_t used, out_len;
+            since = stats_clock(stats);
+            int decoded = decode_tokens(chunk + start, chunk_len - start, is_last, out, out_capacity, sparse ? UNIBINARY_HOLE_LENGTH : 0, &checksum, &used, &out_len);
+            stats_codec(stats, since);
+            stats_tokens(stats, chunk + start, used);
+            start += used;
+            
+            if(out_len > 0) {
+                since = stats_clock(stats);
+                int write_status = io_wait(&io, &writes[(w + 1) & 1]);
+                stats_write(stats, out_len, since);
+                if(write_status != EXIT_SUCCESS) {
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                io_submit(&io, &writes[w & 1], fd_out, 1, 2 + (w & 1), out, out_len);
+                w++;
+            }
+            
+            if(decoded != EXIT_SUCCESS) {
+                fprintf(stderr, "-- cannot decode character at offset %zu\n", offset + start);
+                status = EXIT_FAILURE;
+                break;
+            }
+            
+            if(used == 0 && out_len == 0) break;
+        }
+        
+        if(status != EXIT_SUCCESS) break;
+        
+        if(is_last) {
+            status = checksum_end(&checksum);
+            break;
+        }
+        
+        // the truncated character goes in front of the next chunk, without its newlines
+        carry = 0;
+        for(size_t i = start; i < chunk_len; i++) {
+            if(chunk[i] != '\n') carry++;
+        }
+        
+        uint8_t *c = buffers[next] + head - carry;
+        for(size_t i = start; i < chunk_len; i++) {
+            if(chunk[i] != '\n') *c++ = chunk[i];
+        }
+        
+        // the dropped newlines count in the offsets of the next chunk
+        offset += chunk_len - carry;
+        if(stats != NULL) stats->newlines += chunk_len - start - carry;
+    }
+    
+    uint64_t since = stats_clock(stats);
+    for(int i = 0; i < 2; i++) {
+        io_wait(&io, &reads[i]);
+        if(io_wait(&io, &writes[i]) != EXIT_SUCCESS) status = EXIT_FAILURE;
+    }
+    stats_write(stats, 0, since);
+    
+    if(sparse && end_holes(fd_out) != 0) status = EXIT_FAILURE;
+    
+    io_backend_end(&io);
+    for(int i = 0; i < 4; i++) release(allocator, buffers[i]);
+    
+    return status;
+}
+
+// characters of the UTF-8 string s, newlines excluded
+static size_t utf8_characters(const uint8_t *s, size_t n) {
+    
+    size_t characters = 0;
+    
+    for(size_t i = 0; i < n; i++) {
+        characters += (s[i] & 0xC0) != 0x80 && s[i] != '\n';
+    }
+    
+    return characters;
+}
+
+enum {
+    UB_TOKEN_RUN = 0,
+    UB_TOKEN_PAIR,
+    UB_TOKEN_TRIPLE,
+    UB_TOKEN_SINGLE,
+    UB_TOKEN_LONG_RUN
+};
+
+// number of tokens of each kind in the encoding of src, without writing it
+static void count_tokens(const uint8_t *src, size_t src_len, int long_runs, size_t counts[5]) {
+    
+    const uint8_t *p = src;
+    const uint8_t *end = src + src_len;
+    
+    memset(counts, 0, 5 * sizeof(size_t));
+    
+#ifdef UNIBINARY_X86_KERNELS
+    byte_masks_t byte_masks = byte_masks_builder();
+    
+    // same decisions as encode_tokens() on the masks of 64 bytes windows
+    while(byte_masks != NULL && end - p >= 65) {
+        
+        uint64_t eq_next, high;
+        byte_masks(p, &eq_next, &high);
+        
+        uint64_t runs = eq_next & (eq_next >> 1);
+        uint64_t stops = runs | high;
+        
+        size_t j = 0;
+        
+        while(j < 62) {
+            if((runs >> j) & 1) {
+                uint64_t ends = ~(eq_next >> j);
+                size_t n = ends ? __builtin_ctzll(ends) + 1 : 65;
+                if(j + n > 64) n = run_token_length(p + j, end, 1, long_runs);
+                counts[n > UNIBINARY_MAX_REPEATS ? UB_TOKEN_LONG_RUN : UB_TOKEN_RUN]++;
+                j += n;
+            } else if (((high >> j) & 3) == 0) {
+                uint64_t next_stops = stops >> j;
+                size_t stretch = next_stops ? __builtin_ctzll(next_stops) : 64 - j;
+                size_t pairs = stretch < 2 ? 1 : stretch / 2;
+                counts[UB_TOKEN_PAIR] += pairs;
+                j += 2 * pairs;
+            } else {
+                counts[UB_TOKEN_TRIPLE]++;
+                j += 3;
+            }
+        }
+        
+        p += j;
+    }
+#endif
+    
+    while(p < end) {
+        size_t c;
+        size_t n = token_at(p, end, 1, long_runs, &c);
+        
+        if(n > UNIBINARY_MAX_REPEATS) {
+            counts[UB_TOKEN_LONG_RUN]++;
+        } else if (n >= 3 && p[1] == p[0] && p[2] == p[0]) {
+            counts[UB_TOKEN_RUN]++;
+        } else if (n == 3) {
+            counts[UB_TOKEN_TRIPLE]++;
+        } else if (n == 2) {
+            counts[UB_TOKEN_PAIR]++;
+        } else {
+            counts[UB_TOKEN_SINGLE]++;
+        }
+        
+        p += n;
+    }
+}
+
+size_t unibinary_encoded_characters(const uint8_t *src, size_t src_len) {
+    
+    size_t counts[5];
+    count_tokens(src, src_len, 0, counts);
+    
+    return 2 * counts[UB_TOKEN_RUN] + counts[UB_TOKEN_PAIR] + 2 * counts[UB_TOKEN_TRIPLE] + counts[UB_TOKEN_SINGLE];
+}
+
+static int encode_bytes_into(const uint8_t *src, size_t src_len, const unibinary_options_t *options, uint8_t *dst, size_t dst_capacity, size_t *dst_len);
+
+size_t unibinary_encoded_length(const uint8_t *src, size_t src_len, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    if(has_index(options)) {
+        // where blocks end is only known once encoded
+        size_t capacity = unibinary_encoded_length_max(src_len, options);
+        uint8_t *encoded = allocate(allocator, capacity);
+        size_t len;
+        if(encoded == NULL || encode_bytes_into(src, src_len, options, encoded, capacity, &len) != EXIT_SUCCESS) {
+            if(encoded == NULL) fprintf(stderr, "-- malloc error\n");
+            release(allocator, encoded);
+            return capacity;
+        }
+        
+        release(allocator, encoded);
+        return len;
+    }
+    
+    if(options != NULL && options->optimal) {
+        // the parse is only known once done
+        uint8_t *encoded = allocate(allocator, UNIBINARY_ENCODED_MAX_UTF8_LENGTH(src_len) + UNIBINARY_TRAILER_LENGTH);
+        if(encoded == NULL) {
+            fprintf(stderr, "-- malloc error\n");
+            return unibinary_encoded_length_max(src_len, options);
+        }
+        
+        size_t header_len = put_header(encoded, options) - encoded;
+        size_t used, len;
+        scratch_t scratch = { .allocator = allocator };
+        encode_tokens_of(options, &scratch, src, src_len, 1, encoded + header_len, &used, &len, NULL);
+        scratch_release(&scratch);
+        len = put_trailer(encoded + header_len + len, options, 0) - encoded;
+        
+        size_t characters = utf8_characters(encoded, len);
+        release(allocator, encoded);
+        
+        return len + (options->wrap_length ? characters / options->wrap_length : 0);
+    }
+    
+    int v2 = is_v2(options);
+    
+    size_t counts[5];
+    count_tokens(src, src_len, v2, counts);
+    
+    size_t len = counts[UB_TOKEN_RUN] * (UB_U8_UTF8_LENGTH + UB_U12_UTF8_LENGTH) + counts[UB_TOKEN_PAIR] * UB_U12_UTF8_LENGTH + counts[UB_TOKEN_TRIPLE] * 2 * UB_U12_UTF8_LENGTH + counts[UB_TOKEN_SINGLE] * UB_U8_UTF8_LENGTH;
+    size_t characters = 2 * counts[UB_TOKEN_RUN] + counts[UB_TOKEN_PAIR] + 2 * counts[UB_TOKEN_TRIPLE] + counts[UB_TOKEN_SINGLE];
+    
+    // the header, and the marker, U8, U12b, U12b of each long run
+    len += v2 * 3 + counts[UB_TOKEN_LONG_RUN] * (3 + UB_U8_UTF8_LENGTH + 2 * UB_U12_UTF8_LENGTH);
+    characters += v2 + 4 * counts[UB_TOKEN_LONG_RUN];
+    
+    // the trailer, a marker and 3 U12b
+    if(has_checksum(options)) {
+        len += 3 + 3 * UB_U12_UTF8_LENGTH;
+        characters += 4;
+    }
+    
+    size_t wrap_length = options ? options->wrap_length : 0;
+    
+    return len + (wrap_length ? characters / wrap_length : 0);
+}
+
+size_t unibinary_encoded_length_max(size_t src_len, const unibinary_options_t *options) {
+    
+    size_t wrap_length = options ? options->wrap_length : 0;
+    
+    if(!has_checksum(options) && !has_index(options)) return UNIBINARY_ENCODED_MAX_UTF8_WRAPPED_LENGTH(src_len, wrap_length);
+    
+    // the 4 characters of the trailer, up to 4 more in each block cut short, and their newlines
+    size_t blocks = has_index(options) ? src_len / options->block_size + 2 : 0;
+    size_t characters = UNIBINARY_ENCODED_MAX_LENGTH(src_len) + (has_checksum(options) ? 4 : 0) + 4 * blocks;
+    size_t len = 3 * characters + (wrap_length ? characters / wrap_length : 0);
+    
+    // the index on its own line
+    return has_index(options) ? len + 1 + UNIBINARY_INDEX_LENGTH(blocks) : len;
+}
+
+int unibinary_decoded_length(const uint8_t *src, size_t src_len, size_t *dst_len) {
+    
+    size_t used;
+    return decoded_length_of(src, src_len, 1, NULL, &used, dst_len);
+}
+
+int unibinary_validate(const uint8_t *src, size_t src_len, size_t *error_offset) {
+    
+    size_t used, len;
+    int status = decoded_length_of(src, src_len, 1, NULL, &used, &len);
+    
+    *error_offset = status == EXIT_SUCCESS ? src_len : used;
+    
+    return status;
+}
+
+int unibinary_validate_fd(int fd_in, size_t *error_offset) {
+    return unibinary_validate_fd_with_options(fd_in, NULL, error_offset);
+}
+
+int unibinary_validate_fd_with_options(int fd_in, const unibinary_options_t *options, size_t *error_offset) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    // the carried over bytes are an incomplete token at most, newlines are dropped
+    size_t in_capacity = UNIBINARY_MAX_TOKEN_LENGTH + UNIBINARY_PIPELINE_CHUNK_SIZE;
+    uint8_t *in = allocate(allocator, in_capacity);
+    if(in == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        return EXIT_FAILURE;
+    }
+    
+    int status = EXIT_SUCCESS;
+    int is_last = 0;
+    size_t carry = 0;
+    size_t carry_offset = 0; // of in[0] in the input, the start of the carried token
+    size_t offset = 0;       // of in[carry] in the input
+    
+    while(status == EXIT_SUCCESS && !is_last) {
+        
+        // full chunks, pipes return less
+        size_t in_len = carry;
+        while(in_len < in_capacity && !is_last) {
+            ssize_t n = read(fd_in, in + in_len, in_capacity - in_len);
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            is_last = n == 0;
+            in_len += n;
+        }
+        
+        size_t used = carry, len;
+        if(status == EXIT_SUCCESS) status = decoded_length_of(in, in_len, is_last, NULL, &used, &len);
+        
+        // errors in the carried bytes are at the start of their token
+        *error_offset = used < carry ? carry_offset : offset + (used - carry);
+        
+        carry_offset = *error_offset;
+        offset += in_len - carry;
+        
+        carry = 0;
+        for(size_t i = used; i < in_len; i++) {
+            if(in[i] != '\n') {
+                in[carry++] = in[i];
+            }
+        }
+    }
+    
+    release(allocator, in);
+    
+    return status;
+}
+
+size_t unibinary_decoded_length_max(size_t src_len) {
+    return UNIBINARY_DECODED_MAX_LENGTH(src_len);
+}
+
+static int encode_bytes_into(const uint8_t *src, size_t src_len, const unibinary_options_t *options, uint8_t *dst, size_t dst_capacity, size_t *dst_len) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    size_t wrap_length = options ? options->wrap_length : 0;
+    
+    *dst_len = 0;
+    
+    int bounded = dst_capacity >= unibinary_encoded_length_max(src_len, options);
+    
+    if(!bounded && dst_capacity < unibinary_encoded_length(src, src_len, options)) {
+        fprintf(stderr, "-- output buffer too small\n");
+        return EXIT_FAILURE;
+    }
+    
+    size_t used;
+    
+    if(is_v2(options) || (options != NULL && options->optimal)) {
+        // long runs and optimal parses are only seen whole in one pass, through a worst case buffer unless dst is one
+        block_index_t index;
+        if(index_init(&index, options) != EXIT_SUCCESS) return EXIT_FAILURE;
+        
+        uint8_t *encoded = wrap_length == 0 && bounded ? dst : allocate(allocator, unibinary_encoded_length_max(src_len, options));
+        if(encoded == NULL) {
+            fprintf(stderr, "-- malloc error\n");
+            return EXIT_FAILURE;
+        }
+        
+        size_t header_len = put_header(encoded, options) - encoded;
+        size_t encoded_len;
+        uint32_t crc = 0;
+        scratch_t scratch = { .allocator = allocator };
+        int status = encode_blocks(options, &scratch, &index, src, src_len, 1, encoded + header_len, &used, &encoded_len, &crc);
+        scratch_release(&scratch);
+        if(status != EXIT_SUCCESS) {
+            if(encoded != dst) release(allocator, encoded);
+            index_end(&index);
+            return EXIT_FAILURE;
+        }
+        encoded_len = put_trailer(encoded + header_len + encoded_len, options, crc) - encoded;
+        
+        size_t count = 0;
+        if(encoded == dst) {
+            *dst_len = encoded_len;
+        } else if(wrap_length) {
+            *dst_len = wrap_utf8(encoded, encoded_len, dst, &count, wrap_length);
+        } else {
+            memcpy(dst, encoded, encoded_len);
+            *dst_len = encoded_len;
+        }
+        
+        if(encoded != dst) release(allocator, encoded);
+        
+        if(index.block_size) *dst_len = put_index(dst + *dst_len, &index, count) - dst;
+        index_end(&index);
+        
+        return EXIT_SUCCESS;
+    }
+    
+    if(wrap_length == 0 && bounded) {
+        unibinary_encode_buffer_utf8(src, src_len, 1, dst, &used, dst_len);
+        return EXIT_SUCCESS;
+    }
+    
+    // small steps through the stack, copied or wrapped into dst
+    uint8_t out[UNIBINARY_ENCODED_MAX_UTF8_LENGTH(4096)];
+    size_t pos = 0;
+    size_t count = 0;
+    uint8_t *o = dst;
+    
+    while(pos < src_len) {
+        size_t left = src_len - pos;
+        size_t len = left < 4096 ? left : 4096;
+        
+        size_t out_len;
+        unibinary_encode_buffer_utf8(src + pos, len, len == left, out, &used, &out_len);
+        pos += used;
+        
+        if(wrap_length) {
+            o += wrap_utf8(out, out_len, o, &count, wrap_length);
+        } else {
+            memcpy(o, out, out_len);
+            o += out_len;
+        }
+    }
+    
+    *dst_len = o - dst;
+    
+    return EXIT_SUCCESS;
+}
+
+int unibinary_encode_bytes_into(const uint8_t *src, size_t src_len, const unibinary_options_t *options, uint8_t *dst, size_t dst_capacity, size_t *dst_len) {
+    
+    unibinary_stats_t *stats = stats_of(options);
+    
+    uint64_t since = stats_clock(stats);
+    int status = encode_bytes_into(src, src_len, options, dst, dst_capacity, dst_len);
+    stats_codec(stats, since);
+    
+    // the wrapped output, newlines included
+    if(status == EXIT_SUCCESS) stats_tokens(stats, dst, *dst_len);
+    if(status == EXIT_SUCCESS && stats != NULL) {
+        stats->bytes_read += src_len;
+        stats->bytes_written += *dst_len;
+    }
+    
+    return status;
+}
+
+int unibinary_encode_bytes(const uint8_t *src, size_t src_len, const unibinary_options_t *options, uint8_t **dst, size_t *dst_len) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    size_t capacity = unibinary_encoded_length_max(src_len, options);
+    
+    *dst = allocate(allocator, capacity + 1);
+    if(*dst == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        return EXIT_FAILURE;
+    }
+    
+    if(unibinary_encode_bytes_into(src, src_len, options, *dst, capacity, dst_len) != EXIT_SUCCESS) {
+        release(allocator, *dst);
+        *dst = NULL;
+        *dst_len = 0;
+        return EXIT_FAILURE;
+    }
+    
+    // exact size, NUL terminated for convenience
+    if(allocator == NULL) {
+        uint8_t *exact = realloc(*dst, *dst_len + 1);
+        if(exact != NULL) *dst = exact;
+    }
+    (*dst)[*dst_len] = '\0';
+    
+    return EXIT_SUCCESS;
+}
+
+int unibinary_decode_bytes_into(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_capacity, size_t *dst_len) {
+    
+    size_t used;
+    checksum_t checksum = {0};
+    int status = decode_tokens(src, src_len, 1, dst, dst_capacity, 0, &checksum, &used, dst_len);
+    
+    if(status != EXIT_SUCCESS) {
+        fprintf(stderr, "-- cannot decode character at offset %zu\n", used);
+        return EXIT_FAILURE;
+    }
+    
+    if(used < src_len) {
+        fprintf(stderr, "-- output buffer too small\n");
+        return EXIT_FAILURE;
+    }
+    
+    return checksum_end(&checksum);
+}
+
+int unibinary_decode_bytes(const uint8_t *src, size_t src_len, uint8_t **dst, size_t *dst_len) {
+    return unibinary_decode_bytes_with_options(src, src_len, NULL, dst, dst_len);
+}
+
+int unibinary_decode_bytes_with_options(const uint8_t *src, size_t src_len, const unibinary_options_t *options, uint8_t **dst, size_t *dst_len) {
+    
+    *dst = NULL;
+    *dst_len = 0;
+    
+    unibinary_stats_t *stats = stats_of(options);
+    uint64_t since = stats_clock(stats);
+    
+    size_t used, length;
+    if(decoded_length_of(src, src_len, 1, NULL, &used, &length) != EXIT_SUCCESS) {
+        fprintf(stderr, "-- cannot decode character at offset %zu\n", used);
+        return EXIT_FAILURE;
+    }
+    
+    // NUL terminated for convenience, decoded data may contain other NULs
+    *dst = allocate(allocator_of(options), length + 1);
+    if(*dst == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        return EXIT_FAILURE;
+    }
+    
+    if(unibinary_decode_bytes_into(src, src_len, *dst, length, dst_len) != EXIT_SUCCESS) {
+        release(allocator_of(options), *dst);
+        *dst = NULL;
+        *dst_len = 0;
+        return EXIT_FAILURE;
+    }
+    (*dst)[*dst_len] = '\0';
+    
+    stats_codec(stats, since);
+    stats_tokens(stats, src, src_len);
+    if(stats != NULL) {
+        stats->bytes_read += src_len;
+        stats->bytes_written += *dst_len;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+// the block index at the end of src, trailing newlines aside, see put_index()
+static int index_at_end(const uint8_t *src, size_t src_len, const uint8_t **blocks, size_t *count, size_t *block_size, uint64_t *length) {
+    
+    while(src_len > 0 && src[src_len - 1] == '\n') src_len--;
+    
+    if(src_len < UNIBINARY_INDEX_LENGTH(0)) return EXIT_FAILURE;
+    
+    const uint8_t *p = src + src_len - UNIBINARY_INDEX_LENGTH(0);
+    wchar_t u;
+    int k;
+    uint64_t end;
+    if(next_utf8_char(&p, src + src_len, &u, &k) != UB_CHAR_OK || u != V2_index) return EXIT_FAILURE;
+    if(index_after(&p, src + src_len, u, &end) != UB_CHAR_OK || p != src + src_len) return EXIT_FAILURE;
+    
+    *block_size = end >> 36;
+    *length = end & (UNIBINARY_INDEX_LIMIT - 1);
+    if(*block_size == 0) return EXIT_FAILURE;
+    
+    *count = *length ? (*length - 1) / *block_size + 1 : 0;
+    if(*count > (src_len - UNIBINARY_INDEX_LENGTH(0)) / 12) return EXIT_FAILURE;
+    
+    *blocks = src + src_len - UNIBINARY_INDEX_LENGTH(*count);
+    
+    return EXIT_SUCCESS;
+}
+
+// offset of block i in the text, which is before the index
+static int block_offset(const uint8_t *src, const uint8_t *blocks, size_t i, size_t *offset) {
+    
+    const uint8_t *p = blocks + 12 * i;
+    wchar_t u;
+    int k;
+    uint64_t value;
+    if(next_utf8_char(&p, p + 3, &u, &k) != UB_CHAR_OK || u != V2_block) return EXIT_FAILURE;
+    if(index_after(&p, p + 9, u, &value) != UB_CHAR_OK || value > (uint64_t)(blocks - src)) return EXIT_FAILURE;
+    
+    *offset = value;
+    
+    return EXIT_SUCCESS;
+}
+
+int unibinary_decode_range(const uint8_t *src, size_t src_len, size_t from, size_t to, uint8_t *dst, size_t dst_capacity, size_t *dst_len) {
+    return unibinary_decode_range_with_options(src, src_len, from, to, NULL, dst, dst_capacity, dst_len);
+}
+
+int unibinary_decode_range_with_options(const uint8_t *src, size_t src_len, size_t from, size_t to, const unibinary_options_t *options, uint8_t *dst, size_t dst_capacity, size_t *dst_len) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    
+    *dst_len = 0;
+    
+    const uint8_t *blocks;
+    size_t count, block_size;
+    uint64_t length;
+    if(index_at_end(src, src_len, &blocks, &count, &block_size, &length) != EXIT_SUCCESS) {
+        fprintf(stderr, "-- no UniBinary block index\n");
+        return EXIT_FAILURE;
+    }
+    
+    if(to > length) to = length;
+    if(from >= to) return EXIT_SUCCESS;
+    
+    if(dst_capacity < to - from) {
+        fprintf(stderr, "-- output buffer too small\n");
+        return EXIT_FAILURE;
+    }
+    
+    // blocks partly in the range go through a copy, the others straight into dst
+    uint8_t *block = NULL;
+    if(from % block_size != 0 || (to % block_size != 0 && to != length)) {
+        block = allocate(allocator, block_size);
+        if(block == NULL) {
+            fprintf(stderr, "-- malloc error\n");
+            return EXIT_FAILURE;
+        }
+    }
+    
+    int status = EXIT_SUCCESS;
+    
+    for(size_t i = from / block_size; i < count && (uint64_t)i * block_size < to; i++) {
+        
+        size_t start = i * block_size;
+        size_t expected = length - start < block_size ? length - start : block_size;
+        int whole = start >= from && start + expected <= to;
+        
+        // the last block ends before the index, the trailer and newlines between are skipped
+        size_t begin, end = blocks - src, used, len;
+        if(block_offset(src, blocks, i, &begin) != EXIT_SUCCESS || (i + 1 < count && block_offset(src, blocks, i + 1, &end) != EXIT_SUCCESS) || begin > end) {
+            fprintf(stderr, "-- corrupted UniBinary block index\n");
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        uint8_t *out = whole ? dst + (start - from) : block;
+        if(decode_tokens(src + begin, end - begin, 1, out, expected, 0, NULL, &used, &len) != EXIT_SUCCESS || used < end - begin || len != expected) {
+            fprintf(stderr, "-- cannot decode block %zu at offset %zu\n", i, begin + used);
+            status = EXIT_FAILURE;
+            break;
+        }
+        
+        if(!whole) {
+            size_t a = from > start ? from - start : 0;
+            size_t b = to < start + len ? to - start : len;
+            memcpy(dst + (start + a - from), block + a, b - a);
+        }
+    }
+    
+    release(allocator, block);
+    
+    if(status == EXIT_SUCCESS) *dst_len = to - from;
+    
+    return status;
+}
+
+size_t unibinary_encode_batch_max(const unibinary_record_t *records, size_t count, const unibinary_options_t *options) {
+    
+    size_t max = 0;
+    
+    for(size_t i = 0; i < count; i++) {
+        max += unibinary_encoded_length_max(records[i].len, options);
+    }
+    
+    return max;
+}
+
+int unibinary_encode_batch(const unibinary_record_t *records, size_t count, const unibinary_options_t *options, uint8_t *arena, size_t arena_capacity, size_t *offsets, size_t max_characters, uint8_t *fits) {
+    
+    size_t offset = 0;
+    offsets[0] = 0;
+    
+    for(size_t i = 0; i < count; i++) {
+        
+        size_t len;
+        if(unibinary_encode_bytes_into(records[i].data, records[i].len, options, arena + offset, arena_capacity - offset, &len) != EXIT_SUCCESS) {
+            fprintf(stderr, "-- cannot encode record %zu\n", i);
+            return EXIT_FAILURE;
+        }
+        
+        if(fits != NULL) {
+            fits[i] = utf8_characters(arena + offset, len) <= max_characters;
+        }
+        
+        offset += len;
+        offsets[i + 1] = offset;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+int unibinary_decode_batch(const unibinary_record_t *records, size_t count, uint8_t *arena, size_t arena_capacity, size_t *offsets) {
+    
+    size_t offset = 0;
+    offsets[0] = 0;
+    
+    for(size_t i = 0; i < count; i++) {
+        
+        size_t used, len;
+        checksum_t checksum = {0};
+        if(decode_tokens(records[i].data, records[i].len, 1, arena + offset, arena_capacity - offset, 0, &checksum, &used, &len) != EXIT_SUCCESS) {
+            fprintf(stderr, "-- cannot decode character at offset %zu of record %zu\n", used, i);
+            return EXIT_FAILURE;
+        }
+        
+        if(used < records[i].len) {
+            fprintf(stderr, "-- output buffer too small for record %zu\n", i);
+            return EXIT_FAILURE;
+        }
+        
+        if(checksum_end(&checksum) != EXIT_SUCCESS) {
+            fprintf(stderr, "-- cannot decode record %zu\n", i);
+            return EXIT_FAILURE;
+        }
+        
+        offset += len;
+        offsets[i + 1] = offset;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+int unibinary_encode_string(const char *src, wchar_t **dst, size_t wrap_length) {
+    unibinary_options_t options = { .wrap_length = wrap_length };
+    return unibinary_encode_string_with_options(src, dst, &options);
+}
+
+int unibinary_encode_string_with_options(const char *src, wchar_t **dst, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    *dst = NULL;
+    
+    // encoded as by unibinary_encode_bytes(), whatever the options, then widened
+    uint8_t *encoded;
+    size_t encoded_len;
+    if(unibinary_encode_bytes((const uint8_t *)src, strlen(src), options, &encoded, &encoded_len) != EXIT_SUCCESS) return EXIT_FAILURE;
+    
+    // newlines included
+    size_t characters = 0;
+    for(size_t i = 0; i < encoded_len; i++) characters += (encoded[i] & 0xC0) != 0x80;
+    
+    *dst = allocate(allocator, (characters + 1) * sizeof(wchar_t));
+    if(*dst == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        release(allocator, encoded);
+        return EXIT_FAILURE;
+    }
+    
+    // newlines, and the 2 and 3 bytes sequences of the encoder
+    wchar_t *w = *dst;
+    for(const uint8_t *p = encoded, *end = encoded + encoded_len; p < end; ) {
+        if(*p < 0x80) {
+            *w++ = *p++;
+        } else if (*p < 0xE0) {
+            *w++ = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        } else {
+            *w++ = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            p += 3;
+        }
+    }
+    *w = L'\0';
+    
+    release(allocator, encoded);
+    
+    return EXIT_SUCCESS;
+}
+
+int unibinary_decode_string(const wchar_t *src, char **dst, long *dst_len) {
+    return unibinary_decode_string_with_options(src, dst, dst_len, NULL);
+}
+
+int unibinary_decode_string_with_options(const wchar_t *src, char **dst, long *dst_len, const unibinary_options_t *options) {
+    
+    const unibinary_allocator_t *allocator = allocator_of(options);
+    *dst = NULL;
+    *dst_len = 0;
+    
+    // UTF-8 whatever the locale, characters out of the UniBinary ranges stay invalid
+    size_t src_len = wcslen(src);
+    uint8_t *utf8 = allocate(allocator, 4 * src_len + 1);
+    if(utf8 == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        return EXIT_FAILURE;
+    }
+    
+    uint8_t *o = utf8;
+    for(size_t i = 0; i < src_len; i++) {
+        wchar_t u = src[i];
+        if(u < 0x80) {
+            *o++ = u;
+        } else if (u < 0x10000) {
+            o = put_utf8(o, u);
+        } else {
+            *o++ = 0xFF;
+        }
+    }
+    
+    size_t length;
+    int status = unibinary_decode_bytes_with_options(utf8, o - utf8, options, (uint8_t **)dst, &length);
+    release(allocator, utf8);
+    
+    *dst_len = length;
+    
+    return status;
+}
+
+// copies staged encoded bytes into out, with a newline every wrap_length characters
+static void encoder_flush(unibinary_encoder_t *encoder, uint8_t *out, size_t out_capacity, size_t *produced) {
+    
+    uint8_t *o = out + *produced;
+    uint8_t *o_end = out + out_capacity;
+    const uint8_t *s = encoder->staged + encoder->staged_pos;
+    const uint8_t *s_end = encoder->staged + encoder->staged_len;
+    
+    if(encoder->newline_pending && o < o_end) {
+        *o++ = '\n';
+        encoder->newline_pending = 0;
+    }
+    
+    if(encoder->wrap_length == 0) {
+        size_t n = (size_t)(s_end - s) < (size_t)(o_end - o) ? (size_t)(s_end - s) : (size_t)(o_end - o);
+        memcpy(o, s, n);
+        o += n;
+        s += n;
+    } else if ((size_t)(o_end - o) >= (size_t)(s_end - s) + (s_end - s) / 2 && !encoder->newline_pending && (s == s_end || *s >= 0xC0)) {
+        // whole characters left, wrapped at once
+        o += wrap_utf8(s, s_end - s, o, &encoder->column, encoder->wrap_length);
+        s = s_end;
+    } else if (!encoder->newline_pending) {
+        // byte by byte near the end of out, a character ends before a UTF-8 lead byte
+        while(s < s_end && o < o_end) {
+            *o++ = *s++;
+            
+            if(s < s_end && *s < 0xC0) continue;
+            
+            encoder->column = (encoder->column + 1) % encoder->wrap_length;
+            
+            if(encoder->column == 0) {
+                if(o == o_end) {
+                    encoder->newline_pending = 1;
+                    break;
+                }
+                *o++ = '\n';
+            }
+        }
+    }
+    
+    encoder->staged_pos = s - encoder->staged;
+    *produced = o - out;
+}
+
+// input bytes kept until the tokens at their end are known
+static size_t encoder_pending_capacity(const unibinary_encoder_t *encoder) {
+    return UNIBINARY_STREAM_STEP + carry_capacity(encoder->long_runs, encoder->optimal);
+}
+
+int unibinary_encoder_init(unibinary_encoder_t *encoder, const unibinary_options_t *options) {
+    
+    memset(encoder, 0, sizeof(unibinary_encoder_t));
+    
+    if(version_ok(options) != EXIT_SUCCESS) return EXIT_FAILURE;
+    
+    if(has_index(options)) {
+        fprintf(stderr, "-- no block index when streaming, see unibinary_encode_fd()\n");
+        return EXIT_FAILURE;
+    }
+    encoder->wrap_length = options ? options->wrap_length : 0;
+    encoder->long_runs = is_v2(options);
+    encoder->optimal = options ? options->optimal : 0;
+    encoder->checksum = has_checksum(options);
+    encoder->allocator = allocator_of(options);
+    
+    encoder->pending = allocate(encoder->allocator, encoder_pending_capacity(encoder));
+    encoder->staged = allocate(encoder->allocator, UNIBINARY_ENCODED_MAX_UTF8_LENGTH(encoder_pending_capacity(encoder)));
+    if(encoder->optimal) {
+        encoder->scratch = allocate(encoder->allocator, sizeof(scratch_t));
+        if(encoder->scratch != NULL) *encoder->scratch = (scratch_t){ .allocator = encoder->allocator };
+    }
+    if(encoder->pending == NULL || encoder->staged == NULL || (encoder->optimal && encoder->scratch == NULL)) {
+        fprintf(stderr, "-- malloc error\n");
+        unibinary_encoder_end(encoder);
+        return EXIT_FAILURE;
+    }
+    
+    // written by the first update() or finish()
+    encoder->staged_len = put_header(encoder->staged, options) - encoder->staged;
+    
+    return EXIT_SUCCESS;
+}
+
+// encodes the pending bytes, all of them if is_last, after the staged ones were written
+static void encoder_step(unibinary_encoder_t *encoder, const uint8_t *in, size_t in_len, int is_last, uint8_t *out, size_t out_capacity, size_t *consumed, size_t *produced) {
+    
+    size_t pending_capacity = encoder_pending_capacity(encoder);
+    
+    while(1) {
+        encoder_flush(encoder, out, out_capacity, produced);
+        if(encoder->staged_pos < encoder->staged_len || encoder->newline_pending) break;
+        
+        size_t n = in_len - *consumed < pending_capacity - encoder->pending_len ? in_len - *consumed : pending_capacity - encoder->pending_len;
+        if(n > 0) memcpy(encoder->pending + encoder->pending_len, in + *consumed, n);
+        encoder->pending_len += n;
+        *consumed += n;
+        
+        if(encoder->pending_len == 0 && is_last && encoder->checksum) {
+            // after all the tokens
+            unibinary_options_t options = { .checksum = 1 };
+            encoder->staged_len = put_trailer(encoder->staged, &options, encoder->crc) - encoder->staged;
+            encoder->staged_pos = 0;
+            encoder->checksum = 0;
+            continue;
+        }
+        
+        if(encoder->pending_len == 0) break;
+        
+        size_t used;
+        unibinary_options_t options = { .version = encoder->long_runs ? 2 : 1, .optimal = encoder->optimal, .checksum = encoder->checksum, .allocator = encoder->allocator };
+        encode_tokens_of(&options, encoder->scratch, encoder->pending, encoder->pending_len, is_last && *consumed == in_len, encoder->staged, &used, &encoder->staged_len, &encoder->crc);
+        encoder->staged_pos = 0;
+        
+        if(used == 0) break;
+        
+        encoder->pending_len -= used;
+        memmove(encoder->pending, encoder->pending + used, encoder->pending_len);
+    }
+}
+
+int unibinary_encoder_update(unibinary_encoder_t *encoder, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_capacity, size_t *consumed, size_t *produced) {
+    
+    *consumed = 0;
+    *produced = 0;
+    
+    encoder_step(encoder, in, in_len, 0, out, out_capacity, consumed, produced);
+    
+    return EXIT_SUCCESS;
+}
+
+int unibinary_encoder_finish(unibinary_encoder_t *encoder, uint8_t *out, size_t out_capacity, size_t *produced, int *done) {
+    
+    size_t consumed = 0;
+    *produced = 0;
+    
+    encoder_step(encoder, NULL, 0, 1, out, out_capacity, &consumed, produced);
+    
+    *done = encoder->pending_len == 0 && encoder->staged_pos == encoder->staged_len && !encoder->newline_pending;
+    
+    return EXIT_SUCCESS;
+}
+
+void unibinary_encoder_end(unibinary_encoder_t *encoder) {
+    
+    if(encoder->scratch != NULL) scratch_release(encoder->scratch);
+    release(encoder->allocator, encoder->scratch);
+    release(encoder->allocator, encoder->staged);
+    release(encoder->allocator, encoder->pending);
+    encoder->pending = NULL;
+    encoder->staged = NULL;
+    encoder->scratch = NULL;
+}
+
+int unibinary_decoder_init(unibinary_decoder_t *decoder) {
+    return unibinary_decoder_init_with_options(decoder, NULL);
+}
+
+int unibinary_decoder_init_with_options(unibinary_decoder_t *decoder, const unibinary_options_t *options) {
+    
+    memset(decoder, 0, sizeof(unibinary_decoder_t));
+    decoder->allocator = allocator_of(options);
+    
+    decoder->pending = allocate(decoder->allocator, UNIBINARY_STREAM_STEP + UNIBINARY_MAX_TOKEN_LENGTH);
+    decoder->staged = allocate(decoder->allocator, UNIBINARY_V2_MAX_REPEATS + 1);
+    if(decoder->pending == NULL || decoder->staged == NULL) {
+        fprintf(stderr, "-- malloc error\n");
+        unibinary_decoder_end(decoder);
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+// decodes the pending characters, all of them if is_last, after the staged bytes were written
+static int decoder_step(unibinary_decoder_t *decoder, const uint8_t *in, size_t in_len, int is_last, uint8_t *out, size_t out_capacity, size_t *consumed, size_t *produced) {
+    
+    size_t pending_capacity = UNIBINARY_STREAM_STEP + UNIBINARY_MAX_TOKEN_LENGTH;
+    
+    while(1) {
+        size_t staged_left = decoder->staged_len - decoder->staged_pos;
+        size_t n = staged_left < out_capacity - *produced ? staged_left : out_capacity - *produced;
+        memcpy(out + *produced, decoder->staged + decoder->staged_pos, n);
+        decoder->staged_pos += n;
+        *produced += n;
+        
+        if(decoder->staged_pos < decoder->staged_len) break;
+        
+        n = in_len - *consumed < pending_capacity - decoder->pending_len ? in_len - *consumed : pending_capacity - decoder->pending_len;
+        if(n > 0) memcpy(decoder->pending + decoder->pending_len, in + *consumed, n);
+        decoder->pending_len += n;
+        *consumed += n;
+        
+        if(decoder->pending_len == 0) break;
+        
+        // a run can need 0xFFF bytes, short outputs go through the staging area, and so do v2 runs which do not fit
+        int is_last_input = is_last && *consumed == in_len;
+        int direct = out_capacity - *produced >= UNIBINARY_MAX_REPEATS;
+        size_t used = 0, len = 0;
+        int status = EXIT_SUCCESS;
+        checksum_t checksum = { decoder->checksum, decoder->crc };
+        
+        if(direct) {
+            status = decode_tokens(decoder->pending, decoder->pending_len, is_last_input, out + *produced, out_capacity - *produced, 0, &checksum, &used, &len);
+            *produced += len;
+            direct = used > 0 || len > 0 || status != EXIT_SUCCESS;
+        }
+        
+        if(!direct) {
+            status = decode_tokens(decoder->pending, decoder->pending_len, is_last_input, decoder->staged, UNIBINARY_V2_MAX_REPEATS + 1, 0, &checksum, &used, &len);
+            decoder->staged_len = len;
+            decoder->staged_pos = 0;
+        }
+        
+        decoder->checksum = checksum.active;
+        decoder->crc = checksum.crc;
+        
+        // newlines are dropped from the carried bytes, a token can be split by any number of them
+        size_t kept = 0;
+        for(size_t i = used; i < decoder->pending_len; i++) {
+            if(decoder->pending[i] != '\n') decoder->pending[kept++] = decoder->pending[i];
+        }
+        size_t dropped = decoder->pending_len - used - kept;
+        
+        decoder->offset += used;
+        decoder->pending_len = kept;
+        
+        if(status != EXIT_SUCCESS) {
+            fprintf(stderr, "-- cannot decode character at offset %zu\n", decoder->offset);
+            return EXIT_FAILURE;
+        }
+        
+        // the dropped newlines count in the offsets of the next errors
+        decoder->offset += dropped;
+        
+        if(used == 0 && len == 0 && dropped == 0) break;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+int unibinary_decoder_update(unibinary_decoder_t *decoder, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_capacity, size_t *consumed, size_t *produced) {
+    
+    *consumed = 0;
+    *produced = 0;
+    
+    return decoder_step(decoder, in, in_len, 0, out, out_capacity, consumed, produced);
+}
+
+int unibinary_decoder_finish(unibinary_decoder_t *decoder, uint8_t *out, size_t out_capacity, size_t *produced, int *done) {
+    
+    size_t consumed = 0;
+    *produced = 0;
+    
+    int status = decoder_step(decoder, NULL, 0, 1, out, out_capacity, &consumed, produced);
+    
+    *done = status == EXIT_SUCCESS && decoder->pending_len == 0 && decoder->staged_pos == decoder->staged_len;
+    
+    if(*done) {
+        checksum_t checksum = { decoder->checksum, decoder->crc };
+        status = checksum_end(&checksum);
+        *done = status == EXIT_SUCCESS;
+    }
+    
+    return status;
+}
+
+void unibinary_decoder_end(unibinary_decoder_t *decoder) {
+    
+    release(decoder->allocator, decoder->staged);
+    release(decoder->allocator, decoder->pending);
+    decoder->pending = NULL;
+    decoder->staged = NULL;
 }
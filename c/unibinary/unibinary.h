@@ -7,19 +7,240 @@
 //
 
 #include <stdint.h>
+#include <stdio.h>
 #include <wchar.h>
 
 #ifndef unibinary_unibinary_h
 #define unibinary_unibinary_h
 
+// the library has no global state and does not depend on the locale, its functions can be called from many threads at once
+// UTF-8 in and out, wchar_t values are code points
+
+// counters of what the codec did, for one call or added up over many
+
+typedef struct {
+    // tokens of the encoded text, as written by the encoder or read by the decoder
+    uint64_t runs;          // U8 U12b, and v2 long runs
+    uint64_t long_runs;     // v2 long runs, also in runs
+    uint64_t run_bytes;     // bytes repeated by all runs
+    uint64_t pairs;         // U12a, 2 ASCII bytes
+    uint64_t triples;       // U12b U12b, 3 bytes
+    uint64_t singles;       // U8 alone or in U8 U8, 1 byte each
+    uint64_t newlines;      // breaking lines of wrap_length characters
+    // input and output
+    uint64_t reads;         // fread(), read() or io_uring reads, none for mapped files
+    uint64_t writes;
+    uint64_t bytes_read;    // mapped files included
+    uint64_t bytes_written;
+    // nanoseconds
+    uint64_t read_ns;       // waiting for input
+    uint64_t codec_ns;      // encoding or decoding, on all threads at once
+    uint64_t write_ns;      // wrapping lines and waiting for output
+} unibinary_stats_t;
+
+// used by the functions given one in their options for all their buffers, the returned ones included, which the caller releases with it
+
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size); // NULL on failure, aligned as malloc() would
+    void (*free)(void *ctx, void *p);       // p is never NULL
+    void *ctx;
+} unibinary_allocator_t;
+
+// a bump allocator for many calls, whose allocations are released all at once, on one thread at a time
+// free() takes back allocations in the reverse order of their allocation, as the temporary buffers of a call are
+// allocator.ctx points to the arena, which must not be moved after init()
+
+typedef struct unibinary_arena_chunk unibinary_arena_chunk_t;
+
+typedef struct {
+    unibinary_allocator_t allocator;
+    size_t chunk_size;
+    unibinary_arena_chunk_t *chunks; // the current one first
+} unibinary_arena_t;
+
+// chunk_size bytes are allocated by the first allocation, more chunks when they are full, at least as large as what they hold
+void unibinary_arena_init(unibinary_arena_t *arena, size_t chunk_size);
+// releases everything allocated, and merges the chunks into a single one for the next allocations
+void unibinary_arena_reset(unibinary_arena_t *arena);
+void unibinary_arena_end(unibinary_arena_t *arena);
+
+// options
+
+// the parallel codecs read a chunk of 1 MB per thread at once
+#define UNIBINARY_MAX_THREADS 64
+
+typedef struct {
+    size_t wrap_length;   // characters per line, 0 for a single line
+    unsigned int threads; // 0 or 1 to encode or decode on the calling thread, capped at UNIBINARY_MAX_THREADS
+    int sparse;           // decoding into a regular file leaves holes for long runs of zeros instead of writing them
+    unsigned int version; // 0 or 1 for the original format, 2 for a header and runs of up to 0xFFFFF bytes, see README, encoders fail on later ones
+    int optimal;          // encodes into the fewest characters of each window of input through a slower parse, instead of greedily, see README
+    int checksum;         // v2 followed by the CRC32C of the data, checked by the decoders, see README
+    size_t block_size;    // v2 with a token boundary every block_size bytes, up to 0xFFFFFF, followed by their index for unibinary_decode_range(), 0 for none
+    unibinary_stats_t *stats; // when not NULL, the FILE *, fd, path and bytes functions add to it, it is not cleared
+    const unibinary_allocator_t *allocator; // NULL for malloc() and free()
+} unibinary_options_t;
+
 // encode
 
 int unibinary_encode(FILE *fd_in, FILE *fd_out, size_t wrap_length);
 int unibinary_encode_string(const char* src, wchar_t **dst, size_t wrap_length);
+int unibinary_encode_string_with_options(const char* src, wchar_t **dst, const unibinary_options_t *options);
+
+// with threads > 1, chunks are encoded in parallel and spliced into the same output as unibinary_encode()
+int unibinary_encode_with_options(FILE *fd_in, FILE *fd_out, const unibinary_options_t *options);
+
+// maps the file at path and writes to fd_out without stdio, falls back to unibinary_encode_with_options()
+int unibinary_encode_path(const char *path, int fd_out, const unibinary_options_t *options);
+
+// reads the next chunk of fd_in and writes the previous one to fd_out while one is encoded, without stdio
+// through io_uring on Linux kernels which allow it, else through a thread per read and per write
+int unibinary_encode_fd(int fd_in, int fd_out, const unibinary_options_t *options);
+
+// latest format version of the encoders
+#define UNIBINARY_MAX_VERSION 2
+
+// worst case number of characters for encoding n bytes, see README
+#define UNIBINARY_ENCODED_MAX_LENGTH(n) ((n) / 3 * 2 + ((n) % 3) + 2)
+
+// encodes src into dst, which must hold UNIBINARY_ENCODED_MAX_LENGTH(src_len) characters
+// unless is_last is set, stops before the trailing bytes whose encoding depends on what comes next
+int unibinary_encode_buffer(const uint8_t *src, size_t src_len, int is_last, wchar_t *dst, size_t *src_used, size_t *dst_len);
+
+// same as unibinary_encode_buffer() but writes UTF-8
+#define UNIBINARY_ENCODED_MAX_UTF8_LENGTH(n) (3 * UNIBINARY_ENCODED_MAX_LENGTH(n))
+int unibinary_encode_buffer_utf8(const uint8_t *src, size_t src_len, int is_last, uint8_t *dst, size_t *src_used, size_t *dst_len);
+
+// worst case number of bytes with a newline every wrap_length characters
+#define UNIBINARY_ENCODED_MAX_UTF8_WRAPPED_LENGTH(n, wrap_length) (UNIBINARY_ENCODED_MAX_UTF8_LENGTH(n) + ((wrap_length) ? UNIBINARY_ENCODED_MAX_LENGTH(n) / (wrap_length) : 0))
+
+// encodes src_len bytes into a malloc'd UTF-8 string of exactly dst_len bytes plus a NUL, options may be NULL, *dst is NULL on failure
+// the string is not shrunk to its length when it comes from an allocator
+int unibinary_encode_bytes(const uint8_t *src, size_t src_len, const unibinary_options_t *options, uint8_t **dst, size_t *dst_len);
+
+// same into dst, unibinary_encoded_length_max() bytes are never too small
+// smaller buffers go through a counting pass and a copy, and fail under unibinary_encoded_length()
+int unibinary_encode_bytes_into(const uint8_t *src, size_t src_len, const unibinary_options_t *options, uint8_t *dst, size_t dst_capacity, size_t *dst_len);
+
+// exact number of characters, and of UTF-8 bytes with the newlines of options, NULL for none
+size_t unibinary_encoded_characters(const uint8_t *src, size_t src_len);
+size_t unibinary_encoded_length(const uint8_t *src, size_t src_len, const unibinary_options_t *options);
+
+// worst case UTF-8 bytes, in constant time
+size_t unibinary_encoded_length_max(size_t src_len, const unibinary_options_t *options);
 
 // decode
 
 int unibinary_decode(FILE *src, FILE *dst);
 int unibinary_decode_string(const wchar_t *src, char **dst, long *dst_len);
+int unibinary_decode_string_with_options(const wchar_t *src, char **dst, long *dst_len, const unibinary_options_t *options);
+
+// with threads > 1, chunks are split on token boundaries and decoded in parallel
+// regular files are written in place with pwrite(), other outputs in order
+int unibinary_decode_with_options(FILE *src, FILE *dst, const unibinary_options_t *options);
+
+// maps the file at path and writes to fd_out without stdio, falls back to unibinary_decode_with_options()
+int unibinary_decode_path(const char *path, int fd_out, const unibinary_options_t *options);
+
+// same pipeline as unibinary_encode_fd()
+int unibinary_decode_fd(int fd_in, int fd_out, const unibinary_options_t *options);
+
+// decodes UTF-8 src into dst, newlines are ignored
+// stops before a token that is not complete unless is_last is set, or that does not fit in dst
+// on error, src_used is the offset of the character that cannot be decoded
+// checksum trailers are skipped without being checked, the other decoders check them
+int unibinary_decode_buffer(const uint8_t *src, size_t src_len, int is_last, uint8_t *dst, size_t dst_capacity, size_t *src_used, size_t *dst_len);
+
+// decodes UTF-8 src into a malloc'd buffer of exactly dst_len bytes plus a NUL, *dst is NULL on failure
+int unibinary_decode_bytes(const uint8_t *src, size_t src_len, uint8_t **dst, size_t *dst_len);
+int unibinary_decode_bytes_with_options(const uint8_t *src, size_t src_len, const unibinary_options_t *options, uint8_t **dst, size_t *dst_len);
+
+// same into dst, fails if the decoded bytes don't fit
+int unibinary_decode_bytes_into(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_capacity, size_t *dst_len);
+
+// decodes bytes [from, to) of a text encoded with a block_size, from the blocks they are in, to is capped at the decoded length
+// src can be a mapped file, only its index and these blocks are read, checksums are not checked
+int unibinary_decode_range(const uint8_t *src, size_t src_len, size_t from, size_t to, uint8_t *dst, size_t dst_capacity, size_t *dst_len);
+int unibinary_decode_range_with_options(const uint8_t *src, size_t src_len, size_t from, size_t to, const unibinary_options_t *options, uint8_t *dst, size_t dst_capacity, size_t *dst_len);
+
+// exact number of decoded bytes, fails on invalid input
+int unibinary_decoded_length(const uint8_t *src, size_t src_len, size_t *dst_len);
+
+// checks that src decodes, without decoding it, 0 or EXIT_FAILURE
+// error_offset is the byte offset of the first character which is invalid or starts an invalid or truncated token, src_len if there is none
+// checksums are not checked, that takes decoding
+int unibinary_validate(const uint8_t *src, size_t src_len, size_t *error_offset);
+
+// same for all of fd_in, read in chunks
+int unibinary_validate_fd(int fd_in, size_t *error_offset);
+int unibinary_validate_fd_with_options(int fd_in, const unibinary_options_t *options, size_t *error_offset);
+
+// worst case number of decoded bytes, every 11 UTF-8 bytes being a v2 run of 0xFFFFF bytes and the rest runs of 0xFFF bytes, in constant time
+#define UNIBINARY_DECODED_MAX_LENGTH(n) ((n) / 11 * 0xFFFFF + ((n) % 11) / 5 * 0xFFF + 2)
+size_t unibinary_decoded_length_max(size_t src_len);
+
+// streaming, in the style of zlib
+// update() takes as much input as out can hold the encoding of, finish() writes the rest, call it again until done
+// pending and staged are internal buffers, allocated by init() and freed by end()
+
+typedef struct {
+    size_t wrap_length;
+    int long_runs;          // v2, the header is staged by init()
+    int optimal;
+    int checksum;           // the trailer is staged once all the input is, then this is cleared
+    uint32_t crc;           // CRC32C of the input encoded so far
+    size_t column;          // characters on the current line
+    int newline_pending;    // the line is full but out was
+    uint8_t *pending;       // input bytes whose tokens depend on the next ones, such as a run of less than 0xFFF bytes, 0xFFFFF for v2
+    size_t pending_len;
+    uint8_t *staged;        // encoded bytes not yet written to out
+    size_t staged_len;
+    size_t staged_pos;
+    const unibinary_allocator_t *allocator; // of pending, staged and scratch
+    struct unibinary_scratch *scratch; // of the optimal parse, kept between steps
+} unibinary_encoder_t;
+
+// fails with a block_size, only the fd, path, FILE * and bytes encoders write an index
+int unibinary_encoder_init(unibinary_encoder_t *encoder, const unibinary_options_t *options);
+int unibinary_encoder_update(unibinary_encoder_t *encoder, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_capacity, size_t *consumed, size_t *produced);
+int unibinary_encoder_finish(unibinary_encoder_t *encoder, uint8_t *out, size_t out_capacity, size_t *produced, int *done);
+void unibinary_encoder_end(unibinary_encoder_t *encoder);
+
+typedef struct {
+    uint8_t *pending;       // input bytes of an incomplete token or UTF-8 sequence
+    size_t pending_len;
+    uint8_t *staged;        // decoded bytes not yet written to out, a v2 long run at most
+    size_t staged_len;
+    size_t staged_pos;
+    size_t offset;          // of pending[0] in the input, newlines dropped from pending counted before it, for errors
+    int checksum;           // a header with the checksum feature was read, and not yet its trailer
+    uint32_t crc;           // CRC32C of the bytes decoded since
+    const unibinary_allocator_t *allocator; // of pending and staged
+} unibinary_decoder_t;
+
+int unibinary_decoder_init(unibinary_decoder_t *decoder);
+// only the allocator of options is used
+int unibinary_decoder_init_with_options(unibinary_decoder_t *decoder, const unibinary_options_t *options);
+int unibinary_decoder_update(unibinary_decoder_t *decoder, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_capacity, size_t *consumed, size_t *produced);
+int unibinary_decoder_finish(unibinary_decoder_t *decoder, uint8_t *out, size_t out_capacity, size_t *produced, int *done);
+void unibinary_decoder_end(unibinary_decoder_t *decoder);
+
+// batches of small records, encoded or decoded in one call into a single arena
+// record i is written at arena + offsets[i] and is offsets[i + 1] - offsets[i] bytes long, offsets has count + 1 entries
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+} unibinary_record_t;
+
+// arena bytes which are always enough for unibinary_encode_batch()
+size_t unibinary_encode_batch_max(const unibinary_record_t *records, size_t count, const unibinary_options_t *options);
+
+// when fits is not NULL, fits[i] is set if record i takes at most max_characters characters, newlines excluded
+// such as 140 for a tweet
+int unibinary_encode_batch(const unibinary_record_t *records, size_t count, const unibinary_options_t *options, uint8_t *arena, size_t arena_capacity, size_t *offsets, size_t max_characters, uint8_t *fits);
+
+// fails on the first record which cannot be decoded or does not fit in the arena
+int unibinary_decode_batch(const unibinary_record_t *records, size_t count, uint8_t *arena, size_t arena_capacity, size_t *offsets);
 
 #endif
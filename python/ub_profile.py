@@ -4,16 +4,18 @@
 """
 UniBinary profiling
 
-$ python ub_profile.py
+$ python ub_profile.py [path]
 """
 
 from unibinary import *
-import hotshot
-from hotshot import stats
+import sys
+import cProfile
+import pstats
+
+path = "/bin/ls" # any file ~ 800 KB
 
 def profile_encode_file():
-    #f = open("/usr/bin/true", "rb")
-    f = open("/Users/nst/Desktop/sc.png", "rb") # any file ~ 800 KB
+    f = open(path, "rb")
     bytes = f.read()
     f.close()
     
@@ -37,13 +39,15 @@ def profile_decode_file():
 
 if __name__ == '__main__':
 
+    if len(sys.argv) > 1:
+        path = sys.argv[1]
+
     for f in [profile_encode_file, profile_decode_file]:
     
-        prof = hotshot.Profile("hotshot_stats.prof")
+        prof = cProfile.Profile()
         prof.runcall(f)
-        prof.close()
         
-        s = stats.load("hotshot_stats.prof")
+        s = pstats.Stats(prof)
         s.strip_dirs()
         s.sort_stats('time', 'calls')
         s.print_stats(20)